@@ -18,6 +18,8 @@
 static Athlete *This;
 
 Athlete::Athlete(AthleteId aid) : aky(aid) {
+  // most lookups of an id that is not there skip the index search
+  aky.SetFilter(0.01);
   // if class not derived from Athlete
   if (aid != -1) {
     LoadObject();
@@ -12,25 +12,40 @@
  */
 
 #include "stdafx.h"
+#include <set>
+#include <tuple>
 #include "AthleteOperations.h"
 
+typedef std::tuple<AthleteId, std::string, unsigned short, std::string> Row;
+
+// an athlete's fields, the strings up to the padding Input adds
+static Row AthleteRow(const Athlete &at) {
+  return Row(at.GetANo(), at.GetName().c_str(), at.GetRecord(), at.GetRDate().c_str());
+}
+
 // add athlete objects
 void AddAthlete(std::unique_ptr<std::unordered_multimap<int, st_ath>> atls) {
   Athlete *athlete;
-  AthleteId id = 0;
+
+  // the athletes already on the datastore, which are not added again
+  std::set<Row> rows;
+  {
+    Athlete athl;
+    athl.FirstObject();
+    while (athl.ObjectExists()) {
+      rows.insert(AthleteRow(athl));
+      athl.NextObject();
+    }
+  }
 
   for (std::unordered_multimap<int, st_ath>::iterator it = atls->begin();
     it != atls->end(); ++it) {
-    athlete = Athlete::Get(++id);
-    if (athlete->ObjectExists()) {
-      /*
-      Athlete::Header();
-      std::cout << *athlete << std::endl;
-      std::cerr << "This Athlete is already on datastore\n";
-      */
-    } else {
-      athlete->InputANo(it->first);
-      athlete->Input(std::move(it->second));
+    athlete = new Athlete;
+    athlete->InputANo(it->first);
+    athlete->Input(std::move(it->second));
+    if (rows.insert(AthleteRow(*athlete)).second) {
+      // the athlete id comes from the class sequence
+      athlete->SetAId(athlete->NextSequence());
       if (!athlete->AddObject()) {
         std::cerr << "Add disallowed\n";
       }
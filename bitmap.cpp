@@ -0,0 +1,334 @@
+/*
+ * filename: bitmap.cpp
+ * describe: This is the implementation file of the object address bitmap
+ *           and of the bitmap index, used by the datastore engine -
+ *           EDatastore of the open source project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   No dependency. Handy
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#include "stdafx.h"
+#include <string>
+#include <algorithm>
+#include "edatastore.h"
+
+// words of a bitmap with a bit for every node number
+const int bitmapwords = 65536 / 64;
+
+// most addresses kept in an array, it takes as many bytes as the bits
+const unsigned int arraymax = bitmapwords * sizeof(unsigned long long) / sizeof(NodeNbr);
+
+// the kinds of a saved bitmap
+const char arraybitmap = 0;
+const char bitsbitmap = 1;
+
+// number of bits set in a word
+static int BitCount(unsigned long long w) {
+  int n = 0;
+  for (; w != 0; w &= w - 1) {
+    n++;
+  }
+  return n;
+}
+
+void Bitmap::Clear() {
+  array.clear();
+  bits.clear();
+  count = 0;
+}
+
+// set the bitmap to ascending addresses
+void Bitmap::Assign(const std::vector<NodeNbr> &addrs) {
+  Clear();
+  array = addrs;
+  Optimize();
+}
+
+// change an array to bits
+void Bitmap::ToBits() {
+  if (bits.empty()) {
+    bits.assign(bitmapwords, 0);
+    for (std::vector<NodeNbr>::size_type i = 0; i < array.size(); i++) {
+      bits[array[i] >> 6] |= 1ULL << (array[i] & 63);
+    }
+    count = array.size();
+    array.clear();
+  }
+}
+
+// keep the smaller of an array and bits
+void Bitmap::Optimize() {
+  if (bits.empty() && array.size() > arraymax) {
+    ToBits();
+  } else if (!bits.empty() && count <= arraymax) {
+    array.clear();
+    for (int w = 0; w < bitmapwords; w++) {
+      for (unsigned long long word = bits[w]; word != 0; word &= word - 1) {
+        unsigned long long low = word & (~word + 1);
+        array.push_back(static_cast<NodeNbr>(w * 64 + BitCount(low - 1)));
+      }
+    }
+    bits.clear();
+  }
+}
+
+void Bitmap::Add(NodeNbr nd) {
+  if (bits.empty()) {
+    std::vector<NodeNbr>::iterator it = std::lower_bound(array.begin(), array.end(), nd);
+    if (it == array.end() || *it != nd) {
+      array.insert(it, nd);
+      Optimize();
+    }
+  } else if (!Bit(nd)) {
+    bits[nd >> 6] |= 1ULL << (nd & 63);
+    count++;
+  }
+}
+
+// remove an address, false if it is not there
+bool Bitmap::Remove(NodeNbr nd) {
+  if (bits.empty()) {
+    std::vector<NodeNbr>::iterator it = std::lower_bound(array.begin(), array.end(), nd);
+    if (it == array.end() || *it != nd) {
+      return false;
+    }
+    array.erase(it);
+  } else {
+    if (!Bit(nd)) {
+      return false;
+    }
+    bits[nd >> 6] &= ~(1ULL << (nd & 63));
+    count--;
+    Optimize();
+  }
+  return true;
+}
+
+bool Bitmap::Contains(NodeNbr nd) const {
+  if (bits.empty()) {
+    return std::binary_search(array.begin(), array.end(), nd);
+  }
+  return Bit(nd);
+}
+
+// the lowest address, 0 if there is none
+NodeNbr Bitmap::First() const {
+  if (bits.empty()) {
+    return array.empty() ? 0 : array[0];
+  }
+  for (int w = 0; w < bitmapwords; w++) {
+    if (bits[w] != 0) {
+      unsigned long long low = bits[w] & (~bits[w] + 1);
+      return static_cast<NodeNbr>(w * 64 + BitCount(low - 1));
+    }
+  }
+  return 0;
+}
+
+// the addresses, ascending
+void Bitmap::Addresses(std::vector<NodeNbr> &addrs) const {
+  if (bits.empty()) {
+    addrs = array;
+    return;
+  }
+  addrs.clear();
+  addrs.reserve(count);
+  for (int w = 0; w < bitmapwords; w++) {
+    for (unsigned long long word = bits[w]; word != 0; word &= word - 1) {
+      unsigned long long low = word & (~word + 1);
+      addrs.push_back(static_cast<NodeNbr>(w * 64 + BitCount(low - 1)));
+    }
+  }
+}
+
+// keep the addresses that are in both bitmaps
+Bitmap &Bitmap::operator&=(const Bitmap &bm) {
+  if (!bits.empty() && !bm.bits.empty()) {
+    count = 0;
+    for (int w = 0; w < bitmapwords; w++) {
+      bits[w] &= bm.bits[w];
+      count += BitCount(bits[w]);
+    }
+  } else {
+    // an array is the result, test its addresses
+    if (!bits.empty()) {
+      array = bm.array;
+      std::vector<unsigned long long> mine;
+      mine.swap(bits);
+      std::vector<NodeNbr>::size_type n = 0;
+      for (std::vector<NodeNbr>::size_type i = 0; i < array.size(); i++) {
+        if ((mine[array[i] >> 6] >> (array[i] & 63)) & 1) {
+          array[n++] = array[i];
+        }
+      }
+      array.resize(n);
+      return *this;
+    }
+    std::vector<NodeNbr>::size_type n = 0;
+    for (std::vector<NodeNbr>::size_type i = 0; i < array.size(); i++) {
+      if (bm.Contains(array[i])) {
+        array[n++] = array[i];
+      }
+    }
+    array.resize(n);
+  }
+  Optimize();
+  return *this;
+}
+
+// add the addresses of another bitmap
+Bitmap &Bitmap::operator|=(const Bitmap &bm) {
+  if (bits.empty() && bm.bits.empty() && array.size() + bm.array.size() <= arraymax) {
+    std::vector<NodeNbr> merged;
+    merged.reserve(array.size() + bm.array.size());
+    std::set_union(array.begin(), array.end(), bm.array.begin(), bm.array.end(),
+                   std::back_inserter(merged));
+    array.swap(merged);
+    return *this;
+  }
+  ToBits();
+  if (bm.bits.empty()) {
+    for (std::vector<NodeNbr>::size_type i = 0; i < bm.array.size(); i++) {
+      bits[bm.array[i] >> 6] |= 1ULL << (bm.array[i] & 63);
+    }
+  } else {
+    for (int w = 0; w < bitmapwords; w++) {
+      bits[w] |= bm.bits[w];
+    }
+  }
+  count = 0;
+  for (int w = 0; w < bitmapwords; w++) {
+    count += BitCount(bits[w]);
+  }
+  Optimize();
+  return *this;
+}
+
+// remove the addresses of another bitmap
+Bitmap &Bitmap::operator-=(const Bitmap &bm) {
+  if (bits.empty()) {
+    std::vector<NodeNbr>::size_type n = 0;
+    for (std::vector<NodeNbr>::size_type i = 0; i < array.size(); i++) {
+      if (!bm.Contains(array[i])) {
+        array[n++] = array[i];
+      }
+    }
+    array.resize(n);
+    return *this;
+  }
+  if (bm.bits.empty()) {
+    for (std::vector<NodeNbr>::size_type i = 0; i < bm.array.size(); i++) {
+      if (Bit(bm.array[i])) {
+        bits[bm.array[i] >> 6] &= ~(1ULL << (bm.array[i] & 63));
+        count--;
+      }
+    }
+  } else {
+    count = 0;
+    for (int w = 0; w < bitmapwords; w++) {
+      bits[w] &= ~bm.bits[w];
+      count += BitCount(bits[w]);
+    }
+  }
+  Optimize();
+  return *this;
+}
+
+// a saved bitmap is its kind followed by the array or the bits
+void Bitmap::Save(std::string &buf) const {
+  if (bits.empty()) {
+    buf.assign(1, arraybitmap);
+    if (!array.empty()) {
+      buf.append(reinterpret_cast<const char *>(&array[0]), array.size() * sizeof(NodeNbr));
+    }
+  } else {
+    buf.assign(1, bitsbitmap);
+    buf.append(reinterpret_cast<const char *>(&bits[0]), bitmapwords * sizeof(unsigned long long));
+  }
+}
+
+bool Bitmap::Load(const std::string &buf) {
+  Clear();
+  if (buf.empty()) {
+    return false;
+  }
+  if (buf[0] == arraybitmap) {
+    array.resize((buf.size() - 1) / sizeof(NodeNbr));
+    if (!array.empty()) {
+      memcpy(&array[0], buf.data() + 1, array.size() * sizeof(NodeNbr));
+    }
+    return true;
+  }
+  if (buf[0] != bitsbitmap || buf.size() != 1 + bitmapwords * sizeof(unsigned long long)) {
+    return false;
+  }
+  bits.resize(bitmapwords);
+  memcpy(&bits[0], buf.data() + 1, bitmapwords * sizeof(unsigned long long));
+  for (int w = 0; w < bitmapwords; w++) {
+    count += BitCount(bits[w]);
+  }
+  return true;
+}
+
+// the objects of a key in a bitmap. The lowest address is in the
+// key, a key with more objects has them all in a saved bitmap
+void BitmapIndex::ReadBitmap(const EdsKey *entry, Bitmap &bm) {
+  bm.Clear();
+  if (entry->postings == 0) {
+    bm.Add(entry->fileaddr);
+    return;
+  }
+  std::string buf;
+  ReadChain(entry->postings, buf);
+  bm.Load(buf);
+}
+
+void BitmapIndex::WriteBitmap(EdsKey *entry, const Bitmap &bm) {
+  std::string buf;
+  if (bm.Count() > 1) {
+    bm.Save(buf);
+  }
+  entry->fileaddr = bm.First();
+  entry->postings = WriteChain(entry->postings, buf);
+}
+
+void BitmapIndex::ReadPostings(const EdsKey *entry, std::vector<NodeNbr> &addrs) {
+  Bitmap bm;
+  ReadBitmap(entry, bm);
+  bm.Addresses(addrs);
+}
+
+// the objects of a key from their ascending addresses
+void BitmapIndex::WritePostings(EdsKey *entry, const std::vector<NodeNbr> &addrs) {
+  Bitmap bm;
+  bm.Assign(addrs);
+  WriteBitmap(entry, bm);
+}
+
+// add an object to a key, false if it is there
+bool BitmapIndex::AddPosting(EdsKey *entry, NodeNbr fa) {
+  Bitmap bm;
+  ReadBitmap(entry, bm);
+  if (bm.Contains(fa)) {
+    return false;
+  }
+  bm.Add(fa);
+  WriteBitmap(entry, bm);
+  return true;
+}
+
+// remove an object from a key, false if it is not there or is the
+// key's only object
+bool BitmapIndex::RemovePosting(EdsKey *entry, NodeNbr fa) {
+  Bitmap bm;
+  ReadBitmap(entry, bm);
+  if (bm.Count() == 1 || !bm.Remove(fa)) {
+    return false;
+  }
+  WriteBitmap(entry, bm);
+  return true;
+}
@@ -0,0 +1,70 @@
+/*
+ * filename: bitmap.h
+ * describe: This is the definition file of the object address bitmap and
+ *           of the bitmap index, used by the datastore engine - EDatastore
+ *           of the open source project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   No dependency. Handy
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+// a set of object addresses. An address is a node number, so the set
+// is one container of a roaring bitmap: a sorted array of addresses
+// while there are few of them and a bit for every node number when
+// there are many. The addresses come out ascending, in file order
+class Bitmap {
+public:
+  Bitmap() : count(0) {}
+
+  void Clear();
+  void Assign(const std::vector<NodeNbr> &addrs);
+  void Add(NodeNbr nd);
+  bool Remove(NodeNbr nd);
+  bool Contains(NodeNbr nd) const;
+  unsigned int Count() const {
+    return bits.empty() ? array.size() : count;
+  }
+  NodeNbr First() const;
+  void Addresses(std::vector<NodeNbr> &addrs) const;
+
+  // set operations: and, or, and not
+  Bitmap &operator&=(const Bitmap &bm);
+  Bitmap &operator|=(const Bitmap &bm);
+  Bitmap &operator-=(const Bitmap &bm);
+
+  void Save(std::string &buf) const;
+  bool Load(const std::string &buf);
+private:
+  void ToBits();
+  void Optimize();
+  bool Bit(NodeNbr nd) const {
+    return (bits[nd >> 6] >> (nd & 63)) & 1;
+  }
+private:
+  std::vector<NodeNbr> array;           // the addresses, ascending
+  std::vector<unsigned long long> bits; // or a bit for each address
+  unsigned int count;                   // addresses in bits
+};
+
+// b-tree of key values that keeps the objects of each value in a
+// bitmap, for keys with few values shared by many objects
+class BitmapIndex : public EdsBtree {
+public:
+  BitmapIndex(IndexFile &ndx, Class *cls, EdsKey *ky) : EdsBtree(ndx, cls, ky) {}
+protected:
+  void ReadPostings(const EdsKey *entry, std::vector<NodeNbr> &addrs);
+  void ReadBitmap(const EdsKey *entry, Bitmap &bm);
+  void WritePostings(EdsKey *entry, const std::vector<NodeNbr> &addrs);
+  bool AddPosting(EdsKey *entry, NodeNbr fa);
+  bool RemovePosting(EdsKey *entry, NodeNbr fa);
+private:
+  void WriteBitmap(EdsKey *entry, const Bitmap &bm);
+};
+
+#endif
@@ -13,8 +13,130 @@
 
 #include "stdafx.h"
 #include <string>
+#include <algorithm>
+#include <cmath>
 #include "edatastore.h"
 
+// a saved key filter starts with this, then its counts and bits
+const unsigned int filtermagic = 0x46534445;
+const int filterhdr = 5 * sizeof(unsigned int);
+
+// fewest keys a key filter is sized for
+const unsigned int filterkeys = 1024;
+
+// changes the change buffer holds before they go into the tree
+const unsigned int bufferkeys = 4096;
+
+// a short posting list is packed in a node with others of its tree:
+// after the magic come the lists, each one the address of the key's
+// first object, the count of its bytes and the bytes. A longer one
+// has a chain of its own, after the magic its last node and its last
+// address, so an object with a higher address is appended in place
+const unsigned int packmagic = 0x50534445;
+const unsigned int postmagic = 0x43534445;
+const int packhdr = sizeof(NodeNbr) + 1;
+const int posthdr = sizeof(unsigned int) + 2 * sizeof(NodeNbr);
+const std::string::size_type packlimit = 64;
+
+// build a key filter for a false positive rate
+KeyFilter::KeyFilter(double fprate) {
+  const double ln2 = std::log(2.0);
+  fprate = std::min(std::max(fprate, 1e-6), 0.5);
+  bitsperkey = -std::log(fprate) / (ln2 * ln2);
+  hashes = static_cast<unsigned int>(bitsperkey * ln2 + 0.5);
+  hashes = std::min(std::max(hashes, 1u), 16u);
+  Reset(0);
+  built = false;
+}
+
+// empty the filter and size it for twice keycount keys
+void KeyFilter::Reset(unsigned int keycount) {
+  capacity = std::max(keycount * 2, filterkeys);
+  keys = deleted = 0;
+  built = true;
+  bits.assign(static_cast<std::vector<unsigned char>::size_type>(
+                  capacity * bitsperkey / 8) + 1, 0);
+}
+
+unsigned long long KeyHash(const std::string &image) {
+  unsigned long long h = 14695981039346656037ULL;
+  for (std::string::size_type i = 0; i < image.size(); i++) {
+    h ^= static_cast<unsigned char>(image[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+bool ReadKeyEntry(const char *page, int &off, int keylength, bool &deleted,
+                  std::string &name, int &keyoff) {
+  if (off + entryhdr > nodelength || (page[off] != keptentry && page[off] != lostentry)) {
+    return false;
+  }
+  unsigned short len;
+  memcpy(&len, page + off + 1, sizeof len);
+  if (len < sizeof(NodeNbr) || off + entryhdr + len + keylength > nodelength) {
+    return false;
+  }
+  deleted = page[off] == lostentry;
+  name.assign(page + off + entryhdr, len);
+  keyoff = off + entryhdr + len;
+  off = keyoff + keylength;
+  return true;
+}
+
+// the bits of a key are at h1 + i * h2 for i < hashes, the two
+// halves of its hash
+void KeyFilter::Add(const std::string &image) {
+  const unsigned int nbits = bits.size() * 8;
+  unsigned long long h = KeyHash(image);
+  unsigned int h1 = static_cast<unsigned int>(h);
+  unsigned int h2 = static_cast<unsigned int>(h >> 32) | 1;
+  for (unsigned int i = 0; i < hashes; i++) {
+    unsigned int bit = (h1 + i * h2) % nbits;
+    bits[bit / 8] |= 1 << (bit % 8);
+  }
+  keys++;
+}
+
+// false if the key is certainly not in the tree
+bool KeyFilter::MayContain(const std::string &image) const {
+  const unsigned int nbits = bits.size() * 8;
+  unsigned long long h = KeyHash(image);
+  unsigned int h1 = static_cast<unsigned int>(h);
+  unsigned int h2 = static_cast<unsigned int>(h >> 32) | 1;
+  for (unsigned int i = 0; i < hashes; i++) {
+    unsigned int bit = (h1 + i * h2) % nbits;
+    if ((bits[bit / 8] & (1 << (bit % 8))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void KeyFilter::Save(std::string &buf) const {
+  unsigned int hdr[] = { filtermagic, capacity, keys, deleted, hashes };
+  buf.assign(reinterpret_cast<const char *>(hdr), filterhdr);
+  buf.append(reinterpret_cast<const char *>(&bits[0]), bits.size());
+}
+
+// restore a saved filter, false if it was not saved with this rate
+bool KeyFilter::Load(const std::string &buf) {
+  unsigned int hdr[5];
+  if (buf.size() <= (std::string::size_type)filterhdr) {
+    return false;
+  }
+  memcpy(hdr, buf.data(), filterhdr);
+  if (hdr[0] != filtermagic || hdr[4] != hashes) {
+    return false;
+  }
+  Reset(0);
+  capacity = hdr[1];
+  keys = hdr[2];
+  deleted = hdr[3];
+  bits.assign(buf.begin() + filterhdr, buf.end());
+  return true;
+}
+
 // constructor to open a btree
 EdsBtree::EdsBtree(IndexFile &ndx, Class *cls, EdsKey *ky) throw(BadKeylength)
     : index(ndx) {
@@ -23,6 +145,22 @@ EdsBtree::EdsBtree(IndexFile &ndx, Class *cls, EdsKey *ky) throw(BadKeylength)
   trnode = 0;
   classindexed = cls;
   currnode = 0;
+  oldcurrnode = 0;
+  oldcurrkey = 0;
+  nodepending = false;
+  pendingkey = -1;
+  rightleaf = 0;
+  lastkey = 0;
+  postnode = 0;
+  postpos = 0;
+  postkey = 0;
+  packnode = 0;
+  filter = 0;
+  closed = false;
+  buffered = false;
+  merging = false;
+  changelog.head = changelog.tail = 0;
+  changelog.pos = 0;
 
   indexno = ky->indexno;
 
@@ -34,13 +172,57 @@ EdsBtree::EdsBtree(IndexFile &ndx, Class *cls, EdsKey *ky) throw(BadKeylength)
   } else if (ky->keylength != 0 && header.keylength != ky->keylength) {
     throw BadKeylength();
   }
+
+  // the fanout of the nodes, every key carries a file address
+  // and the keys of non-leaf nodes a lower node too
+  int keyspace = nodedatalength - sizeof(TRNode::TRNodeHeader);
+  leaffanout = keyspace / EntryLength(true);
+  innerfanout = keyspace / EntryLength(false);
+
+  // keys without a normalized image cannot be filtered
+  nullkey->Normalize();
+  if (ky->filterrate > 0 && nullkey->normalized) {
+    filter = new KeyFilter(ky->filterrate);
+  }
+  LoadFilter();
+
+  // the changes the change buffer held when the tree was closed
+  if (header.buffernode != 0) {
+    changelog.head = header.buffernode;
+    ReplayLog(changes, changelog);
+  }
 }
 
 // destructor for a btree
-EdsBtree::~EdsBtree() {
+// write the current node, the key filter and the header. An error
+// writing them is thrown here, the destructor can only drop it
+void EdsBtree::Close() {
+  if (closed) {
+    return;
+  }
+  closed = true;
+  ResetCursor();
+  if (filter != 0) {
+    // save the key filter
+    std::string buf;
+    filter->Save(buf);
+    header.filternode = WriteChain(0, buf);
+  }
   // write the btree header
   WriteHeader();
+}
+
+EdsBtree::~EdsBtree() {
+  try {
+    Close();
+  } catch (...) {
+    // lost, call Close to know
+  }
+  ClearTable(changes);
+  delete filter;
   delete trnode;
+  delete lastkey;
+  delete postkey;
   delete nullkey;
 }
 
@@ -51,14 +233,38 @@ EdsKey *EdsBtree::MakeKeyBuffer() const {
   return thiskey;
 }
 
-// insert a key into a btree
-void EdsBtree::Insert(EdsKey *keypointer) {
+// insert a key into a btree, false if it is there already. The
+// search that tests for the key leaves the leaf it goes in loaded.
+// A secondary key that is there already gets the object's address
+// added to its posting list instead. With a change buffer a secondary
+// key only goes into the buffer, and true comes back
+bool EdsBtree::Insert(EdsKey *keypointer) {
+  if (BufferChange(keypointer, false)) {
+    return true;
+  }
+  NodeNbr fa = keypointer->fileaddr;
   // don't insert duplicate keys
-  if (!Find(keypointer)) {
+  bool inserted = AppendPosition(keypointer) || !EdsBtree::Find(keypointer);
+  if (!inserted && indexno != 0) {
+    keypointer->fileaddr = fa;
+    inserted = AddPosting(trnode->currkey, fa);
+    if (inserted) {
+      trnode->currkey->objects++;
+      trnode->MarkNodeChanged();
+      UpdateCounts(currnode, trnode->Total());
+    }
+  } else if (inserted) {
     EdsKey *newkey = keypointer->MakeKey();
     *newkey = *keypointer;
+    newkey->postings = 0;
+    newkey->objects = 1;
+    newkey->lowercount = 0;
+    if (filter != 0) {
+      filter->Add(keypointer->keyimage);
+    }
 
     NodeNbr rootnode = 0, leftnode = 0, rightnode = 0;
+    unsigned int lefttotal = 0, righttotal = 0;
     bool RootisLeaf = true;
 
     bool done = false;
@@ -71,22 +277,30 @@ void EdsBtree::Insert(EdsKey *keypointer) {
       // are into parents (non-leaves)
       if (!trnode->header.isleaf) {
         trnode->currkey->lowernode = rightnode;
+        trnode->currkey->lowercount = righttotal;
+        trnode->SetLowerCount(leftnode, lefttotal);
       }
 
+      // a key added at the end of the rightmost node of its level
+      bool append = trnode->header.rightsibling == 0 &&
+                    trnode->currkey == trnode->keys.LastEntry();
+
       done = trnode->header.keycount <= em;
-      if (!done) {
+      NodeNbr parent = ParentNode();
+      if (!done && !append) {
         // node is full, try to redistribute keys among siblings
-        done = trnode->Redistribute(trnode->header.leftsibling);
+        done = trnode->Redistribute(trnode->header.leftsibling, parent);
       }
 
-      if (!done) {
-        done = trnode->Redistribute(trnode->header.rightsibling);
+      if (!done && !append) {
+        done = trnode->Redistribute(trnode->header.rightsibling, parent);
       }
 
       if (done) break;
 
       // cannot redistribute filled node, split it
       RootisLeaf = false;
+      rightleaf = 0;
       rightnode = index.NewNode();
       leftnode = currnode;
 
@@ -94,18 +308,18 @@ void EdsBtree::Insert(EdsKey *keypointer) {
       right.SetNodeNbr(rightnode);
       right.MarkNodeChanged();
 
-      // establish sibling and parent relationships
+      // establish sibling relationships
       // between current node and new right sibling
       right.header.rightsibling = trnode->header.rightsibling;
       trnode->header.rightsibling = rightnode;
       right.header.leftsibling = currnode;
-      right.header.parent = trnode->header.parent;
 
       // if the current node is a leaf, so is the new sibling
       right.header.isleaf = trnode->header.isleaf;
 
-      // compute new key counts for the two nodes
-      trnode->header.keycount = (em + 1) / 2;
+      // compute new key counts for the two nodes, an appended
+      // key goes alone into the new node and leaves this one full
+      trnode->header.keycount = append ? em - 1 : (em + 1) / 2;
       right.header.keycount = em - trnode->header.keycount;
 
       // locate the middle key in the current node
@@ -114,6 +328,7 @@ void EdsBtree::Insert(EdsKey *keypointer) {
       // set the pointer to keys less than those in new node
       if (!right.header.isleaf) {
         right.header.lowernode = middlekey->lowernode;
+        right.header.lowercount = middlekey->lowercount;
       }
 
       // point to the keys to move (1 past middle)
@@ -131,14 +346,18 @@ void EdsBtree::Insert(EdsKey *keypointer) {
         right.keys.AppendEntry(movekey);
         movekey = nkey;
       }
+      // objects under the two nodes, for their counts in the parent
+      lefttotal = trnode->Total();
+      righttotal = right.Total();
 
       // prepare to insert key into parent of split nodes
-      currnode = trnode->header.parent;
+      currnode = parent;
+      if (!path.empty()) {
+        path.pop_back();
+      }
       if (!currnode) {
         // no parent node, splitting the root node
         rootnode = index.NewNode();
-        right.header.parent = rootnode;
-        trnode->header.parent = rootnode;
       }
 
       // the former right sibling of the current node is now the right sibling
@@ -149,12 +368,6 @@ void EdsBtree::Insert(EdsKey *keypointer) {
         farright.MarkNodeChanged();
       }
 
-      // children of the new split node point to the current split node as
-      // parent. They must be adopted by the new split node
-      if (!right.header.isleaf) {
-        right.Adoption();
-      }
-
       // if splitting other than root, read parent position currkey to key
       // where split node key will be inserted
       if (currnode) {
@@ -178,19 +391,55 @@ void EdsBtree::Insert(EdsKey *keypointer) {
       currnode = header.rootnode = rootnode;
       trnode->SetNodeNbr(rootnode);
       trnode->Insert(newkey);
-      trnode->header.parent = 0;
       trnode->header.keycount = 1;
 
       if (!RootisLeaf) {
         trnode->header.lowernode = leftnode;
+        trnode->header.lowercount = lefttotal;
         trnode->currkey->lowernode = rightnode;
+        trnode->currkey->lowercount = righttotal;
       }
       trnode->MarkNodeChanged();
+    } else {
+      // count the new key in the nodes above
+      UpdateCounts(currnode, trnode->Total());
+    }
+    if (trnode->header.isleaf && trnode->header.rightsibling == 0) {
+      // remember the rightmost leaf for the next append
+      rightleaf = currnode;
+      rightpath = path;
+      if (lastkey == 0) {
+        lastkey = nullkey->MakeKey();
+      }
+      *lastkey = *(trnode->keys.LastEntry());
     }
     delete newkey;
   }
   delete trnode;
   trnode = 0;
+  return inserted;
+}
+
+// position at the end of the rightmost leaf without a search
+// from the root if the key is higher than every key in the tree
+bool EdsBtree::AppendPosition(EdsKey *keypointer) {
+  if (rightleaf == 0) {
+    return false;
+  }
+  keypointer->Normalize();
+  if (lastkey->Compare(*keypointer) >= 0) {
+    return false;
+  }
+  oldcurrnode = 0;
+  oldcurrkey = 0;
+  nodepending = false;
+  postnode = 0;
+  delete trnode;
+  currnode = rightleaf;
+  path = rightpath;
+  trnode = new TRNode(this, currnode);
+  trnode->currkey = 0;
+  return true;
 }
 
 void EdsBtree::SaveKeyPosition() {
@@ -203,11 +452,849 @@ void EdsBtree::SaveKeyPosition() {
   }
 }
 
+// step down from the current node to one of its children
+void EdsBtree::Descend(NodeNbr nd) {
+  path.push_back(currnode);
+  currnode = nd;
+}
+
+// set the counts of objects on the search path above node nd, which
+// has total objects in its subtree. Each node above gets the count
+// of the one below it patched into its raw page and its own total
+// summed from the page for the next one up
+void EdsBtree::UpdateCounts(NodeNbr nd, unsigned int total) {
+  const int hdrsize = sizeof(NodeNbr) + sizeof(TRNode::TRNodeHeader);
+  const int stride = EntryLength(false);
+  const int countpos = header.keylength + 2 * sizeof(NodeNbr);
+  const int objectspos = countpos + sizeof(unsigned int) + sizeof(NodeNbr);
+  char page[nodelength];
+  TRNode::TRNodeHeader hdr;
+
+  for (std::vector<NodeNbr>::size_type i = path.size(); i-- > 0;) {
+    const long nad = Node::NodeAddress(path[i]);
+    index.ReadAt(page, nodelength, nad);
+    memcpy(&hdr, page + sizeof(NodeNbr), sizeof hdr);
+    if (hdr.lowernode == nd && hdr.lowercount != total) {
+      hdr.lowercount = total;
+      index.WriteAt(&hdr, sizeof hdr, nad + sizeof(NodeNbr));
+    }
+    unsigned int sum = hdr.lowercount;
+    for (int k = 0; k < hdr.keycount; k++) {
+      char *entry = page + hdrsize + k * stride;
+      NodeNbr lnode;
+      unsigned int count;
+      memcpy(&lnode, entry + countpos - sizeof(NodeNbr), sizeof(NodeNbr));
+      memcpy(&count, entry + countpos, sizeof count);
+      if (lnode == nd && count != total) {
+        count = total;
+        index.WriteAt(&count, sizeof count, nad + (entry + countpos - page));
+      }
+      sum += count;
+      if (indexno != 0) {
+        memcpy(&count, entry + objectspos, sizeof count);
+        sum += count;
+      } else {
+        sum++;
+      }
+    }
+    nd = path[i];
+    total = sum;
+  }
+}
+
+// load the node a TypedBtree search stopped at
+void EdsBtree::LoadPendingNode() {
+  if (nodepending) {
+    nodepending = false;
+    delete trnode;
+    trnode = new TRNode(this, currnode);
+    trnode->currkey = pendingkey < 0 ? 0 : trnode->keys.FindEntry(pendingkey);
+  }
+}
+
+// the key at the cursor. A key with a posting list comes back
+// in postkey, with the address of the cursor's object in it
+EdsKey *EdsBtree::CursorKey(EdsKey *ky) {
+  if (ky == 0 || ky->postings == 0) {
+    postnode = 0;
+    postpos = 0;
+    return ky;
+  }
+  if (postnode != ky->postings || postlist.empty() || postlist[0] != ky->fileaddr) {
+    // the cursor moved to this key, read its objects
+    ReadPostings(ky, postlist);
+    postnode = ky->postings;
+    if (postpos < 0 || postpos >= (int)postlist.size()) {
+      postpos = postlist.size() - 1;
+    }
+  }
+  if (postkey == 0) {
+    postkey = nullkey->MakeKey();
+  }
+  *postkey = *ky;
+  postkey->fileaddr = postlist[postpos];
+  return postkey;
+}
+
+// true if the bytes in a chain of index nodes start with a tag
+bool EdsBtree::ChainTagged(NodeNbr nd, unsigned int tag) {
+  unsigned int magic = 0;
+  if (nd != 0 && nd <= index.HighestNode()) {
+    index.ReadAt(&magic, sizeof magic, Node::NodeAddress(nd) + chainhdr);
+  }
+  return magic == tag;
+}
+
+// read the bytes kept in a chain of index nodes
+void EdsBtree::ReadChain(NodeNbr nd, std::string &buf) {
+  char page[nodelength];
+  buf.clear();
+  while (nd != 0) {
+    index.ReadAt(page, nodelength, Node::NodeAddress(nd));
+    unsigned short len;
+    memcpy(&len, page + sizeof(NodeNbr), sizeof len);
+    buf.append(page + chainhdr, len);
+    memcpy(&nd, page, sizeof(NodeNbr));
+  }
+}
+
+// write bytes to a chain of index nodes and return its first node.
+// The nodes of the old chain are reused and more added or freed as
+// needed, an empty buffer frees the chain and returns 0
+NodeNbr EdsBtree::WriteChain(NodeNbr nd, const std::string &buf) {
+  const std::string::size_type datalength = nodelength - chainhdr;
+  char page[nodelength];
+  NodeNbr nx = 0; // next node in the old chain
+  if (buf.empty()) {
+    nx = nd;
+    nd = 0;
+  } else if (nd != 0) {
+    index.ReadAt(&nx, sizeof(NodeNbr), Node::NodeAddress(nd));
+  } else {
+    nd = index.NewNode();
+  }
+  NodeNbr head = nd;
+
+  std::string::size_type pos = 0;
+  while (nd != 0) {
+    std::string::size_type len = std::min(datalength, buf.size() - pos);
+    NodeNbr next = 0;
+    if (pos + len < buf.size()) {
+      if (nx != 0) {
+        next = nx;
+        index.ReadAt(&nx, sizeof(NodeNbr), Node::NodeAddress(next));
+      } else {
+        next = index.NewNode();
+      }
+    }
+    unsigned short used = len;
+    memcpy(page, &next, sizeof(NodeNbr));
+    memcpy(page + sizeof(NodeNbr), &used, sizeof used);
+    memcpy(page + chainhdr, buf.data() + pos, len);
+    memset(page + chainhdr + len, 0, datalength - len);
+    index.WriteAt(page, nodelength, Node::NodeAddress(nd));
+    pos += len;
+    nd = next;
+  }
+
+  // free what is left of the old chain
+  while (nx != 0) {
+    Node node(&index, nx);
+    nx = node.NextNode();
+    node.MarkNodeDeleted();
+  }
+  return head;
+}
+
+// the name of a key in a log of keys: its image, then the object's
+// address high byte first, so the names of a key value sort by object
+std::string EdsBtree::KeyName(const EdsKey *key) const {
+  std::string name = key->keyimage;
+  name += static_cast<char>(key->fileaddr >> 8);
+  name += static_cast<char>(key->fileaddr & 0xff);
+  return name;
+}
+
+NodeNbr EdsBtree::NameAddress(const std::string &name) {
+  std::string::size_type n = name.size();
+  return static_cast<NodeNbr>((static_cast<unsigned char>(name[n - 2]) << 8) |
+                              static_cast<unsigned char>(name[n - 1]));
+}
+
+// hold a key added or deleted in a table, in place of what it held for
+// the key and object, and append it to the log of the table. The
+// entries follow each other in the last node of the log, so WriteData
+// holds them for one write. True if the log was started
+bool EdsBtree::LogKey(KeyTable &table, KeyLog &log, EdsKey *keypointer, bool deleted) {
+  std::string name = KeyName(keypointer);
+  LoggedKey &lk = table[name];
+  if (lk.key == 0) {
+    lk.key = keypointer->MakeKey();
+  }
+  *lk.key = *keypointer;
+  lk.key->postings = 0;
+  lk.deleted = deleted;
+
+  bool started = false;
+  if (log.tail == 0 || log.pos + KeyEntryLength(name) > nodelength) {
+    NodeNbr nd = index.NewNode();
+    char fill[nodelength];
+    memset(fill, 0, nodelength);
+    index.WriteData(fill, nodelength, Node::NodeAddress(nd));
+    if (log.tail != 0) {
+      index.WriteData(&nd, sizeof(NodeNbr), Node::NodeAddress(log.tail));
+    } else {
+      log.head = nd;
+      started = true;
+    }
+    log.tail = nd;
+    log.pos = sizeof(NodeNbr);
+  }
+  char op = deleted ? lostentry : keptentry;
+  unsigned short len = name.size();
+  index.WriteData(&op, 1, Node::NodeAddress(log.tail) + log.pos);
+  index.WriteData(&len, sizeof len);
+  index.WriteData(name.data(), len);
+  keypointer->WriteKey(index);
+  log.pos += KeyEntryLength(name);
+  return started;
+}
+
+// read a log of keys back into its table, the last entry of a key and
+// object is the one kept
+void EdsBtree::ReplayLog(KeyTable &table, KeyLog &log) {
+  char page[nodelength];
+  NodeNbr nd = log.head;
+  while (nd != 0) {
+    index.ReadAt(page, nodelength, Node::NodeAddress(nd));
+    int off = sizeof(NodeNbr);
+    int keyoff;
+    bool deleted;
+    std::string name;
+    while (ReadKeyEntry(page, off, header.keylength, deleted, name, keyoff)) {
+      LoggedKey &lk = table[name];
+      if (lk.key == 0) {
+        lk.key = MakeKeyBuffer();
+      }
+      index.Seek(Node::NodeAddress(nd) + keyoff);
+      lk.key->ReadKey(index);
+      lk.key->keyimage.assign(name, 0, name.size() - sizeof(NodeNbr));
+      lk.key->normalized = true;
+      lk.key->fileaddr = NameAddress(name);
+      lk.deleted = deleted;
+    }
+    log.tail = nd;
+    log.pos = off;
+    memcpy(&nd, page, sizeof(NodeNbr));
+  }
+}
+
+// free the nodes of a log of keys
+void EdsBtree::FreeLog(KeyLog &log) {
+  NodeNbr nd = log.head;
+  while (nd != 0) {
+    NodeNbr next;
+    index.ReadAt(&next, sizeof next, Node::NodeAddress(nd));
+    Node node(&index, nd);
+    node.MarkNodeDeleted();
+    nd = next;
+  }
+  log.head = log.tail = 0;
+  log.pos = 0;
+}
+
+void EdsBtree::ClearTable(KeyTable &table) {
+  for (KeyTable::iterator it = table.begin(); it != table.end(); ++it) {
+    delete it->second.key;
+  }
+  table.clear();
+}
+
+// hold a secondary key added or deleted in the change buffer, false if
+// it goes into the tree now. Of the changes to a key and object only
+// the last one counts, as adding an object a key has or deleting one
+// it does not have changes nothing. A full buffer goes into the tree
+bool EdsBtree::BufferChange(EdsKey *keypointer, bool deleted) {
+  if (!buffered || merging) {
+    return false;
+  }
+  keypointer->Normalize();
+  if (!keypointer->normalized) {
+    return false;
+  }
+  if (LogKey(changes, changelog, keypointer, deleted)) {
+    header.buffernode = changelog.head;
+    WriteHeader();
+  }
+  if (changes.size() >= bufferkeys) {
+    MergeChanges(0);
+  }
+  return true;
+}
+
+// put the changes held for a key into the tree, before it is searched
+// for, or all of them for keypointer 0 or a partial key, before a scan.
+// They go in key order, so the changes to the keys of a leaf are made
+// one after the other. An empty buffer frees its log
+void EdsBtree::MergeChanges(EdsKey *keypointer) {
+  if (changes.empty() || merging) {
+    return;
+  }
+  KeyTable::iterator it = changes.begin(), end = changes.end();
+  if (keypointer != 0 && !keypointer->isPartialKey()) {
+    keypointer->Normalize();
+    const std::string &image = keypointer->keyimage;
+    it = end = changes.lower_bound(image);
+    while (end != changes.end() && end->first.compare(0, image.size(), image) == 0) {
+      ++end;
+    }
+    if (it == end) {
+      return;
+    }
+  }
+  merging = true;
+  try {
+    while (it != end) {
+      if (it->second.deleted) {
+        Delete(it->second.key);
+      } else {
+        Insert(it->second.key);
+      }
+      delete it->second.key;
+      changes.erase(it++);
+    }
+  } catch (...) {
+    merging = false;
+    throw;
+  }
+  merging = false;
+  if (changes.empty()) {
+    FreeLog(changelog);
+    header.buffernode = 0;
+    WriteHeader();
+  }
+}
+
+// put the changes held into the tree while the cursor is on a key, and
+// the cursor back on its key and object. If they went the cursor goes
+// to the ones after them, or before them going back, and true says
+// that is where Next or Previous is
+bool EdsBtree::MergeAtCursor(bool forward) {
+  EdsKey *ck = Current();
+  if (ck == 0) {
+    MergeChanges(0);
+    ResetCursor();
+    return false;
+  }
+  EdsKey *at = ck->MakeKey();
+  *at = *ck;
+  NodeNbr fa = at->fileaddr;
+  MergeChanges(0);
+  bool found = Find(at);
+  delete at;
+  if (!found) {
+    // the cursor is on the key after it, if there is one
+    if (Current() == 0) {
+      ResetCursor();
+    }
+    return forward;
+  }
+  LoadPendingNode();
+  EdsKey *entry = trnode->currkey;
+  ReadPostings(entry, postlist);
+  postnode = entry->postings;
+  int n = postlist.size();
+  int pos = std::lower_bound(postlist.begin(), postlist.end(), fa) - postlist.begin();
+  if (pos < n && postlist[pos] == fa) {
+    postpos = pos;
+    return false;
+  }
+  if (forward) {
+    postpos = pos < n ? pos : n - 1;
+    return pos < n;
+  }
+  postpos = pos > 0 ? pos - 1 : 0;
+  return pos > 0;
+}
+
+// append an address difference to a posting list as a varint
+static void PutDelta(std::string &buf, unsigned int n) {
+  do {
+    unsigned char c = n & 0x7f;
+    n >>= 7;
+    if (n != 0) {
+      c |= 0x80;
+    }
+    buf += static_cast<char>(c);
+  } while (n != 0);
+}
+
+// the packed list of the key whose first object is at first, the
+// offset of its count byte in page, 0 = not there
+static int FindPacked(const char *page, NodeNbr first) {
+  unsigned short used;
+  memcpy(&used, page + sizeof(NodeNbr), sizeof used);
+  int off = chainhdr + sizeof packmagic;
+  while (off + packhdr <= chainhdr + used) {
+    NodeNbr fa;
+    memcpy(&fa, page + off, sizeof fa);
+    if (fa == first) {
+      return off + sizeof(NodeNbr);
+    }
+    off += packhdr + static_cast<unsigned char>(page[off + sizeof(NodeNbr)]);
+  }
+  return 0;
+}
+
+// the address differences of a key's posting list
+void EdsBtree::ReadDeltas(const EdsKey *entry, std::string &deltas) {
+  deltas.clear();
+  if (entry->postings == 0) {
+    return;
+  }
+  if (ChainTagged(entry->postings, packmagic)) {
+    char page[nodelength];
+    index.ReadAt(page, nodelength, Node::NodeAddress(entry->postings));
+    int off = FindPacked(page, entry->fileaddr);
+    if (off != 0) {
+      deltas.assign(page + off + 1, static_cast<unsigned char>(page[off]));
+    }
+    return;
+  }
+  ReadChain(entry->postings, deltas);
+  unsigned int magic = 0;
+  if (deltas.size() >= (std::string::size_type)posthdr) {
+    memcpy(&magic, deltas.data(), sizeof magic);
+  }
+  if (magic == postmagic) {
+    deltas.erase(0, posthdr);
+  }
+}
+
+// read the addresses of all the objects with a key. The first is
+// in the key, the others follow in its posting list as the
+// differences from the one before, each one a varint
+void EdsBtree::ReadPostings(const EdsKey *entry, std::vector<NodeNbr> &addrs) {
+  addrs.clear();
+  addrs.push_back(entry->fileaddr);
+  std::string buf;
+  ReadDeltas(entry, buf);
+  NodeNbr addr = entry->fileaddr;
+  unsigned int delta = 0;
+  int shift = 0;
+  for (std::string::size_type i = 0; i < buf.size(); i++) {
+    unsigned char c = buf[i];
+    delta |= static_cast<unsigned int>(c & 0x7f) << shift;
+    shift += 7;
+    if ((c & 0x80) == 0) {
+      addr += delta;
+      addrs.push_back(addr);
+      delta = 0;
+      shift = 0;
+    }
+  }
+}
+
+// take the posting list of the key whose first object is at first
+// out of node nd, packed or a chain of its own
+void EdsBtree::FreePostings(NodeNbr nd, NodeNbr first) {
+  if (nd == 0) {
+    return;
+  }
+  if (!ChainTagged(nd, packmagic)) {
+    WriteChain(nd, std::string());
+    return;
+  }
+  char page[nodelength];
+  index.ReadAt(page, nodelength, Node::NodeAddress(nd));
+  int off = FindPacked(page, first);
+  if (off == 0) {
+    return;
+  }
+  off -= sizeof(NodeNbr);
+  unsigned short used;
+  memcpy(&used, page + sizeof(NodeNbr), sizeof used);
+  int len = packhdr + static_cast<unsigned char>(page[off + sizeof(NodeNbr)]);
+  memmove(page + off, page + off + len, chainhdr + used - off - len);
+  used -= len;
+  memset(page + chainhdr + used, 0, len);
+  memcpy(page + sizeof(NodeNbr), &used, sizeof used);
+  if (used == sizeof packmagic) {
+    // the last list in the node
+    if (packnode == nd) {
+      packnode = 0;
+    }
+    WriteChain(nd, std::string());
+  } else {
+    index.WriteAt(page, nodelength, Node::NodeAddress(nd));
+  }
+}
+
+// pack the posting list of the key whose first object is at first in
+// the node the tree packs lists in, or a new one, and return the node
+NodeNbr EdsBtree::PackList(NodeNbr first, const std::string &deltas) {
+  char page[nodelength];
+  unsigned short used = 0;
+  int len = packhdr + deltas.size();
+  if (packnode != 0 && ChainTagged(packnode, packmagic)) {
+    index.ReadAt(page, nodelength, Node::NodeAddress(packnode));
+    memcpy(&used, page + sizeof(NodeNbr), sizeof used);
+  }
+  if (used == 0 || used + len > nodelength - chainhdr) {
+    packnode = index.NewNode();
+    memset(page, 0, nodelength);
+    memcpy(page + chainhdr, &packmagic, sizeof packmagic);
+    used = sizeof packmagic;
+  }
+  char *cp = page + chainhdr + used;
+  memcpy(cp, &first, sizeof first);
+  cp[sizeof first] = static_cast<char>(deltas.size());
+  memcpy(cp + packhdr, deltas.data(), deltas.size());
+  used += len;
+  memcpy(page + sizeof(NodeNbr), &used, sizeof used);
+  index.WriteAt(page, nodelength, Node::NodeAddress(packnode));
+  return packnode;
+}
+
+// write the addresses of a key's objects, ascending. A short list is
+// packed with others, a longer one gets a chain of its own, and the
+// nodes of the old list are reused or freed
+void EdsBtree::WritePostings(EdsKey *entry, const std::vector<NodeNbr> &addrs) {
+  NodeNbr oldfirst = entry->fileaddr;
+  entry->fileaddr = addrs[0];
+  std::string buf;
+  for (std::vector<NodeNbr>::size_type i = 1; i < addrs.size(); i++) {
+    PutDelta(buf, addrs[i] - addrs[i - 1]);
+  }
+  NodeNbr nd = entry->postings;
+  bool packed = nd != 0 && ChainTagged(nd, packmagic);
+  if (buf.empty() || buf.size() <= packlimit || packed) {
+    FreePostings(nd, oldfirst);
+    nd = 0;
+  }
+  if (buf.empty()) {
+    entry->postings = 0;
+  } else if (buf.size() <= packlimit) {
+    entry->postings = PackList(entry->fileaddr, buf);
+  } else {
+    std::string hdr(posthdr, '\0');
+    memcpy(&hdr[0], &postmagic, sizeof postmagic);
+    memcpy(&hdr[posthdr - sizeof(NodeNbr)], &addrs.back(), sizeof(NodeNbr));
+    entry->postings = WriteChain(nd, hdr + buf);
+    // the chain's last node goes in its header
+    NodeNbr tail = entry->postings, next;
+    index.ReadAt(&next, sizeof next, Node::NodeAddress(tail));
+    while (next != 0) {
+      tail = next;
+      index.ReadAt(&next, sizeof next, Node::NodeAddress(tail));
+    }
+    index.WriteAt(&tail, sizeof tail,
+                  Node::NodeAddress(entry->postings) + chainhdr + sizeof postmagic);
+  }
+}
+
+// append an object above the last one to a posting list with a chain
+// of its own, writing only its last node and the first. False if the
+// list has no such chain or the object is not above its last
+bool EdsBtree::AppendPosting(EdsKey *entry, NodeNbr fa) {
+  const int datalength = nodelength - chainhdr;
+  NodeNbr head = entry->postings;
+  if (head == 0 || !ChainTagged(head, postmagic)) {
+    return false;
+  }
+  char first[nodelength];
+  index.ReadAt(first, nodelength, Node::NodeAddress(head));
+  NodeNbr tail, last;
+  memcpy(&tail, first + chainhdr + sizeof postmagic, sizeof tail);
+  memcpy(&last, first + chainhdr + sizeof postmagic + sizeof tail, sizeof last);
+  if (fa <= last) {
+    return false;
+  }
+  std::string buf;
+  PutDelta(buf, fa - last);
+
+  char page[nodelength];
+  char *tp = first;
+  if (tail != head) {
+    index.ReadAt(page, nodelength, Node::NodeAddress(tail));
+    tp = page;
+  }
+  unsigned short used;
+  memcpy(&used, tp + sizeof(NodeNbr), sizeof used);
+  std::string::size_type room = std::min(buf.size(), (std::string::size_type)(datalength - used));
+  memcpy(tp + chainhdr + used, buf.data(), room);
+  used += room;
+  memcpy(tp + sizeof(NodeNbr), &used, sizeof used);
+  NodeNbr oldtail = tail;
+  if (room < buf.size()) {
+    // the rest starts a new last node
+    char fresh[nodelength];
+    tail = index.NewNode();
+    memset(fresh, 0, nodelength);
+    unsigned short rest = buf.size() - room;
+    memcpy(fresh + sizeof(NodeNbr), &rest, sizeof rest);
+    memcpy(fresh + chainhdr, buf.data() + room, rest);
+    index.WriteAt(fresh, nodelength, Node::NodeAddress(tail));
+    memcpy(tp, &tail, sizeof tail);
+  }
+  if (oldtail != head) {
+    index.WriteAt(page, nodelength, Node::NodeAddress(oldtail));
+  }
+  memcpy(first + chainhdr + sizeof postmagic, &tail, sizeof tail);
+  memcpy(first + chainhdr + sizeof postmagic + sizeof tail, &fa, sizeof fa);
+  index.WriteAt(first, nodelength, Node::NodeAddress(head));
+  return true;
+}
+
+// the objects of a key in a bitmap
+void EdsBtree::ReadBitmap(const EdsKey *entry, Bitmap &bm) {
+  std::vector<NodeNbr> addrs;
+  ReadPostings(entry, addrs);
+  bm.Assign(addrs);
+}
+
+// add an object to a key, false if it is there. The caller marks
+// the node of the key changed
+bool EdsBtree::AddPosting(EdsKey *entry, NodeNbr fa) {
+  if (AppendPosting(entry, fa)) {
+    return true;
+  }
+  std::vector<NodeNbr> addrs;
+  ReadPostings(entry, addrs);
+  std::vector<NodeNbr>::iterator it = std::lower_bound(addrs.begin(), addrs.end(), fa);
+  if (it != addrs.end() && *it == fa) {
+    return false;
+  }
+  addrs.insert(it, fa);
+  WritePostings(entry, addrs);
+  return true;
+}
+
+// remove an object from a key, false if it is not there or is the
+// key's only object
+bool EdsBtree::RemovePosting(EdsKey *entry, NodeNbr fa) {
+  std::vector<NodeNbr> addrs;
+  ReadPostings(entry, addrs);
+  std::vector<NodeNbr>::iterator it = std::lower_bound(addrs.begin(), addrs.end(), fa);
+  if (it == addrs.end() || *it != fa || addrs.size() == 1) {
+    return false;
+  }
+  addrs.erase(it);
+  WritePostings(entry, addrs);
+  return true;
+}
+
+// read the key filter saved with the tree header. The saved copy is
+// freed once it is read, so a tree that is not closed builds its
+// filter from its keys again when it is first used
+void EdsBtree::LoadFilter() {
+  std::string buf;
+  NodeNbr nd = header.filternode;
+  if (nd != 0) {
+    if (ChainTagged(nd, filtermagic)) {
+      ReadChain(nd, buf);
+      WriteChain(nd, std::string());
+    }
+    header.filternode = 0;
+    WriteHeader();
+    index.Flush();
+  }
+  if (filter != 0) {
+    filter->Load(buf);
+  }
+}
+
+// build the key filter from the keys in the tree. The nodes of each
+// level are linked as siblings, so the tree is read a level at a time
+void EdsBtree::BuildFilter() {
+  std::vector<std::string> images;
+  NodeNbr level = header.rootnode;
+  while (level != 0) {
+    NodeNbr nd = level;
+    level = 0;
+    while (nd != 0) {
+      TRNode node(this, nd);
+      if (level == 0 && !node.header.isleaf) {
+        level = node.header.lowernode;
+      }
+      for (EdsKey *ky = node.keys.FirstEntry(); ky != 0; ky = node.keys.NextEntry()) {
+        images.push_back(ky->keyimage);
+      }
+      nd = node.header.rightsibling;
+    }
+  }
+  filter->Reset(images.size());
+  for (std::vector<std::string>::size_type i = 0; i < images.size(); i++) {
+    filter->Add(images[i]);
+  }
+}
+
+// false if a key is certainly not in the tree, and then there is no
+// current key. Keys the filter cannot test may be there
+bool EdsBtree::MayContain(EdsKey *keypointer) {
+  MergeChanges(keypointer);
+  if (filter == 0 || keypointer->isPartialKey()) {
+    return true;
+  }
+  keypointer->Normalize();
+  if (!keypointer->normalized) {
+    return true;
+  }
+  if (filter->Stale()) {
+    BuildFilter();
+  }
+  if (filter->MayContain(keypointer->keyimage)) {
+    return true;
+  }
+  ResetCursor();
+  return false;
+}
+
+// leave the tree with no current key
+void EdsBtree::ResetCursor() {
+  delete trnode;
+  trnode = 0;
+  nodepending = false;
+  oldcurrnode = 0;
+  postnode = 0;
+}
+
+// the addresses of all the objects with a key, ascending
+int EdsBtree::FindAll(EdsKey *keypointer, std::vector<NodeNbr> &addrs) {
+  addrs.clear();
+  if (MayContain(keypointer) && Find(keypointer)) {
+    LoadPendingNode();
+    ReadPostings(trnode->currkey, addrs);
+  }
+  return addrs.size();
+}
+
+// the objects with key values from lo to hi in a bitmap, hi = 0
+// for no upper bound. A null lo starts at the first key
+int EdsBtree::FindBitmap(EdsKey *lo, EdsKey *hi, Bitmap &bm) {
+  bm.Clear();
+  if (lo == hi) {
+    // one key value
+    if (MayContain(lo) && Find(lo)) {
+      LoadPendingNode();
+      ReadBitmap(trnode->currkey, bm);
+    }
+    return bm.Count();
+  }
+  MergeChanges(0);
+  if (hi != 0) {
+    hi->Normalize();
+  }
+  if (lo->isNullValue()) {
+    First();
+  } else {
+    Find(lo);
+    Current();
+  }
+  while (trnode != 0 && trnode->currkey != 0) {
+    if (hi != 0 && trnode->currkey->Compare(*hi) > 0) break;
+    Bitmap keybm;
+    ReadBitmap(trnode->currkey, keybm);
+    bm |= keybm;
+    NextKey();
+  }
+  return bm.Count();
+}
+
+// the number of objects with keys below a key, or up to it when after
+// is true. The counts of the subtrees passed by are added on the way
+// down from the root
+unsigned int EdsBtree::Position(EdsKey *keypointer, bool after) {
+  unsigned int pos = 0;
+  keypointer->Normalize();
+  NodeNbr nd = header.rootnode;
+  while (nd != 0) {
+    TRNode node(this, nd);
+    bool inner = !node.header.isleaf;
+    // objects in the subtree before the current key
+    unsigned int lower = inner ? node.header.lowercount : 0;
+    nd = inner ? node.header.lowernode : 0;
+    for (EdsKey *ky = node.keys.FirstEntry(); ky != 0; ky = node.keys.NextEntry()) {
+      int cmp = ky->Compare(*keypointer);
+      if (cmp > 0) break;
+      if (cmp == 0) {
+        return pos + lower + (after ? ky->objects : 0);
+      }
+      pos += lower + ky->objects;
+      lower = inner ? ky->lowercount : 0;
+      nd = inner ? ky->lowernode : 0;
+    }
+  }
+  return pos;
+}
+
+// the number of objects with key values from lo to hi, hi = 0 for no
+// upper bound. A null lo counts from the first key
+unsigned int EdsBtree::Count(EdsKey *lo, EdsKey *hi) {
+  MergeChanges(0);
+  unsigned int end = 0;
+  if (hi != 0) {
+    end = Position(hi, true);
+  } else if (header.rootnode != 0) {
+    TRNode root(this, header.rootnode);
+    end = root.Total();
+  }
+  unsigned int begin = lo->isNullValue() ? 0 : Position(lo, false);
+  return end > begin ? end - begin : 0;
+}
+
+// the number of objects with keys below a key, its place in key order
+unsigned int EdsBtree::Rank(EdsKey *keypointer) {
+  MergeChanges(0);
+  return Position(keypointer, false);
+}
+
+// move to the object n places after the first one in key order,
+// skipping the subtrees it is not in. 0 if there are not that many
+EdsKey *EdsBtree::SeekToOffset(unsigned int n) {
+  MergeChanges(0);
+  ResetCursor();
+  path.clear();
+  currnode = header.rootnode;
+  while (currnode != 0) {
+    trnode = new TRNode(this, currnode);
+    bool inner = !trnode->header.isleaf;
+    // objects in the subtree before the current key
+    unsigned int lower = inner ? trnode->header.lowercount : 0;
+    NodeNbr lnode = trnode->header.lowernode;
+    for (EdsKey *ky = trnode->keys.FirstEntry(); ky != 0; ky = trnode->keys.NextEntry()) {
+      if (n < lower) break;
+      n -= lower;
+      if (n < ky->objects) {
+        // the object is one of this key's
+        trnode->currkey = ky;
+        postpos = n;
+        return Current();
+      }
+      n -= ky->objects;
+      lower = inner ? ky->lowercount : 0;
+      lnode = ky->lowernode;
+    }
+    if (n >= lower) break;
+    Descend(lnode);
+    delete trnode;
+    trnode = 0;
+  }
+  ResetCursor();
+  return 0;
+}
+
 // find a key in a btree
 bool EdsBtree::Find(EdsKey *keypointer) {
+  MergeChanges(keypointer);
   oldcurrnode = 0;
   oldcurrkey = 0;
+  nodepending = false;
+  postnode = 0;
+  postpos = 0;
+  keypointer->Normalize();
 
+  path.clear();
   currnode = header.rootnode;
   while (currnode) {
     delete trnode;
@@ -225,29 +1312,53 @@ bool EdsBtree::Find(EdsKey *keypointer) {
       // search key is < lowest key in node
       SaveKeyPosition();
       if (trnode->header.isleaf) break;
-      currnode = trnode->header.lowernode;
+      Descend(trnode->header.lowernode);
     } else if (trnode->currkey) {
       // search key is < current key in node
       SaveKeyPosition();
       if (trnode->header.isleaf) break;
-      currnode = trnode->keys.PrevEntry(trnode->currkey)->lowernode;
+      Descend(trnode->keys.PrevEntry(trnode->currkey)->lowernode);
     } else {
       // search key > highest key in node
       if (trnode->header.isleaf) break;
-      currnode = trnode->keys.LastEntry()->lowernode;
+      Descend(trnode->keys.LastEntry()->lowernode);
     }
   }
   return false;
 }
 
-// delete a key from a btree
+// delete a key from a btree, or its object from the key with a change
+// buffer
 void EdsBtree::Delete(EdsKey *keypointer) {
-  if (Find(keypointer)) {
+  if (BufferChange(keypointer, true)) {
+    return;
+  }
+  rightleaf = 0;
+  NodeNbr fa = keypointer->fileaddr;
+  if (EdsBtree::Find(keypointer)) {
+    keypointer->fileaddr = fa;
+    EdsKey *entry = trnode->currkey;
+    if (indexno != 0 && (entry->postings != 0 || entry->fileaddr != fa)) {
+      // the key stays while other objects have it
+      if (RemovePosting(entry, fa)) {
+        entry->objects--;
+        trnode->MarkNodeChanged();
+        UpdateCounts(currnode, trnode->Total());
+      }
+      delete trnode;
+      trnode = 0;
+      return;
+    }
+    if (filter != 0) {
+      filter->Remove();
+    }
     if (!trnode->header.isleaf) {
 
       // if not found in leaf node, go down to leaf
+      path.push_back(currnode);
       TRNode *leaf = new TRNode(this, trnode->currkey->lowernode);
       while (!leaf->header.isleaf) {
+        path.push_back(leaf->GetNodeNbr());
         NodeNbr lf = leaf->header.lowernode;
         delete leaf;
         leaf = new TRNode(this, lf);
@@ -262,6 +1373,7 @@ void EdsBtree::Delete(EdsKey *keypointer) {
 
       trnode->keys.InsertEntry(movekey, trnode->currkey);
       movekey->lowernode = trnode->currkey->lowernode;
+      movekey->lowercount = trnode->currkey->lowercount;
       trnode->keys.RemoveEntry(trnode->currkey);
       delete trnode->currkey;
       trnode->MarkNodeChanged();
@@ -284,16 +1396,18 @@ void EdsBtree::Delete(EdsKey *keypointer) {
     //      try to combine it with a sibling node
     while (trnode->header.keycount > 0 &&
            trnode->header.keycount <= trnode->m() / 2) {
+      NodeNbr parent = ParentNode();
       if (trnode->header.rightsibling) {
         TRNode *right = new TRNode(this, trnode->header.rightsibling);
-        if (trnode->Implode(*right)) {
+        if (trnode->Implode(*right, parent)) {
           delete right;
-          NodeNbr parent = trnode->header.parent;
           if (parent == 0) {
             header.rootnode = trnode->GetNodeNbr();
+            path.clear();
             break;
           }
           delete trnode;
+          path.pop_back();
           trnode = new TRNode(this, parent);
           continue;
         }
@@ -301,15 +1415,16 @@ void EdsBtree::Delete(EdsKey *keypointer) {
       }
       if (trnode->header.leftsibling) {
         TRNode *left = new TRNode(this, trnode->header.leftsibling);
-        if (left->Implode(*trnode)) {
+        if (left->Implode(*trnode, parent)) {
           delete trnode;
-          NodeNbr parent = left->header.parent;
           if (parent == 0) {
             header.rootnode = left->GetNodeNbr();
             trnode = left;
+            path.clear();
             break;
           }
           delete left;
+          path.pop_back();
           trnode = new TRNode(this, parent);
           continue;
         }
@@ -318,11 +1433,15 @@ void EdsBtree::Delete(EdsKey *keypointer) {
 
       // could not combine with either sibling,
       //     try to redistribute
-      if (!trnode->Redistribute(trnode->header.leftsibling)) {
-        trnode->Redistribute(trnode->header.rightsibling);
+      if (!trnode->Redistribute(trnode->header.leftsibling, parent)) {
+        trnode->Redistribute(trnode->header.rightsibling, parent);
       }
       break;
     }
+    if (trnode->header.keycount > 0) {
+      // take the key's objects off the counts above
+      UpdateCounts(trnode->GetNodeNbr(), trnode->Total());
+    }
   }
   delete trnode;
   trnode = 0;
@@ -330,11 +1449,22 @@ void EdsBtree::Delete(EdsKey *keypointer) {
 
 // return the address of the current key
 EdsKey *EdsBtree::Current() {
-  if (trnode == 0) {
+  if (trnode == 0 && !nodepending) {
     return 0;
   }
+  if (oldcurrnode == 0) {
+    LoadPendingNode();
+  }
+  nodepending = false;
 
   if (oldcurrnode != 0) {
+    // the saved node is above currnode on the search path
+    while (!path.empty() && path.back() != oldcurrnode) {
+      path.pop_back();
+    }
+    if (!path.empty()) {
+      path.pop_back();
+    }
     currnode = oldcurrnode;
     delete trnode;
     trnode = new TRNode(this, currnode);
@@ -342,17 +1472,22 @@ EdsKey *EdsBtree::Current() {
     oldcurrnode = 0;
     oldcurrkey = 0;
   }
-  return trnode->currkey;
+  return CursorKey(trnode->currkey);
 }
 
 // return the address of the first key
 EdsKey *EdsBtree::First() {
+  MergeChanges(0);
+  nodepending = false;
+  oldcurrnode = 0;
+  postpos = 0;
+  path.clear();
   currnode = header.rootnode;
   if (currnode) {
     delete trnode;
     trnode = new TRNode(this, currnode);
     while (!trnode->header.isleaf) {
-      currnode = trnode->header.lowernode;
+      Descend(trnode->header.lowernode);
       delete trnode;
       trnode = new TRNode(this, currnode);
     }
@@ -363,12 +1498,17 @@ EdsKey *EdsBtree::First() {
 
 // return the address of the last key
 EdsKey *EdsBtree::Last() {
+  MergeChanges(0);
+  nodepending = false;
+  oldcurrnode = 0;
+  postpos = -1;
+  path.clear();
   currnode = header.rootnode;
   if (currnode) {
     delete trnode;
     trnode = new TRNode(this, currnode);
     while (!trnode->header.isleaf) {
-      currnode = trnode->keys.LastEntry()->lowernode;
+      Descend(trnode->keys.LastEntry()->lowernode);
       delete trnode;
       trnode = new TRNode(this, currnode);
     }
@@ -379,18 +1519,36 @@ EdsKey *EdsBtree::Last() {
 
 // return the address of the next key
 EdsKey *EdsBtree::Next() {
+  if (!changes.empty() && MergeAtCursor(true)) {
+    return Current();
+  }
+  LoadPendingNode();
   if (trnode == 0 || trnode->currkey == 0) {
     return First();
   }
+  if (trnode->currkey->postings != 0) {
+    // the next object with the same key
+    CursorKey(trnode->currkey);
+    if (postpos + 1 < (int)postlist.size()) {
+      ++postpos;
+      return CursorKey(trnode->currkey);
+    }
+  }
+  return NextKey();
+}
+
+// move past the objects of the current key to the next key
+EdsKey *EdsBtree::NextKey() {
+  postpos = 0;
 
   if (!trnode->header.isleaf) {
     // current key is not in a leaf
-    currnode = trnode->currkey->lowernode;
+    Descend(trnode->currkey->lowernode);
     delete trnode;
     trnode = new TRNode(this, currnode);
     // go down to the leaf
     while (!trnode->header.isleaf) {
-      currnode = trnode->header.lowernode;
+      Descend(trnode->header.lowernode);
       delete trnode;
       trnode = new TRNode(this, currnode);
     }
@@ -403,9 +1561,10 @@ EdsKey *EdsBtree::Next() {
 
     // point to the next key in the leaf
     trnode->currkey = trnode->keys.NextEntry(trnode->currkey);
-    while (trnode->currkey == 0 && currnode != header.rootnode) {
+    while (trnode->currkey == 0 && !path.empty()) {
       // current key was the last one in the leaf
-      TRNode pnode(this, trnode->Parent());
+      TRNode pnode(this, path.back());
+      path.pop_back();
       pnode.SearchNode(thiskey);
       currnode = pnode.GetNodeNbr();
       *trnode = pnode;
@@ -417,24 +1576,37 @@ EdsKey *EdsBtree::Next() {
 
 // return the address of the previous key
 EdsKey *EdsBtree::Previous() {
+  if (!changes.empty() && MergeAtCursor(false)) {
+    return Current();
+  }
+  LoadPendingNode();
   if (trnode == 0 || trnode->currkey == 0) {
     return Last();
   }
+  if (trnode->currkey->postings != 0) {
+    // the previous object with the same key
+    CursorKey(trnode->currkey);
+    if (postpos > 0) {
+      --postpos;
+      return CursorKey(trnode->currkey);
+    }
+  }
+  postpos = -1;
 
   if (!trnode->header.isleaf) {
     // current key is not in a leaf
     EdsKey *ky = trnode->keys.PrevEntry(trnode->currkey);
     if (ky != 0) {
-      currnode = ky->lowernode;
+      Descend(ky->lowernode);
     } else {
-      currnode = trnode->header.lowernode;
+      Descend(trnode->header.lowernode);
     }
 
     delete trnode;
     trnode = new TRNode(this, currnode);
     // go down to the leaf
     while (!trnode->header.isleaf) {
-      currnode = trnode->keys.LastEntry()->lowernode;
+      Descend(trnode->keys.LastEntry()->lowernode);
       delete trnode;
       trnode = new TRNode(this, currnode);
     }
@@ -447,9 +1619,10 @@ EdsKey *EdsBtree::Previous() {
 
     // point to the previous key in the leaf
     trnode->currkey = trnode->keys.PrevEntry(trnode->currkey);
-    while (trnode->currkey == 0 && currnode != header.rootnode) {
+    while (trnode->currkey == 0 && !path.empty()) {
       // current key was the first one in the leaf
-      TRNode pnode(this, trnode->Parent());
+      TRNode pnode(this, path.back());
+      path.pop_back();
       pnode.SearchNode(thiskey);
 
       if (pnode.currkey == 0) {
@@ -465,3 +1638,181 @@ EdsKey *EdsBtree::Previous() {
   }
   return Current();
 }
+
+// the entries of a rebuilt tree from keys sorted by value and object
+// address, one for each key value. A secondary key with more objects
+// gets their addresses in its posting list, a primary key value that
+// is there twice keeps its first object
+void EdsBtree::MakeEntries(const std::vector<EdsKey *> &sorted, std::vector<EdsKey *> &entries) {
+  std::vector<NodeNbr> addrs;
+  // the lists of the new tree share no node with the old one
+  packnode = 0;
+  std::vector<EdsKey *>::size_type i = 0;
+  while (i < sorted.size()) {
+    std::vector<EdsKey *>::size_type j = i + 1;
+    addrs.assign(1, sorted[i]->fileaddr);
+    while (j < sorted.size() && sorted[j]->Compare(*sorted[i]) == 0) {
+      if (sorted[j]->fileaddr != addrs.back()) {
+        addrs.push_back(sorted[j]->fileaddr);
+      }
+      j++;
+    }
+    EdsKey *entry = MakeKeyBuffer();
+    *entry = *sorted[i];
+    entry->indexno = indexno;
+    entry->lowernode = 0;
+    entry->lowercount = 0;
+    entry->postings = 0;
+    entry->objects = 1;
+    if (indexno != 0 && addrs.size() > 1) {
+      entry->objects = addrs.size();
+      WritePostings(entry, addrs);
+    }
+    entries.push_back(entry);
+    i = j;
+  }
+}
+
+// write one level of a tree built bottom up. keys go into the nodes
+// of the level in order, the one between two nodes up to the next
+// level, and the nodes and object counts of the level below become
+// their lower nodes. The keys are spread evenly, so every node is about
+// as full as the fanout lets it be
+void EdsBtree::BuildLevel(std::vector<EdsKey *> &keys, std::vector<NodeNbr> &nodes,
+                          std::vector<unsigned int> &totals, bool leaf) {
+  const int fanout = leaf ? leaffanout : innerfanout;
+  const int nkeys = keys.size();
+  const int count = (nkeys + fanout + 1) / (fanout + 1);
+  const int inkeys = nkeys - (count - 1);
+  std::vector<NodeNbr> nds(count);
+  for (int k = 0; k < count; k++) {
+    nds[k] = index.NewNode();
+  }
+
+  std::vector<EdsKey *> upper;
+  std::vector<unsigned int> uppertotals;
+  int ki = 0, ci = 0;
+  for (int k = 0; k < count; k++) {
+    TRNode node(this, nds[k]);
+    node.header = TRNode::TRNodeHeader();
+    node.header.isleaf = leaf;
+    node.header.leftsibling = k > 0 ? nds[k - 1] : 0;
+    node.header.rightsibling = k + 1 < count ? nds[k + 1] : 0;
+    node.header.keycount = inkeys / count + (k < inkeys % count);
+    unsigned int total = 0;
+    if (!leaf) {
+      node.header.lowernode = nodes[ci];
+      node.header.lowercount = totals[ci];
+      total += totals[ci++];
+    }
+    for (int i = 0; i < node.header.keycount; i++) {
+      EdsKey *ky = keys[ki++];
+      if (!leaf) {
+        ky->lowernode = nodes[ci];
+        ky->lowercount = totals[ci];
+        total += totals[ci++];
+      }
+      total += ky->objects;
+      node.keys.AppendEntry(ky);
+    }
+    node.MarkNodeChanged();
+    uppertotals.push_back(total);
+    if (k + 1 < count) {
+      upper.push_back(keys[ki++]);
+    }
+  }
+  keys.swap(upper);
+  nodes.swap(nds);
+  totals.swap(uppertotals);
+}
+
+// free the nodes of a tree and its posting lists. The nodes are read
+// raw and a node is freed once, so a damaged tree cannot loop
+void EdsBtree::FreeTree(NodeNbr root) {
+  const int hdrsize = sizeof(NodeNbr) + sizeof(TRNode::TRNodeHeader);
+  std::vector<bool> freed(index.HighestNode() + 1, false);
+  std::vector<NodeNbr> todo;
+  if (root != 0) {
+    todo.push_back(root);
+  }
+  char page[nodelength];
+  while (!todo.empty()) {
+    NodeNbr nd = todo.back();
+    todo.pop_back();
+    if (nd == 0 || nd >= freed.size() || freed[nd]) {
+      continue;
+    }
+    freed[nd] = true;
+    index.ReadAt(page, nodelength, Node::NodeAddress(nd));
+    TRNode::TRNodeHeader hdr;
+    memcpy(&hdr, page + sizeof(NodeNbr), sizeof hdr);
+    const int stride = EntryLength(hdr.isleaf);
+    if (hdr.keycount > 0 && hdr.keycount <= (hdr.isleaf ? leaffanout : innerfanout)) {
+      if (!hdr.isleaf) {
+        todo.push_back(hdr.lowernode);
+      }
+      for (int i = 0; i < hdr.keycount; i++) {
+        const char *entry = page + hdrsize + i * stride + header.keylength + sizeof(NodeNbr);
+        NodeNbr nx;
+        if (!hdr.isleaf) {
+          memcpy(&nx, entry, sizeof(NodeNbr));
+          todo.push_back(nx);
+          entry += sizeof(NodeNbr) + sizeof(unsigned int);
+        }
+        if (indexno != 0) {
+          // a node of packed lists is freed once
+          memcpy(&nx, entry, sizeof(NodeNbr));
+          if (nx < freed.size() && !freed[nx]) {
+            freed[nx] = true;
+            WriteChain(nx, std::string());
+          }
+        }
+      }
+    }
+    Node node(&index, nd);
+    node.MarkNodeDeleted();
+  }
+}
+
+// replace the tree with one built bottom up from keys sorted by value
+// and object address. The leaves are written first and then each
+// level above them, and the old tree stays the tree of the header
+// until the new one is complete. Its nodes are then freed, unless
+// reclaim is false for a tree that may be damaged
+void EdsBtree::Rebuild(const std::vector<EdsKey *> &sorted, bool reclaim) {
+  ResetCursor();
+  // the objects were read with their changes
+  if (reclaim) {
+    FreeLog(changelog);
+  }
+  changelog.head = changelog.tail = 0;
+  changelog.pos = 0;
+  header.buffernode = 0;
+  ClearTable(changes);
+  path.clear();
+  rightleaf = 0;
+  NodeNbr oldroot = header.rootnode;
+
+  std::vector<EdsKey *> keys;
+  MakeEntries(sorted, keys);
+  if (filter != 0) {
+    filter->Reset(keys.size());
+    for (std::vector<EdsKey *>::size_type i = 0; i < keys.size(); i++) {
+      filter->Add(keys[i]->keyimage);
+    }
+  }
+
+  std::vector<NodeNbr> nodes;
+  std::vector<unsigned int> totals;
+  bool leaf = true;
+  while (!keys.empty()) {
+    BuildLevel(keys, nodes, totals, leaf);
+    leaf = false;
+  }
+  header.rootnode = nodes.empty() ? 0 : nodes[0];
+  WriteHeader();
+  if (reclaim) {
+    FreeTree(oldroot);
+  }
+  index.Flush();
+}
@@ -16,6 +16,9 @@
 
 #include <fstream>
 #include <string>
+#include <cstring>
+#include <vector>
+#include <map>
 #include "linklist.h"
 #include "node.h"
 
@@ -23,44 +26,116 @@
 
 class EdsKey;
 class TRNode;
+class Bitmap;
 struct Class;
+template <class T> class Key;
 
 const int classnamesize = 32;
 
+// a node of a chain of index nodes (posting lists, key filters)
+// starts with the next node and the count of bytes used in it
+const int chainhdr = sizeof(NodeNbr) + sizeof(unsigned short);
+
+// an entry of a log of keys in index nodes says whether the object
+// has the key or lost it, then comes the length of its name, the name
+// and the key. The rest of the node is zeros
+const char keptentry = 1;
+const char lostentry = 2;
+const int entryhdr = 1 + sizeof(unsigned short);
+
+// read the entry of a log of keys at offset off of a node and move off
+// past it, false after the last one
+bool ReadKeyEntry(const char *page, int &off, int keylength, bool &deleted,
+                  std::string &name, int &keyoff);
+
+// 64-bit FNV-1a hash of a key image
+unsigned long long KeyHash(const std::string &image);
+
 // IndexFile class
 class IndexFile : public NodeFile {
 public:
-  IndexFile(const std::string &name) : NodeFile(name + ".idx") {}
+  IndexFile(const std::string &name, bool shadowpaging = false)
+      : NodeFile(name + ".idx", shadowpaging) {}
+  IndexFile(const std::string &name, std::shared_ptr<const PageVersion> pin)
+      : NodeFile(name + ".idx", pin) {}
 };
 
-// b-tree header record
+// b-tree header record. The headers of a class's indexes follow each
+// other in the index file, so a field added here moves all but the
+// first and the index files have to be recreated
 class TreeHeader {
   TreeHeader() {
     rootnode = 0;
+    filternode = 0;
     keylength = 0;
+    buffernode = 0;
   }
 
   friend class EdsBtree;
+  friend class HashIndex;
+  friend class LsmIndex;
   friend class IndexFile;
   NodeNbr rootnode;    // node number of the root
+  NodeNbr filternode;  // saved key filter, 0 = none
   KeyLength keylength; // length of a key in this b-tree
+  NodeNbr buffernode;  // log of the change buffer, 0 = none
+};
+
+// Bloom filter of the key values in a b-tree, tested before a search
+// to skip the descent for most keys that are not there. Deleted keys
+// leave their bits set, so the filter is built again from the tree
+// when too many were deleted or it holds more keys than it was sized for
+class KeyFilter {
+public:
+  KeyFilter(double fprate);
+  void Reset(unsigned int keycount);
+  void Add(const std::string &image);
+  void Remove() { deleted++; }
+  bool MayContain(const std::string &image) const;
+  bool Stale() const { return !built || keys > capacity || deleted * 2 > keys; }
+  void Save(std::string &buf) const;
+  bool Load(const std::string &buf);
+private:
+  double bitsperkey;     // bits of the array for each key
+  unsigned int hashes;   // bits set for each key
+  unsigned int capacity; // keys the array is sized for
+  unsigned int keys;     // keys added since it was built
+  unsigned int deleted;  // keys deleted since it was built
+  bool built;            // false until it is built or loaded
+  std::vector<unsigned char> bits;
 };
 
 // b-tree index
 class EdsBtree {
 public:
   EdsBtree(IndexFile &ndx, Class *cls, EdsKey *ky) throw(BadKeylength);
-  ~EdsBtree();
+  virtual ~EdsBtree();
+  // close it, reporting errors writing the index
+  virtual void Close();
 
-  void Insert(EdsKey *keypointer);
-  void Delete(EdsKey *keypointer);
-  bool Find(EdsKey *keypointer);
-  EdsKey *Current();
-  EdsKey *First();
-  EdsKey *Last();
-  EdsKey *Next();
-  EdsKey *Previous();
+  virtual bool Insert(EdsKey *keypointer);
+  virtual void Delete(EdsKey *keypointer);
+  virtual bool Find(EdsKey *keypointer);
+  bool MayContain(EdsKey *keypointer);
+  virtual int FindAll(EdsKey *keypointer, std::vector<NodeNbr> &addrs);
+  virtual EdsKey *Current();
+  virtual EdsKey *First();
+  virtual EdsKey *Last();
+  virtual EdsKey *Next();
+  virtual EdsKey *Previous();
+  virtual int FindBitmap(EdsKey *lo, EdsKey *hi, Bitmap &bm);
+  virtual unsigned int Count(EdsKey *lo, EdsKey *hi);
+  // true if Count adds up the counts kept in the index instead of
+  // reading the keys
+  virtual bool CountsKept() const { return true; }
+  virtual unsigned int Rank(EdsKey *keypointer);
+  virtual EdsKey *SeekToOffset(unsigned int n);
+  virtual void Rebuild(const std::vector<EdsKey *> &sorted, bool reclaim = true);
+  // hold the changes to a secondary index in a change buffer, see
+  // EDatastore::UseChangeBuffer
+  void BufferChanges(bool on) { buffered = on && indexno != 0; }
   IndexFile &GetIndexFile() const { return index; }
+  void SaveHeader() { WriteHeader(); }
   EdsKey *NullKey() const { return nullkey; }
   EdsKey *MakeKeyBuffer() const;
   NodeNbr Root() const { return header.rootnode; }
@@ -68,14 +143,76 @@ public:
   IndexNo Indexno() const { return indexno; }
   const Class *ClassIndexed() const { return classindexed; }
   void SetClassIndexed(Class *cid) { classindexed = cid; }
-private:
+  int LeafFanout() const { return leaffanout; }
+  int InnerFanout() const { return innerfanout; }
+  // bytes of a key in a node. Keys of non-leaf nodes carry their lower
+  // node and its count of objects, secondary keys their posting list
+  // and count of objects
+  int EntryLength(bool leaf) const {
+    return header.keylength + sizeof(NodeNbr) * (1 + !leaf + (indexno != 0)) +
+           sizeof(unsigned int) * (!leaf + (indexno != 0));
+  }
+protected:
+  // a key added or deleted that is held in memory, and in a log of
+  // index nodes that brings it back, by its name: the key image with
+  // the object's address after it
+  struct LoggedKey {
+    EdsKey *key;
+    bool deleted;
+  };
+  typedef std::map<std::string, LoggedKey> KeyTable;
+  // the nodes of a log of keys
+  struct KeyLog {
+    NodeNbr head; // first node, 0 = none
+    NodeNbr tail; // the node appended to
+    int pos;      // offset of the next entry in it
+  };
+  std::string KeyName(const EdsKey *key) const;
+  static NodeNbr NameAddress(const std::string &name);
+  int KeyEntryLength(const std::string &name) const {
+    return entryhdr + name.size() + header.keylength;
+  }
+  bool LogKey(KeyTable &table, KeyLog &log, EdsKey *keypointer, bool deleted);
+  void ReplayLog(KeyTable &table, KeyLog &log);
+  void FreeLog(KeyLog &log);
+  void ClearTable(KeyTable &table);
+  bool BufferChange(EdsKey *keypointer, bool deleted);
+  void MergeChanges(EdsKey *keypointer);
+  bool MergeAtCursor(bool forward);
   std::streampos HdrPos() {
     return classindexed->headeraddr + (std::streamoff)(indexno * sizeof(TreeHeader));
   }
   void ReadHeader() { index.ReadData(&header, sizeof(TreeHeader), HdrPos()); }
   void WriteHeader() { index.WriteData(&header, sizeof(TreeHeader), HdrPos()); }
   void SaveKeyPosition();
-private:
+  bool AppendPosition(EdsKey *keypointer);
+  void LoadPendingNode();
+  virtual void ResetCursor();
+  EdsKey *CursorKey(EdsKey *ky);
+  bool ChainTagged(NodeNbr nd, unsigned int tag);
+  void ReadChain(NodeNbr nd, std::string &buf);
+  NodeNbr WriteChain(NodeNbr nd, const std::string &buf);
+  EdsKey *NextKey();
+  void ReadDeltas(const EdsKey *entry, std::string &deltas);
+  virtual void ReadPostings(const EdsKey *entry, std::vector<NodeNbr> &addrs);
+  virtual void ReadBitmap(const EdsKey *entry, Bitmap &bm);
+  void FreePostings(NodeNbr nd, NodeNbr first);
+  NodeNbr PackList(NodeNbr first, const std::string &deltas);
+  virtual void WritePostings(EdsKey *entry, const std::vector<NodeNbr> &addrs);
+  bool AppendPosting(EdsKey *entry, NodeNbr fa);
+  virtual bool AddPosting(EdsKey *entry, NodeNbr fa);
+  virtual bool RemovePosting(EdsKey *entry, NodeNbr fa);
+  void LoadFilter();
+  virtual void BuildFilter();
+  void Descend(NodeNbr nd);
+  void UpdateCounts(NodeNbr nd, unsigned int total);
+  unsigned int Position(EdsKey *keypointer, bool after);
+  void MakeEntries(const std::vector<EdsKey *> &sorted, std::vector<EdsKey *> &entries);
+  void BuildLevel(std::vector<EdsKey *> &keys, std::vector<NodeNbr> &nodes,
+                  std::vector<unsigned int> &totals, bool leaf);
+  void FreeTree(NodeNbr root);
+  NodeNbr ParentNode() const { return path.empty() ? 0 : path.back(); }
+protected:
   TreeHeader header;   // btree header
   TRNode *trnode;       // -> current node value
   EdsKey *nullkey;     // for building empty derived key
@@ -83,8 +220,27 @@ private:
   IndexNo indexno;     // 0=primary key, > 0=secondary key
   Class *classindexed; // -> class structure of indexed class
   NodeNbr currnode;    // current node number
+  std::vector<NodeNbr> path; // nodes above currnode, root first
+  NodeNbr rightleaf;   // rightmost leaf, 0 = not known
+  std::vector<NodeNbr> rightpath; // nodes above it
+  EdsKey *lastkey;     // highest key in the tree when rightleaf is known
   NodeNbr oldcurrnode; // for repositioning
   int oldcurrkey;    //  "        "
+  bool nodepending;    // currnode found but not loaded into trnode
+  int pendingkey;      // its current key, -1 = past the last one
+  int leaffanout;      // most keys in a leaf node
+  int innerfanout;     // most keys in a non-leaf node
+  NodeNbr postnode;    // posting list in postlist, 0 = none
+  std::vector<NodeNbr> postlist; // objects of the current key
+  int postpos;         // the cursor's object in it, -1 = the last
+  EdsKey *postkey;     // the current key with that object's address
+  NodeNbr packnode;    // node short posting lists are packed in, 0 = new
+  KeyFilter *filter;   // filter of the keys in the tree, 0 = none
+  bool closed;         // by Close
+  bool buffered;       // secondary keys go to the change buffer
+  bool merging;        // the change buffer is going into the tree
+  KeyTable changes;    // the change buffer
+  KeyLog changelog;    // its log
 };
 
 // b-tree TRNode class
@@ -94,36 +250,39 @@ public: // due to a bug in Borland C++ 4.0
 private:
   TRNode(EdsBtree *bt, NodeNbr node);
   bool SearchNode(EdsKey *keyvalue);
+  bool FindSeparator(EdsKey *leftkey, NodeNbr right);
   void Insert(EdsKey *keyvalue);
   int m();
   void WriteBtreeKey(EdsKey *thiskey);
-  void Adopt(NodeNbr node);
-  void Adoption();
   bool isLeaf() const { return header.isleaf; }
-  NodeNbr Parent() const { return header.parent; }
   NodeNbr LeftSibling() const { return header.leftsibling; }
   NodeNbr RightSibling() const { return header.rightsibling; }
   int KeyCount() const { return header.keycount; }
   NodeNbr LowerNode() const { return header.lowernode; }
-  bool Redistribute(NodeNbr sib);
-  bool Implode(TRNode &right);
+  bool Redistribute(NodeNbr sib, NodeNbr parent);
+  bool Implode(TRNode &right, NodeNbr &parent);
+  unsigned int Total();
+  void SetLowerCount(NodeNbr nd, unsigned int count);
   int NodeHeaderSize() const {
     return sizeof(TRNodeHeader) + Node::NodeHeaderSize();
   }
   TRNode &operator=(TRNode &trnode);
 private:
   friend class EdsBtree;
+  template <class T> friend class TypedBtree;
   struct TRNodeHeader {
     bool isleaf;          // true if node is a leaf
-    NodeNbr parent;       // parent to this node
+    NodeNbr parent;       // unused, parents come from the search path
     NodeNbr leftsibling;  // left sibling node
     NodeNbr rightsibling; // right sibling node
     int keycount;   // number of keys in this node
     NodeNbr lowernode;    // lower node associated with
                           // keys < keys in this node
+    unsigned int lowercount; // objects in the subtree of the lower node
     TRNodeHeader() {
       isleaf = false;
       parent = leftsibling = rightsibling = keycount = lowernode = 0;
+      lowercount = 0;
     }
   } header;
   EdsKey *currkey;         // current key
@@ -131,4 +290,19 @@ private:
   LinkedList<EdsKey> keys; // the keys in this node
 };
 
+// b-tree of a fixed-width arithmetic key. Find reads the raw node
+// pages and binary searches the keys in place, comparing them as T
+// with the key stride fixed for the tree, no key objects are built and
+// no virtual functions are called. Updates use the EdsBtree code and
+// the node of a found key is only loaded when a cursor function needs it
+template <class T>
+class TypedBtree : public EdsBtree {
+public:
+  TypedBtree(IndexFile &ndx, Class *cls, EdsKey *ky) : EdsBtree(ndx, cls, ky) {}
+  bool Find(EdsKey *keypointer);
+};
+
+// TypedBtree<T>::Find is at the end of key.h, it sets the address of
+// the key it finds
+
 #endif
@@ -36,7 +36,7 @@ public:
 		return mo == dt.mo && da == dt.da && yr == dt.yr;
 	}
 	int operator!= (const Date &dt) const { return !(*this == dt); }
-	int operator>  (const Date &dt) const { return !(*this == dt || *this < dt); }
+	int operator>  (const Date &dt) const { return dt < *this; }
 	int operator<= (const Date &dt) const { return (*this == dt || *this < dt); }
 	int operator>= (const Date &dt) const { return (*this == dt || *this > dt); }
 
@@ -81,42 +81,190 @@
 #include "stdafx.h"
 #include <new.h>
 #include <stdlib.h>
+#include <climits>
 #include <string>
 #include <algorithm>
+#include <exception>
 #include "edatastore.h"
 
 #pragma warning (disable: 4267)
 
 EDatastore *EDatastore::opendatastore; // latest open datastore
+thread_local EDatastore *EDatastore::threaddatastore; // latest snapshot on this thread
+
+// most nodes Prefetch reads at once
+const int prefetchnodes = 32;
+// most nodes between two objects that Prefetch reads through
+const int prefetchgap = 4;
+
+// versions of a shadow paged datastore between two commits
+const int commitversions = 64;
 
 // construct a EDatastore datastore
-EDatastore::EDatastore(const std::string &name) : datafile(name), indexfile(name) {
+EDatastore::EDatastore(const std::string &name, bool shadowpaging)
+    : datafile(name, shadowpaging), indexfile(name, shadowpaging) {
   rebuildnode = 0;
+  versions = 0;
+  adding = 0;
+  closed = false;
+  if (shadowpaging) {
+    std::shared_ptr<Snapshot> snap(new Snapshot);
+    snap->name = name;
+    snap->data = datafile.Version();
+    snap->index = indexfile.Version();
+    published = snap;
+  }
   previousdatastore = opendatastore;
   opendatastore = this;
 }
 
-// close the EDatastore datastore
-EDatastore::~EDatastore() {
+// open a datastore on a snapshot of a shadow paged one
+EDatastore::EDatastore(const Snapshot &snap)
+    : datafile(snap.name, snap.data), indexfile(snap.name, snap.index) {
+  rebuildnode = 0;
+  versions = 0;
+  adding = 0;
+  closed = false;
+  published = std::make_shared<const Snapshot>(snap);
+  // the objects built on this thread read the snapshot, the other
+  // threads go on with the open datastore
+  previousdatastore = threaddatastore;
+  threaddatastore = this;
+}
+
+// the numbers of a class sequence are handed out in blocks, only
+// the end of the block is written to the index file
+const SequenceNo sequenceblock = 64;
+
+// close the EDatastore datastore. An error writing the files is
+// thrown here, the destructor can only drop it
+void EDatastore::Close() {
+  if (closed) {
+    return;
+  }
+  closed = true;
+  std::exception_ptr error;
+  Class *cls = classes.FirstEntry();
+  try {
+    while (cls != 0) {
+      if (cls->lastseq != cls->highseq) {
+        // give back the unused part of the sequence block
+        indexfile.WriteAt(&cls->lastseq, sizeof(SequenceNo), SequenceAddr(cls));
+      }
+      cls = classes.NextEntry();
+    }
+  } catch (...) {
+    error = std::current_exception();
+  }
   EdsBtree *bt = btrees.FirstEntry();
   while (bt != 0) {
+    try {
+      bt->Close();
+    } catch (...) {
+      if (!error) error = std::current_exception();
+    }
     delete bt;
     bt = btrees.NextEntry();
   }
-  Class *cls = classes.FirstEntry();
+  btrees.ClearList();
+  cls = classes.FirstEntry();
   while (cls != 0) {
     delete[] cls->classname;
     delete cls;
     cls = classes.NextEntry();
   }
-  opendatastore = previousdatastore;
+  classes.ClearList();
+  if (datafile.ReadOnly()) {
+    threaddatastore = previousdatastore;
+  } else {
+    opendatastore = previousdatastore;
+  }
+  try {
+    indexfile.Close();
+  } catch (...) {
+    if (!error) error = std::current_exception();
+  }
+  try {
+    datafile.Close();
+  } catch (...) {
+    if (!error) error = std::current_exception();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+EDatastore::~EDatastore() {
+  try {
+    Close();
+  } catch (...) {
+    // lost, call Close to know
+  }
+}
+
+Snapshot EDatastore::GetSnapshot() const {
+  std::shared_ptr<const Snapshot> snap = std::atomic_load(&published);
+  return snap ? *snap : Snapshot();
+}
+
+// the version of the data file the objects saved now go in
+unsigned int EDatastore::NextStamp() const {
+  return datafile.ShadowPaging() ? datafile.Version()->txn + 1 : 0;
+}
+
+// make the changes to a shadow paged datastore the version snapshots
+// get, with the headers of its indexes. Not while an object is added
+// and not saved: its primary key is in the index and its node is not
+// written, so the save that ends the last one publishes
+void EDatastore::Publish() {
+  if (!datafile.ShadowPaging() || datafile.ReadOnly() || adding > 0) {
+    return;
+  }
+  EdsBtree *bt = btrees.FirstEntry();
+  while (bt != 0) {
+    bt->SaveHeader();
+    bt = btrees.NextEntry();
+  }
+  bool data = datafile.Publish();
+  bool index = indexfile.Publish();
+  if (data || index) {
+    std::shared_ptr<Snapshot> snap(new Snapshot);
+    snap->name = published->name;
+    snap->data = datafile.Version();
+    snap->index = indexfile.Version();
+    std::atomic_store(&published, std::shared_ptr<const Snapshot>(snap));
+    if (++versions >= commitversions) {
+      datafile.Commit();
+      indexfile.Commit();
+      versions = 0;
+    }
+  }
+}
+
+// write the latest version of a shadow paged datastore to disk, or wait
+// for the writes queued behind
+void EDatastore::Commit() {
+  if (adding > 0 && datafile.ShadowPaging()) {
+    // the save that ends the adding publishes and commits
+    versions = commitversions;
+    return;
+  }
+  Publish();
+  datafile.Commit();
+  indexfile.Commit();
+  versions = 0;
+}
+
+void EDatastore::WriteBehind(const FlushPolicy &policy) {
+  datafile.WriteBehind(policy);
+  indexfile.WriteBehind(policy);
 }
 
 // read an object header record
 void EDatastore::GetObjectHeader(ObjAddr nd, ObjectHeader &objhdr) {
   // constructing this node seeks to the first data byte
   Node(&datafile, nd);
-  datafile.ReadData(&objhdr, sizeof(ObjectHeader));
+  datafile.ReadData(&objhdr, ObjectHeaderLength());
 }
 
 Class *EDatastore::Registration(const Serialize &pcls) {
@@ -166,7 +314,11 @@ ClassID EDatastore::GetClassID(const char *classname) {
 void EDatastore::AddClassToIndex(Class *cls) {
   NodeNbr nd = 0;
 
-  if (FindClass(cls, &nd) == false) {
+  if (FindClass(cls, &nd)) {
+    // read the class sequence
+    indexfile.ReadData(&cls->highseq, sizeof(SequenceNo), SequenceAddr(cls));
+    cls->lastseq = cls->highseq;
+  } else {
     indexfile.ResetNewFile();
     nd = nd ? nd : indexfile.NewNode();
     // build the class header for new class
@@ -189,17 +341,41 @@ void EDatastore::AddClassToIndex(Class *cls) {
   }
 }
 
+// the class sequence is kept at the end of the class header node,
+// after the tree headers
+std::streampos EDatastore::SequenceAddr(const Class *cls) const {
+  return cls->headeraddr +
+         (std::streamoff)(nodedatalength - classnamesize - sizeof(SequenceNo));
+}
+
+// return the next number of a class's sequence. The end of each block
+// of numbers is written before the first one is used, so a number is
+// never handed out twice even if the datastore is not closed
+SequenceNo EDatastore::NextSequence(const Serialize &pcls) {
+  Class *cls = Registration(pcls);
+  if (cls->lastseq == cls->highseq) {
+    cls->highseq += sequenceblock;
+    indexfile.WriteAt(&cls->highseq, sizeof(SequenceNo), SequenceAddr(cls));
+  }
+  return ++cls->lastseq;
+}
+
 // register a class's indexes with the datastore manager
 void EDatastore::RegisterIndexes(Class *cls,
   const Serialize &pcls) throw(ZeroLengthKey) {
   Serialize &cl = const_cast<Serialize &>(pcls);
+  bool lsm = lsmclasses.count(cls->classname) != 0;
+  bool buffered = bufferedclasses.count(cls->classname) != 0;
   EdsKey *key = cl.keys.FirstEntry();
   while (key != 0) {
     if (key->GetKeyLength() == 0) {
       throw ZeroLengthKey();
     }
-    EdsBtree *bt = new EdsBtree(indexfile, cls, key);
+    EdsBtree *bt = lsm || LsmIndex::Kept(indexfile, cls, key->indexno)
+                       ? key->MakeLsm(indexfile, cls)
+                       : key->MakeBtree(indexfile, cls);
     bt->SetClassIndexed(cls);
+    bt->BufferChanges(buffered);
     btrees.AppendEntry(bt);
     key = cl.keys.NextEntry();
   }
@@ -226,8 +402,8 @@ ClassID EDatastore::RegisterClass(const Serialize &pcls) {
 }
 
 // Serialize base class member functions
-Serialize *Serialize::objconstructed = 0;
-Serialize *Serialize::objdestroyed = 0;
+thread_local Serialize *Serialize::objconstructed = 0;
+thread_local Serialize *Serialize::objdestroyed = 0;
 bool Serialize::usingnew = false;
 
 // common constructor code
@@ -243,9 +419,9 @@ void Serialize::BuildObject() throw(NoDatastore) {
   newobject = false;
   loaded = false;
   saved = false;
-  offset = 0;
+  original = 0;
+  recpos = 0;
   indexcount = 0;
-  node = 0;
   objectaddress = 0;
   instances = 0;
 }
@@ -256,7 +432,6 @@ Serialize::~Serialize() throw(NotLoaded, NotSaved, MustDestroy) {
     throw NoDatastore();
   RemoveObject();
   keys.ClearList();
-  delete node;
 
   if (!loaded) {
     throw NotLoaded();
@@ -356,20 +531,19 @@ void Serialize::RemoveObject() {
   RemoveOrgKeys();
 }
 
-void Serialize::TestDuplicateObject() throw(Serialize *) {
+// return the instance this object is loaded in already, or 0
+Serialize *Serialize::TestDuplicateObject() {
   if (objectaddress != 0) {
     // search for a previous instance of this object
     Serialize *obj = edatastore->objects.FirstEntry();
     while (obj != 0) {
       if (objectaddress == obj->objectaddress) {
-        // object already instantiated
-        obj->instances++;
-        saved = true;
-        throw obj;
+        return obj;
       }
       obj = edatastore->objects.NextEntry();
     }
   }
+  return 0;
 }
 
 // called from derived constructor after all construction
@@ -394,43 +568,143 @@ void Serialize::LoadObject(ObjAddr nd) {
 void Serialize::ObjectOut() {
   Serialize *hold = objdestroyed;
   objdestroyed = this;
-  // tell object to write its data members
+  // tell object to write its data members into the record
+  record.clear();
   Write();
   objdestroyed = hold;
-  // pad the last node
-  int padding = nodedatalength - offset;
-  if (padding) {
-    char *pads = new char[padding];
-    memset(pads, 0, padding);
-    edatastore->datafile.WriteData(pads, padding);
-    delete pads;
-  }
-
-  NodeNbr nx = node->NextNode();
-  node->SetNextNode(0);
-  delete node;
-  node = 0;
-  // if node was linked, object got shorter
-  while (nx != 0) {
-    Node nd(&edatastore->datafile, nx);
-    nx = nd.NextNode();
-    nd.MarkNodeDeleted();
+
+  // write the record as whole nodes, each one led by
+  // the next node number and the object header
+  DataFile &df = edatastore->datafile;
+  const int ohlength = edatastore->ObjectHeaderLength();
+  const int hdrsize = sizeof(NodeNbr) + ohlength;
+  const std::string::size_type datalength = nodelength - hdrsize;
+  char page[nodelength];
+  ObjectHeader oh = objhdr;
+  oh.ndnbr = 0;
+  oh.stamp = objhdr.stamp = edatastore->NextStamp();
+
+  NodeNbr nd = objectaddress;
+  NodeNbr nx = 0; // next node in the object's existing chain
+  NodeNbr fresh = 0; // a new node not linked into the chain yet
+  edatastore->fetched.erase(nd);
+  if (!newobject) {
+    df.ReadAt(&nx, sizeof(NodeNbr), Node::NodeAddress(nd));
   }
-  edatastore->datafile.Seek(filepos);
+  std::string::size_type pos = 0;
+  while (nd != 0) {
+    std::string::size_type len = std::min(datalength, record.size() - pos);
+    NodeNbr next = 0;
+    if (pos + len < record.size()) {
+      // the object continues in the next node
+      if (nx != 0) {
+        next = nx;
+        df.ReadAt(&nx, sizeof(NodeNbr), Node::NodeAddress(next));
+      } else {
+        next = df.NewNode();
+        fresh = next;
+      }
+    }
+
+    memcpy(page, &next, sizeof(NodeNbr));
+    memcpy(page + sizeof(NodeNbr), &oh, ohlength);
+    memcpy(page + hdrsize, record.data() + pos, len);
+    memset(page + hdrsize + len, 0, datalength - len);
+    try {
+      df.WriteAt(page, nodelength, Node::NodeAddress(nd));
+    } catch (...) {
+      // no node links to the one just got, give it back
+      if (fresh != 0) {
+        DeleteNodes(fresh);
+      }
+      throw;
+    }
+    fresh = 0;
+
+    pos += len;
+    oh.ndnbr++;
+    nd = next;
+  }
+
+  // if the chain was longer, the object got shorter
+  DeleteNodes(nx);
+  record.clear();
 }
 
-// write the object's node header
-void Serialize::WriteObjectHeader() {
-  // write the relative node number and class id
-  edatastore->datafile.WriteData(&objhdr, sizeof(ObjectHeader));
-  offset = sizeof(ObjectHeader);
+// read all the object's nodes into the record, or take it from
+// the records read ahead
+void Serialize::ReadRecord() throw(BadObjAddr) {
+  DataFile &df = edatastore->datafile;
+  const int ohlength = edatastore->ObjectHeaderLength();
+  const int hdrsize = sizeof(NodeNbr) + ohlength;
+  char page[nodelength];
+  record.clear();
+  recpos = 0;
+
+  std::map<NodeNbr, std::pair<ObjectHeader, std::string> >::iterator it =
+      edatastore->fetched.find(objectaddress);
+  if (it != edatastore->fetched.end() && it->second.first.classid == objhdr.classid) {
+    objhdr.stamp = it->second.first.stamp;
+    record.swap(it->second.second);
+    edatastore->fetched.erase(it);
+    return;
+  }
+
+  NodeNbr nd = objectaddress;
+  while (nd != 0) {
+    df.ReadAt(page, nodelength, Node::NodeAddress(nd));
+    if (nd == objectaddress) {
+      ObjectHeader oh;
+      memcpy(&oh, page + sizeof(NodeNbr), ohlength);
+      if (oh.ndnbr != 0 || oh.classid != objhdr.classid) {
+        throw BadObjAddr();
+      }
+      objhdr.stamp = oh.stamp;
+    }
+    record.append(page + hdrsize, nodelength - hdrsize);
+    memcpy(&nd, page, sizeof(NodeNbr));
+  }
 }
 
-// read the object's node header
-void Serialize::ReadObjectHeader() {
-  // read the relative node number and class id
-  edatastore->datafile.ReadData(&objhdr, sizeof(ObjectHeader));
-  offset = sizeof(ObjectHeader);
+// give back the nodes and index entries of a new object that could
+// not be saved
+void Serialize::ReleaseObject() {
+  DeleteNodes(objectaddress);
+  EdsKey *key = keys.FirstEntry();
+  bool primary = true;
+  while (key != 0) {
+    if (!key->isNullValue()) {
+      EdsBtree *bt = FindIndex(key);
+      bool ours = !primary;
+      if (primary) {
+        // only if the object's own address is under the primary key
+        EdsKey *ky = bt->MakeKeyBuffer();
+        ky->CopyKeyData(key);
+        ours = bt->MayContain(ky) && bt->Find(ky) && ky->fileaddr == objectaddress;
+        delete ky;
+      }
+      if (ours) {
+        key->fileaddr = objectaddress;
+        bt->Delete(key);
+      }
+    }
+    primary = false;
+    key = keys.NextEntry();
+  }
+  DeleteIndexes();
+  RemoveOrgKeys();
+  objectaddress = 0;
+  newobject = false;
+}
+
+// return a chain of nodes to the free list
+void Serialize::DeleteNodes(NodeNbr nx) {
+  edatastore->fetched.erase(nx);
+  while (nx != 0) {
+    Node nd(&edatastore->datafile, nx);
+    nx = nd.NextNode();
+    nd.MarkNodeDeleted();
+  }
 }
 
 // called from derived destructor before all destruction, a new or
@@ -441,128 +715,135 @@ void Serialize::SaveObject() throw(NoDatastore) {
   }
 
   saved = true;
+  if (original != 0) {
+    // a copy of an object loaded elsewhere, that instance saves it
+    return;
+  }
   if (edatastore->rebuildnode) {
     AddIndexes();
     return;
   }
 
   if (newobject) {
+    --edatastore->adding;
     if (!deleted && ObjectExists()) {
-      AddIndexes();
-      PositionNode();
-      ObjectOut();
+      try {
+        AddIndexes();
+        ObjectOut();
+      } catch (...) {
+        // the object's nodes may never have been written
+        ReleaseObject();
+        throw;
+      }
       RecordObject();
+    } else if (ObjectExists()) {
+      // added then deleted, release the node and the primary key
+      DeleteNodes(objectaddress);
+      DeleteIndexes();
+      RemoveOrgKeys();
+      objectaddress = 0;
     }
   }
   else if (deleted || changed && ObjectExists()) {
-    // position the edatastore file at the object's node
-    PositionNode();
     if (deleted) {
       // delete the object's nodes from the datastore
-      while (node != 0) {
-        node->MarkNodeDeleted();
-        NodeNbr nx = node->NextNode();
-        delete node;
-        if (nx) {
-          node = new Node(&edatastore->datafile, nx);
-        }
-        else {
-          node = 0;
-        }
-      }
+      DeleteNodes(objectaddress);
       DeleteIndexes();
       objectaddress = 0;
     }
     else {
+      // update the object's indexes, a primary key in use is undone
+      UpdateIndexes();
       // tell object to write its data members
       ObjectOut();
-      // update the object's indexes
-      UpdateIndexes();
       RecordObject();
     }
-    edatastore->datafile.Seek(filepos);
   }
   newobject = false;
   deleted = false;
   changed = false;
+  edatastore->Publish();
 }
 
-// read one data member of the object from the datastore
-void Serialize::EdsReadObject(void *buf, int length) {
-  while (node != 0 && length > 0) {
-    if (offset == nodedatalength) {
-      NodeNbr nx = node->NextNode();
-      delete node;
-      node = nx ? new Node(&edatastore->datafile, nx) : 0;
-      ReadObjectHeader();
-    }
-
-    if (node != 0) {
-      int len = std::min(length, static_cast<int>(nodedatalength - offset));
-      edatastore->datafile.ReadData(buf, len);
-      buf = reinterpret_cast<char *>(buf) + len;
-      offset += len;
-      length -= len;
-    }
-  }
-}
-
-// write one data member of the object to the datastore
-void Serialize::EdsWriteObject(const void *buf, int length) {
-  while (node != 0 && length > 0) {
-    if (offset == nodedatalength) {
-      NodeNbr nx = node->NextNode();
-      if (nx == 0) {
-        nx = edatastore->datafile.NewNode();
-      }
-
-      node->SetNextNode(nx);
-      delete node;
-      node = new Node(&edatastore->datafile, nx);
-      WriteObjectHeader();
-      objhdr.ndnbr++;
-    }
-    int len = std::min(length, static_cast<int>(nodedatalength - offset));
-    edatastore->datafile.WriteData(buf, len);
-    buf = reinterpret_cast<const char *>(buf) + len;
-    offset += len;
-    length -= len;
-  }
-}
-
+// strings are stored as a varint length, 7 bits a byte with the
+// low bits first, followed by the characters
 void Serialize::ReadStrObject(std::string &str) {
-  int len;
-  EdsReadObject(&len, sizeof(int));
-  char *s = new char[len + 1];
-  EdsReadObject(s, len);
-  s[len] = '\0';
-  str = s;
-  delete s;
+  std::string::size_type len = 0;
+  int shift = 0;
+  while (recpos < record.size()) {
+    unsigned char c = record[recpos++];
+    len |= static_cast<std::string::size_type>(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) break;
+    shift += 7;
+  }
+  len = std::min(len, record.size() - recpos);
+  str.assign(record, recpos, len);
+  recpos += len;
 }
 
 void Serialize::WriteStrObject(const std::string &str) {
-  int len = strlen(str.c_str());
-  EdsWriteObject(&len, sizeof(int));
-  EdsWriteObject(str.c_str(), len);
+  // trailing NULs are key padding, not part of the value
+  std::string::size_type len = str.find_last_not_of('\0');
+  len = (len == std::string::npos) ? 0 : len + 1;
+  std::string::size_type n = len;
+  do {
+    unsigned char c = n & 0x7f;
+    n >>= 7;
+    if (n != 0) {
+      c |= 0x80;
+    }
+    record += static_cast<char>(c);
+  } while (n != 0);
+  record.append(str, 0, len);
 }
 
 // add the index values to the object's index btrees
 void Serialize::AddIndexes() {
   EdsKey *key = keys.FirstEntry();
+  EdsKey *oky = orgkeys.FirstEntry();
+  if (newobject && oky != 0) {
+    // the primary key went in when the object was added
+    if (!(*oky == *key)) {
+      // it has changed since
+      ChangePrimaryKey(key, oky);
+    }
+    key = keys.NextEntry();
+  }
   while (key != 0) {
     if (!key->isNullValue()) {
       EdsBtree *bt = FindIndex(key);
       key->fileaddr = objectaddress;
+      // false only if the object has the secondary key already
       bt->Insert(key);
     }
     key = keys.NextEntry();
   }
 }
 
+// put a changed primary key in the index before the old one goes,
+// a value another object has, or none, leaves the object its old key
+void Serialize::ChangePrimaryKey(EdsKey *key, EdsKey *oky) {
+  EdsBtree *bt = FindIndex(key);
+  key->fileaddr = objectaddress;
+  if (key->isNullValue() || !bt->Insert(key)) {
+    *key = *oky;
+  } else if (!oky->isNullValue()) {
+    oky->fileaddr = objectaddress;
+    bt->Delete(oky);
+  }
+}
+
 // update the index values in the object's index btrees
 void Serialize::UpdateIndexes() {
   EdsKey *oky = orgkeys.FirstEntry();
   EdsKey *key = keys.FirstEntry();
+  if (key != 0 && !(*oky == *key)) {
+    ChangePrimaryKey(key, oky);
+  }
+  if (key != 0) {
+    oky = orgkeys.NextEntry();
+    key = keys.NextEntry();
+  }
   while (key != 0) {
     if (!(*oky == *key)) {
       // key value has changed, update the index
@@ -596,37 +877,24 @@ void Serialize::DeleteIndexes() {
   }
 }
 
-// position the file to the specifed node number
-void Serialize::PositionNode() throw(BadObjAddr) {
-  filepos = edatastore->datafile.FilePosition();
-  if (objectaddress) {
-    delete node;
-    node = new Node(&edatastore->datafile, objectaddress);
-    offset = sizeof(ObjectHeader);
-    ObjectHeader oh;
-    edatastore->datafile.ReadData(&oh, sizeof(ObjectHeader));
-    if (oh.ndnbr != 0 || oh.classid != objhdr.classid) {
-      throw BadObjAddr();
-    }
-  }
-}
-
 // search the index for a match on the key
 void Serialize::SearchIndex(EdsKey *key) {
   objectaddress = 0;
   if (key != 0 && !key->isNullValue()) {
     EdsBtree *bt = FindIndex(key);
-    if (bt != 0 && bt->Find(key)) {
-      if (key->indexno != 0) {
-        EdsKey *bc;
-        do {
-          bc = bt->Previous();
-        } while (bc != 0 && *bc == *key);
-        key = bt->Next();
-      }
+    if (bt != 0 && bt->MayContain(key) && bt->Find(key)) {
+      // the first object with the key
       objectaddress = key->fileaddr;
+    } else if (bt != 0 && key->isPartialKey()) {
+      // a partial key sorts below all the keys it prefixes,
+      // so the first match is the next key in the index
+      EdsKey *ck = bt->Current();
+      if (ck != 0 && ck->HasPrefix(*key))
+        objectaddress = ck->fileaddr;
     }
   }
+  if (key != 0)
+    key->ResetPrefix();
 }
 
 // scan nodes forward to the first one of next object
@@ -661,6 +929,201 @@ Serialize &Serialize::FindObject(EdsKey *key) {
   return *this;
 }
 
+// the addresses of all the objects with a key value, ascending
+int Serialize::FindAll(EdsKey *key, std::vector<ObjAddr> &addrs) {
+  addrs.clear();
+  EdsBtree *bt = FindIndex(key);
+  if (bt != 0 && !key->isNullValue()) {
+    std::vector<NodeNbr> nds;
+    bt->FindAll(key, nds);
+    addrs.assign(nds.begin(), nds.end());
+  }
+  return addrs.size();
+}
+
+// the objects with a key value in a bitmap
+int Serialize::FindBitmap(EdsKey *key, Bitmap &bm) {
+  return FindBitmap(key, key, bm);
+}
+
+// the objects with key values from lo to hi in a bitmap, hi = 0 for
+// no upper bound and a null lo from the first key. Bitmaps of
+// several keys combine with &=, |= and -= before any object is read
+int Serialize::FindBitmap(EdsKey *lo, EdsKey *hi, Bitmap &bm) {
+  bm.Clear();
+  EdsBtree *bt = FindIndex(lo);
+  if (bt != 0 && (lo != hi || !lo->isNullValue())) {
+    bt->FindBitmap(lo, hi, bm);
+  }
+  return bm.Count();
+}
+
+// the addresses of the objects that meet all of several key
+// predicates, or any of them, ascending. The objects of each predicate
+// come from its index as a bitmap and the bitmaps are intersected or
+// joined before any object is read. An intersection starts from the
+// predicate with the fewest objects, counted in its index, and stops
+// as soon as nothing is left. A predicate on an index that would have
+// to read its keys to count them, a hash or LSM index, comes last
+int Serialize::FindAll(const std::vector<KeyRange> &ranges,
+                       std::vector<ObjAddr> &addrs, bool any) {
+  addrs.clear();
+  std::vector<std::pair<int, std::vector<KeyRange>::size_type> > order;
+  for (std::vector<KeyRange>::size_type i = 0; i < ranges.size(); i++) {
+    EdsBtree *bt = FindIndex(ranges[i].lo);
+    int count = 0;
+    if (!any) {
+      count = bt != 0 && !bt->CountsKept() ? INT_MAX
+                                           : CountObjects(ranges[i].lo, ranges[i].hi);
+    }
+    if (!any && count == 0) {
+      return 0;
+    }
+    order.push_back(std::make_pair(count, i));
+  }
+  std::sort(order.begin(), order.end());
+
+  Bitmap bm, keybm;
+  for (std::vector<KeyRange>::size_type i = 0; i < order.size(); i++) {
+    const KeyRange &kr = ranges[order[i].second];
+    FindBitmap(kr.lo, kr.hi, i == 0 ? bm : keybm);
+    if (i == 0) continue;
+    if (any) {
+      bm |= keybm;
+    } else {
+      bm &= keybm;
+      if (bm.Count() == 0) break;
+    }
+  }
+  std::vector<NodeNbr> nds;
+  bm.Addresses(nds);
+  addrs.assign(nds.begin(), nds.end());
+  return addrs.size();
+}
+
+// read the object at an address, e.g. one that FindAll returned
+Serialize &Serialize::FetchObject(ObjAddr nd) {
+  RemoveObject();
+  objectaddress = nd;
+  ReadDataMembers();
+  return *this;
+}
+
+// the addresses of the objects with key values from lo to hi in key
+// order, hi = 0 for no upper bound and a null lo from the first key.
+// They are read from the index alone, for Prefetch
+int Serialize::FindRange(EdsKey *lo, EdsKey *hi, std::vector<ObjAddr> &addrs) {
+  addrs.clear();
+  EdsBtree *bt = FindIndex(lo);
+  if (bt == 0) {
+    return 0;
+  }
+  if (hi != 0) {
+    hi->Normalize();
+  }
+  EdsKey *ky;
+  if (lo->isNullValue()) {
+    ky = bt->First();
+  } else {
+    bt->Find(lo);
+    ky = bt->Current();
+  }
+  while (ky != 0 && (hi == 0 || ky->Compare(*hi) <= 0)) {
+    addrs.push_back(ky->fileaddr);
+    ky = bt->Next();
+  }
+  return addrs.size();
+}
+
+// read the records of objects ahead, so that FetchObject takes them
+// from memory in any order. The addresses are sorted and the nodes
+// read in ascending file order, nodes close together in one read
+// with the few nodes between them. Returns the records read ahead
+int Serialize::Prefetch(const std::vector<ObjAddr> &addrs) {
+  DataFile &df = edatastore->datafile;
+  const int ohlength = edatastore->ObjectHeaderLength();
+  const int hdrsize = sizeof(NodeNbr) + ohlength;
+  std::map<NodeNbr, std::pair<ObjectHeader, std::string> > &fetched = edatastore->fetched;
+  fetched.clear();
+
+  std::vector<NodeNbr> nds(addrs.begin(), addrs.end());
+  std::sort(nds.begin(), nds.end());
+  nds.erase(std::unique(nds.begin(), nds.end()), nds.end());
+  nds.erase(std::remove(nds.begin(), nds.end(), NodeNbr(0)), nds.end());
+
+  std::vector<char> buf;
+  char page[nodelength];
+  std::vector<NodeNbr>::size_type i = 0;
+  while (i < nds.size()) {
+    // the run of nodes for the next objects
+    NodeNbr first = nds[i];
+    NodeNbr last = first;
+    std::vector<NodeNbr>::size_type j = i + 1;
+    while (j < nds.size() && nds[j] - first < prefetchnodes &&
+           nds[j] - last <= prefetchgap) {
+      last = nds[j++];
+    }
+    buf.resize((last - first + 1) * nodelength);
+    df.ReadAt(&buf[0], buf.size(), Node::NodeAddress(first));
+
+    for (; i < j; i++) {
+      const char *pg = &buf[(nds[i] - first) * nodelength];
+      ObjectHeader oh;
+      memcpy(&oh, pg + sizeof(NodeNbr), ohlength);
+      if (oh.ndnbr != 0 || oh.classid != objhdr.classid) {
+        // not an object of this class, FetchObject will say so
+        continue;
+      }
+      fetched[nds[i]].first = oh;
+      std::string &rec = fetched[nds[i]].second;
+      NodeNbr nd;
+      for (;;) {
+        rec.append(pg + hdrsize, nodelength - hdrsize);
+        memcpy(&nd, pg, sizeof(NodeNbr));
+        if (nd == 0) break;
+        // the object goes on in another node, in the run or not
+        if (nd >= first && nd <= last) {
+          pg = &buf[(nd - first) * nodelength];
+        } else {
+          df.ReadAt(page, nodelength, Node::NodeAddress(nd));
+          pg = page;
+        }
+      }
+    }
+  }
+  return fetched.size();
+}
+
+// the number of objects with key values from lo to hi, hi = 0 for no
+// upper bound and a null lo from the first key. No lo counts all the
+// objects of the class in its primary key
+int Serialize::CountObjects(EdsKey *lo, EdsKey *hi) {
+  EdsBtree *bt = FindIndex(lo);
+  if (bt == 0) {
+    return 0;
+  }
+  return bt->Count(lo != 0 ? lo : bt->NullKey(), hi);
+}
+
+// the number of objects before a key value in its index
+int Serialize::RankObject(EdsKey *key) {
+  EdsBtree *bt = FindIndex(key);
+  return bt != 0 ? bt->Rank(key) : 0;
+}
+
+// retrieve the object n places after the first in a key sequence,
+// e.g. the first one of a page of a listing
+Serialize &Serialize::SeekObject(int n, EdsKey *key) {
+  RemoveObject();
+  objectaddress = 0;
+  EdsBtree *bt = FindIndex(key);
+  if (bt != 0 && n >= 0 && (key = bt->SeekToOffset(n)) != 0) {
+    objectaddress = key->fileaddr;
+  }
+  ReadDataMembers();
+  return *this;
+}
+
 // retrieve the current object in a key sequence
 Serialize &Serialize::CurrentObject(EdsKey *key) {
   RemoveObject();
@@ -743,44 +1206,90 @@ Serialize &Serialize::PreviousObject(EdsKey *key) {
 
 // read an object's data members
 void Serialize::ReadDataMembers() {
+  original = 0;
   if (objectaddress != 0) {
-    PositionNode();
+    ReadRecord();
     // tell object to read its data members
     Serialize *hold = objconstructed;
     objconstructed = this;
     Read();
     objconstructed = hold;
-    delete node;
-    node = 0;
-    TestDuplicateObject();
-    // post object instantiated and
-    //     put secondary keys in table
-    RecordObject();
-    edatastore->datafile.Seek(filepos);
+    record.clear();
+    original = TestDuplicateObject();
+    if (original == 0) {
+      // post object instantiated and
+      //     put secondary keys in table
+      RecordObject();
+    }
   }
 }
 
 // add an object to the EDatastore datastore
 bool Serialize::AddObject() {
+  if (newobject) {
+    // added already, and not saved yet
+    return false;
+  }
   newobject = (objectaddress == 0 && TestRelationships());
   if (newobject) {
-    delete node; // (just in case)
-    node = new Node(&edatastore->datafile, edatastore->datafile.NewNode());
-    objectaddress = node->GetNodeNbr();
-    WriteObjectHeader();
-    objhdr.ndnbr++;
+    // the object's nodes are written when it is saved
+    objectaddress = edatastore->datafile.NewNode();
+    // inserting the primary key is the test for a duplicate, a copy
+    // in orgkeys tells SaveObject the key is in the index. Until the
+    // save the key points at a node that is not written: nothing may
+    // look the object up before it is saved, and a save that fails
+    // takes the key out again (ReleaseObject). No version is published
+    // in between
+    EdsKey *key = keys.FirstEntry();
+    if (key != 0 && !key->isNullValue()) {
+      key->fileaddr = objectaddress;
+      bool inserted;
+      try {
+        inserted = FindIndex(key)->Insert(key);
+      } catch (...) {
+        DeleteNodes(objectaddress);
+        objectaddress = 0;
+        newobject = false;
+        throw;
+      }
+      if (inserted) {
+        EdsKey *ky = key->MakeKey();
+        *ky = *key;
+        orgkeys.AppendEntry(ky);
+      } else {
+        // the primary key is already in use
+        DeleteNodes(objectaddress);
+        objectaddress = 0;
+        newobject = false;
+      }
+    }
+    if (newobject) {
+      ++edatastore->adding;
+    }
   }
   return newobject;
 }
 
+// number a new object without searching the index
+SequenceNo Serialize::NextSequence() {
+  return edatastore->NextSequence(*this);
+}
+
 // mark a serialize object for change
-bool Serialize::ChangeObject() {
+bool Serialize::ChangeObject() throw(LoadedElsewhere) {
+  if (original != 0) {
+    // the instance loaded first saves the object, not this copy
+    throw LoadedElsewhere();
+  }
   changed = TestRelationships();
   return changed;
 }
 
 // mark a serialize object for delete
-bool Serialize::DeleteObject() {
+bool Serialize::DeleteObject() throw(LoadedElsewhere) {
+  if (original != 0) {
+    throw LoadedElsewhere();
+  }
   EdsKey *key = keys.FirstEntry();
   bool related = false;
 
@@ -806,7 +1315,7 @@ bool Serialize::DeleteObject() {
             }
             else {
               ky->CopyKeyData(key);
-              related = bt->Find(ky);
+              related = bt->MayContain(ky) && bt->Find(ky);
             }
           }
         }
@@ -821,18 +1330,24 @@ bool Serialize::DeleteObject() {
 // test an object's relationships
 //        return false if it is related to a
 //        nonexistent object
-//        return false if its primary key is already in use
 bool Serialize::TestRelationships() {
   EdsKey *key = keys.FirstEntry();
   if (key == 0) return true;
   EdsBtree *bt;
-  if (objectaddress == 0) {
+  bool unrelated = true;
+
+  // a primary key changed to the key of another object
+  EdsKey *oky = orgkeys.FirstEntry();
+  if (oky != 0 && !key->isNullValue() && !(*oky == *key)) {
     bt = FindIndex(key);
-    if (bt != 0 && bt->Find(key)) {
+    EdsKey *ky = bt->MakeKeyBuffer();
+    ky->CopyKeyData(key);
+    bool inuse = bt->MayContain(ky) && bt->Find(ky);
+    delete ky;
+    if (inuse) {
       return false;
     }
   }
-  bool unrelated = true;
 
   while ((key = keys.NextEntry()) != 0) {
     const type_info *relclass = key->relatedclass;
@@ -869,7 +1384,7 @@ bool Serialize::TestRelationships() {
           if (strcmp(bc, kc) == 0) {
             EdsKey *ky = bt->MakeKeyBuffer();
             ky->CopyKeyData(key);
-            unrelated = bt->Find(ky);
+            unrelated = bt->MayContain(ky) && bt->Find(ky);
           }
         }
         bt = edatastore->btrees.NextEntry();
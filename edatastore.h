@@ -85,6 +85,10 @@
 #include <typeinfo>
 #include <string>
 #include <cstring>
+#include <cstddef>
+#include <vector>
+#include <map>
+#include <set>
 
 /*
 * EDatastore exceptions representing program errors
@@ -120,15 +124,26 @@ class BadReference : public EdsExceptions {};
 // Bad ObjAddr specified
 class BadObjAddr : public EdsExceptions {};
 
+// Index not of the key's index type
+class BadIndex : public EdsExceptions {};
+
+// Change or delete of a copy of an object another instance has loaded
+class LoadedElsewhere : public EdsExceptions {};
+
 // Class Identification
 typedef int ClassID;
 
 // Class Identification structure
+typedef unsigned int SequenceNo;
+
 struct Class {
   char *classname;
   ClassID classid;
   std::streampos headeraddr;
-  Class(char *cn = 0) : classname(cn), classid(0), headeraddr(0) {}
+  SequenceNo lastseq; // last number the class sequence handed out
+  SequenceNo highseq; // highest number recorded in the index file
+  Class(char *cn = 0) : classname(cn), classid(0), headeraddr(0),
+                        lastseq(0), highseq(0) {}
 };
 
 // Key Controls
@@ -137,6 +152,11 @@ typedef int KeyLength;
 
 #include "linklist.h"
 #include "btree.h"
+#include "hashidx.h"
+#include "bitmap.h"
+#include "shadow.h"
+#include "lsm.h"
+#include "flusher.h"
 
 // Object Address
 struct ObjAddr {
@@ -151,11 +171,25 @@ struct ObjAddr {
 struct ObjectHeader {
   ClassID classid;  // class identification
   NodeNbr ndnbr;    // relative node number within object
-  ObjectHeader() : classid(0), ndnbr(0) {}
+  unsigned int stamp; // version of the datastore it was saved in
+  ObjectHeader() : classid(0), ndnbr(0), stamp(0) {}
 };
 
+// a plain data file keeps the header without the stamp
+const int plainheaderlength = offsetof(ObjectHeader, stamp);
+
 class EDatastore;
 
+// a query predicate on one key of a class: the objects with key values
+// from lo to hi, hi = 0 for no upper bound and a null lo from the
+// first key, or the objects with lo's value when hi is lo
+struct KeyRange {
+  EdsKey *lo;
+  EdsKey *hi;
+  KeyRange(EdsKey *key) : lo(key), hi(key) {}
+  KeyRange(EdsKey *l, EdsKey *h) : lo(l), hi(h) {}
+};
+
 // Serialize object abstract base class
 class Serialize {
 public:
@@ -172,6 +206,12 @@ public:
   void AddReference() {
     ++instances;
   }
+  // the instance that had this object loaded already, if any. The
+  // object is changed or deleted through it, ChangeObject and
+  // DeleteObject of this copy throw LoadedElsewhere
+  Serialize *LoadedInstance() const {
+    return original;
+  }
 protected:
   Serialize();
   Serialize(EDatastore* db);
@@ -188,14 +228,27 @@ public:
 
   // class interface methods for modifying datastore
   bool AddObject();
-  bool ChangeObject();
-  bool DeleteObject();
+  bool ChangeObject() throw (LoadedElsewhere);
+  bool DeleteObject() throw (LoadedElsewhere);
   bool ObjectExists() const {
     return objectaddress != 0;
   }
+  // the next number of the class's sequence, for new keys
+  SequenceNo NextSequence();
 
   // class interface methods for searching datastore
   Serialize& FindObject(EdsKey *key);
+  int FindAll(EdsKey *key, std::vector<ObjAddr>& addrs);
+  int FindBitmap(EdsKey *key, Bitmap& bm);
+  int FindBitmap(EdsKey *lo, EdsKey *hi, Bitmap& bm);
+  int FindAll(const std::vector<KeyRange>& ranges, std::vector<ObjAddr>& addrs,
+              bool any = false);
+  Serialize& FetchObject(ObjAddr nd);
+  int FindRange(EdsKey *lo, EdsKey *hi, std::vector<ObjAddr>& addrs);
+  int Prefetch(const std::vector<ObjAddr>& addrs);
+  int CountObjects(EdsKey *lo = 0, EdsKey *hi = 0);
+  int RankObject(EdsKey *key);
+  Serialize& SeekObject(int n, EdsKey *key = 0);
   Serialize& CurrentObject(EdsKey *key = 0);
   Serialize& FirstObject(EdsKey *key = 0);
   Serialize& LastObject(EdsKey *key = 0);
@@ -205,6 +258,11 @@ public:
   ObjAddr ObjectAddress() const {
     return objectaddress;
   }
+  // the version of a shadow paged datastore the object was last saved
+  // in, the commit stamp of the object as read, 0 = no shadow paging
+  unsigned int CommitStamp() const {
+    return objhdr.stamp;
+  }
   // pseudo delete operator for multiple instances
   static void Destroy(Serialize *pp);
 
@@ -220,15 +278,16 @@ private:
     keys.AppendEntry(key);
   }
   void ObjectOut();
+  void ReadRecord() throw (BadObjAddr);
+  void DeleteNodes(NodeNbr nx);
+  void ReleaseObject();
   void RecordObject();
   void RemoveObject();
   void RemoveOrgKeys();
   void AddIndexes();
   void DeleteIndexes();
   void UpdateIndexes();
-  void PositionNode() throw (BadObjAddr);
-  void ReadObjectHeader();
-  void WriteObjectHeader();
+  void ChangePrimaryKey(EdsKey *key, EdsKey *oky);
   void SearchIndex(EdsKey *key);
   void ReadDataMembers();
   EdsBtree *FindIndex(EdsKey *key);
@@ -236,30 +295,34 @@ private:
   void ScanForward(NodeNbr nd);
   void ScanBackward(NodeNbr nd);
   void BuildObject() throw (NoDatastore);
-  void TestDuplicateObject() throw (Serialize*);
+  Serialize *TestDuplicateObject();
 private:
   friend class EDatastore;
   friend class EdsKey;
   friend class EdsReference;
+  friend class ParallelScan;
+  friend class IndexRebuild;
   ObjectHeader objhdr;
   ObjAddr objectaddress; // Node address for this object
   EDatastore* edatastore;        // datastore for this object
   int indexcount;  // number of keys in the object
   int instances;   // number of instances of object
-  Node *node;            // current node for reading/writing
-  int offset;      // current char position
+  std::string record;    // the object's data members, all nodes
+  std::string::size_type recpos; // current char position in record
   bool changed;          // true if user changed the object
   bool deleted;          // true if user deleted the object
   bool newobject;        // true if user is adding the object
   bool loaded;           // true if LoadObject called
   bool saved;            // true if SaveObject called
+  Serialize *original;   // instance loaded before this one
   static bool usingnew;  // true if object built with new
-  std::streampos filepos;// for saving file position
 
   // pointers to associate keys with objects
   Serialize *prevconstructed;
-  static Serialize *objconstructed;
-  static Serialize *objdestroyed;
+  // kept per thread, so that threads may read objects of their own
+  // side by side, see ParallelScan
+  static thread_local Serialize *objconstructed;
+  static thread_local Serialize *objdestroyed;
 
   LinkedList<EdsKey> keys;
   LinkedList<EdsKey> orgkeys; // original keys in the object
@@ -268,25 +331,67 @@ private:
 // DataFile class
 class DataFile : public NodeFile {
 public:
-  DataFile(const std::string& name) : NodeFile(name + ".eds") {}
+  DataFile(const std::string& name, bool shadowpaging = false)
+      : NodeFile(name + ".eds", shadowpaging) {}
+  DataFile(const std::string& name, std::shared_ptr<const PageVersion> pin)
+      : NodeFile(name + ".eds", pin) {}
 };
 
-// the EDatastore datastore
+// the EDatastore datastore. A shadow paged datastore makes each change
+// to an object a version of its two files that a snapshot can hold. A
+// datastore opened on a snapshot, on any thread, reads that version
+// while the datastore goes on changing, and keeps what it writes to
+// itself. The versions reach the disk on Commit, every so many
+// changes and on closing
 class EDatastore {
 public:
-  EDatastore(const std::string& name);
+  EDatastore(const std::string& name, bool shadowpaging = false);
+  EDatastore(const Snapshot& snap);
   ~EDatastore();
+  // close it, reporting errors writing the files
+  void Close();
+  // the datastore of the objects built with none named: the latest
+  // snapshot opened on this thread, else the latest one opened
   static EDatastore *OpenDatastore() {
-    return opendatastore;
+    return threaddatastore != 0 ? threaddatastore : opendatastore;
+  }
+  // the latest version, safe to call on any thread
+  Snapshot GetSnapshot() const;
+  void Commit();
+  // queue the writes to the two files for a thread that writes them
+  // behind, so saving an object does not wait for the disk. Commit
+  // waits for them by the policy, and so does closing
+  void WriteBehind(const FlushPolicy &policy = FlushPolicy());
+  // keep the indexes of class T in log-structured merge indexes, for a
+  // class that is mostly added to. Call it before the first object of
+  // the class is built, the indexes are known as such from then on
+  template <class T>
+  void UseLsm() {
+    lsmclasses.insert(typeid(T).name());
+  }
+  // hold the changes to the secondary indexes of class T in a change
+  // buffer, to go into the b-trees later in key order. Call it before
+  // the first object of the class is built, each time it is opened
+  template <class T>
+  void UseChangeBuffer() {
+    bufferedclasses.insert(typeid(T).name());
   }
 private:
+  void Publish();
   void GetObjectHeader(ObjAddr nd, ObjectHeader& objhdr);
+  // bytes of the object header in a data node, with the stamp only
+  // in a shadow paged datastore
+  int ObjectHeaderLength() const {
+    return datafile.ShadowPaging() ? sizeof(ObjectHeader) : plainheaderlength;
+  }
   void RebuildIndexes(ObjAddr nd) {
     rebuildnode = nd;
   }
   bool FindClass(Class *cls, NodeNbr *nd = 0);
   ClassID GetClassID(const char *classname);
-  // friend void BuildIndex();
+  SequenceNo NextSequence(const Serialize& pcls);
+  unsigned int NextStamp() const;
+  std::streampos SequenceAddr(const Class *cls) const;
   // private copy constructor & assignment prevent copies
   EDatastore(const EDatastore&) : datafile(std::string()), indexfile(std::string()) {}
   EDatastore& operator=(const EDatastore&) {
@@ -298,6 +403,8 @@ private:
   void AddClassToIndex(Class *cls);
 private:
   friend Serialize;
+  friend class ParallelScan;
+  friend class IndexRebuild;
   DataFile datafile;              // the object datafile
   IndexFile indexfile;            // the b-tree file
   LinkedList<Serialize> objects; // instantiated objects
@@ -305,8 +412,17 @@ private:
   LinkedList<EdsBtree> btrees;    // btrees in the datastore
                                   // for Index program to rebuild indexes
   ObjAddr rebuildnode;            // object being rebuilt
+  // records read ahead by Prefetch, with their class
+  std::map<NodeNbr, std::pair<ObjectHeader, std::string> > fetched;
+  std::set<std::string> lsmclasses; // classes with LSM indexes
+  std::set<std::string> bufferedclasses; // classes with change buffers
+  std::shared_ptr<const Snapshot> published; // latest version
+  int versions;                        // published since Commit
+  int adding;                          // objects added, not saved yet
+  bool closed;                         // by Close
   EDatastore *previousdatastore;       // previous open datastore
   static EDatastore *opendatastore;    // latest open datastore
+  static thread_local EDatastore *threaddatastore; // latest snapshot on this thread
 };
 
 // Serialize constructor using last declared datastore
@@ -319,6 +435,21 @@ inline Serialize::Serialize(EDatastore* db) : edatastore(db) {
   BuildObject();
 }
 
+// read one data member from the object's record
+inline void Serialize::EdsReadObject(void *buf, int length) {
+  std::string::size_type len = record.size() - recpos;
+  if (len > static_cast<std::string::size_type>(length)) {
+    len = length;
+  }
+  memcpy(buf, record.data() + recpos, len);
+  recpos += len;
+}
+
+// append one data member to the object's record
+inline void Serialize::EdsWriteObject(const void *buf, int length) {
+  record.append(reinterpret_cast<const char *>(buf), length);
+}
+
 template <class T>
 void ReadObject(T& t) {
   Serialize *oc = Serialize::ObjectBeingConstructed();
@@ -396,6 +527,13 @@ void Reference<T>::ReadObject() {
   ::ReadObject(oa);
   if (oa != 0) {
     obj = new T(oa);
+    Serialize *po = obj->LoadedInstance();
+    if (po != 0) {
+      // share the instance loaded already
+      delete obj;
+      obj = static_cast<T*>(po);
+      obj->AddReference();
+    }
   }
 }
 
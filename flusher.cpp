@@ -0,0 +1,294 @@
+/*
+ * filename: flusher.cpp
+ * describe: This is the implementation file of the write-behind flusher
+ *           of a node file, used by the datastore engine - EDatastore of
+ *           the open source project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   Needs C++11 for std::thread
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#include "stdafx.h"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "flusher.h"
+
+// the flushers of the files open in this process, by file name
+static std::mutex registrylock;
+static std::map<std::string, std::weak_ptr<Flusher> > registry;
+
+// open the file a second time for the thread to write on
+Flusher::Flusher(const std::string &filename, const FlushPolicy &pol) throw(BadFileOpen)
+    : name(filename), policy(pol), queuedbytes(0), batches(0), syncedbatches(0),
+      wantedbatches(0), lastsync(std::chrono::steady_clock::now()), failed(false), stopping(false) {
+#ifdef _WIN32
+  nfile.open(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+  if (!nfile.is_open()) {
+    throw BadFileOpen();
+  }
+#else
+  fd = open(filename.c_str(), O_RDWR);
+  if (fd < 0) {
+    throw BadFileOpen();
+  }
+#endif
+  worker = std::thread(&Flusher::Run, this);
+}
+
+Flusher::~Flusher() {
+  Stop();
+#ifdef _WIN32
+  nfile.close();
+#else
+  close(fd);
+#endif
+}
+
+std::shared_ptr<Flusher> Flusher::Start(const std::string &filename,
+                                        const FlushPolicy &policy) {
+  std::shared_ptr<Flusher> fl(new Flusher(filename, policy));
+  std::lock_guard<std::mutex> lk(registrylock);
+  registry[filename] = fl;
+  return fl;
+}
+
+std::shared_ptr<Flusher> Flusher::Find(const std::string &filename) {
+  std::lock_guard<std::mutex> lk(registrylock);
+  std::map<std::string, std::weak_ptr<Flusher> >::iterator it = registry.find(filename);
+  return it != registry.end() ? it->second.lock() : std::shared_ptr<Flusher>();
+}
+
+void Flusher::Stop() {
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    if (!worker.joinable()) {
+      return;
+    }
+    stopping = true;
+  }
+  wake.notify_all();
+  written.notify_all();
+  worker.join();
+
+  std::lock_guard<std::mutex> lk(registrylock);
+  std::map<std::string, std::weak_ptr<Flusher> >::iterator it = registry.find(name);
+  if (it != registry.end() && (it->second.expired() || it->second.lock().get() == this)) {
+    registry.erase(it);
+  }
+}
+
+// queue siz bytes for file address wh, merged with the queued writes
+// they overlap or touch
+void Flusher::Write(const void *buf, unsigned int siz, long wh) throw(FileWriteError) {
+  std::unique_lock<std::mutex> lk(lock);
+  while (queuedbytes >= policy.maxbytes && !failed && !stopping) {
+    written.wait(lk);
+  }
+  if (failed || stopping) {
+    throw FileWriteError();
+  }
+
+  long end = wh + (long)siz;
+  Extents::iterator head = queued.upper_bound(wh);
+  if (head != queued.begin()) {
+    Extents::iterator pv = head;
+    --pv;
+    if (pv->first + (long)pv->second.size() >= wh) {
+      head = pv;
+    }
+  }
+  if (head == queued.end() || head->first > end) {
+    queued[wh].assign(reinterpret_cast<const char *>(buf), siz);
+    queuedbytes += siz;
+  } else {
+    if (head->first > wh) {
+      head = queued.insert(head, Extents::value_type(wh, std::string()));
+    }
+    // the run from head takes in the writes up to the end of this one
+    Extents::iterator last = head;
+    for (++last; last != queued.end() && last->first <= end; ++last) {
+      end = std::max(end, last->first + (long)last->second.size());
+    }
+    std::string &run = head->second;
+    end = std::max(end, head->first + (long)run.size());
+    queuedbytes -= run.size();
+    run.resize(end - head->first);
+    Extents::iterator x = head;
+    for (++x; x != last; ++x) {
+      memcpy(&run[x->first - head->first], x->second.data(), x->second.size());
+      queuedbytes -= x->second.size();
+    }
+    memcpy(&run[wh - head->first], buf, siz);
+    queuedbytes += run.size();
+    ++head;
+    queued.erase(head, last);
+  }
+  lk.unlock();
+  wake.notify_one();
+}
+
+unsigned long Flusher::Batches() {
+  std::lock_guard<std::mutex> lk(lock);
+  return batches;
+}
+
+// copy the bytes of ext that fall in the siz bytes at wh into buf, the
+// bytes between the end of the file and a write after it read as zeros
+void Flusher::Lay(const Extents &ext, char *buf, unsigned int siz, long wh,
+                  unsigned int &done) {
+  Extents::const_iterator it = ext.upper_bound(wh);
+  if (it != ext.begin()) {
+    --it;
+  }
+  for (; it != ext.end() && it->first < wh + (long)siz; ++it) {
+    long from = std::max(it->first, wh);
+    long to = std::min(it->first + (long)it->second.size(), wh + (long)siz);
+    if (from >= to) {
+      continue;
+    }
+    if (from - wh > (long)done) {
+      memset(buf + done, 0, from - wh - done);
+    }
+    memcpy(buf + (from - wh), it->second.data() + (from - it->first), to - from);
+    if (to - wh > (long)done) {
+      done = static_cast<unsigned int>(to - wh);
+    }
+  }
+  if (it != ext.end() && done < siz) {
+    // a write after the bytes puts them all inside the file
+    memset(buf + done, 0, siz - done);
+    done = siz;
+  }
+}
+
+bool Flusher::Overlay(void *buf, unsigned int siz, long wh, unsigned int &done,
+                      unsigned long seen) {
+  std::lock_guard<std::mutex> lk(lock);
+  if (batches != seen) {
+    // a batch the read may have missed left the queue
+    return false;
+  }
+  char *cp = reinterpret_cast<char *>(buf);
+  Lay(writing, cp, siz, wh, done);
+  Lay(queued, cp, siz, wh, done);
+  return true;
+}
+
+void Flusher::Sync(bool disk) throw(FileWriteError) {
+  std::unique_lock<std::mutex> lk(lock);
+  unsigned long target = batches + (writing.empty() ? 0 : 1) + (queued.empty() ? 0 : 1);
+  disk = disk || policy.durability != FlushPolicy::Buffered;
+  if (disk && target > wantedbatches) {
+    // the thread waits for the disk up to the target
+    wantedbatches = target;
+    wake.notify_one();
+  }
+  while (!failed && (batches < target || (disk && syncedbatches < target))) {
+    written.wait(lk);
+  }
+  if (failed) {
+    throw FileWriteError();
+  }
+}
+
+// true if the thread is to wait for the disk now
+bool Flusher::DiskWait() const {
+  if (syncedbatches == batches) {
+    return false;
+  }
+  if (syncedbatches < wantedbatches) {
+    return true;
+  }
+  switch (policy.durability) {
+  case FlushPolicy::Synced:
+    return true;
+  case FlushPolicy::Grouped:
+    return stopping || std::chrono::steady_clock::now() >=
+                           lastsync + std::chrono::milliseconds(policy.interval);
+  default:
+    return false;
+  }
+}
+
+// the thread: take the queue as a batch and write it, and wait for the
+// disk as the policy says
+void Flusher::Run() {
+  std::unique_lock<std::mutex> lk(lock);
+  for (;;) {
+    while (queued.empty() && !stopping && !DiskWait()) {
+      if (syncedbatches != batches && policy.durability == FlushPolicy::Grouped) {
+        wake.wait_until(lk, lastsync + std::chrono::milliseconds(policy.interval));
+      } else {
+        wake.wait(lk);
+      }
+    }
+    if (!queued.empty()) {
+      writing.swap(queued);
+      queuedbytes = 0;
+      written.notify_all();
+      lk.unlock();
+      bool ok = WriteBatch();
+      lk.lock();
+      failed = failed || !ok;
+      writing.clear();
+      ++batches;
+      written.notify_all();
+    }
+    if (DiskWait()) {
+      unsigned long upto = batches;
+      lk.unlock();
+      SyncFile();
+      lk.lock();
+      syncedbatches = upto;
+      lastsync = std::chrono::steady_clock::now();
+      written.notify_all();
+    }
+    if (stopping && queued.empty() && !DiskWait()) {
+      break;
+    }
+  }
+}
+
+// write the batch, false if a write failed
+bool Flusher::WriteBatch() {
+  for (Extents::const_iterator it = writing.begin(); it != writing.end(); ++it) {
+    const char *cp = it->second.data();
+    unsigned int siz = static_cast<unsigned int>(it->second.size());
+#ifdef _WIN32
+    nfile.seekp(it->first);
+    nfile.write(cp, siz);
+    if (nfile.fail()) {
+      nfile.clear();
+      return false;
+    }
+#else
+    unsigned int done = 0;
+    while (done < siz) {
+      ssize_t n = pwrite(fd, cp + done, siz - done, it->first + done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      done += n;
+    }
+#endif
+  }
+#ifdef _WIN32
+  nfile.flush();
+#endif
+  return true;
+}
+
+void Flusher::SyncFile() {
+#ifdef _WIN32
+  nfile.flush();
+#else
+  fsync(fd);
+#endif
+}
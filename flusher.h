@@ -0,0 +1,106 @@
+/*
+ * filename: flusher.h
+ * describe: This is the definition file of the write-behind flusher of
+ *           a node file, used by the datastore engine - EDatastore of
+ *           the open source project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   Needs C++11 for std::thread
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#ifndef FLUSHER_H
+#define FLUSHER_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <string>
+#include "node.h"
+
+// how the flusher gets the writes of a file to the disk. Synced waits
+// for the disk after each batch it writes, Grouped once in each
+// interval for all the batches written in it, Buffered leaves it to
+// the operating system. A Sync of the file waits for what is queued
+// to be written and, unless Buffered, to reach the disk. The commit
+// of a shadow paged file waits for the disk whatever the policy, so
+// its meta page never reaches the disk before the pages it names
+struct FlushPolicy {
+  enum Durability { Synced, Grouped, Buffered };
+  Durability durability;
+  unsigned int interval; // milliseconds between the disk waits of Grouped
+  unsigned int maxbytes; // queued bytes before a writer waits
+  FlushPolicy(Durability d = Grouped, unsigned int ms = 10,
+              unsigned int mb = 4 << 20)
+      : durability(d), interval(ms), maxbytes(mb) {}
+};
+
+// write-behind of a node file. A write is queued in memory and the
+// writer goes on, a thread of the flusher writes the queue to the file
+// in batches. Queued writes that overlap or touch are merged into one,
+// so a batch is a write for each run of bytes. A writer waits while
+// the queue holds maxbytes. A read of the file lays the queued bytes
+// over what it reads, so it sees the writes that are not in the file
+// yet. Every node file open on the file in this process, the
+// snapshot readers too, reads through the same flusher
+class Flusher {
+public:
+  Flusher(const std::string &filename, const FlushPolicy &policy) throw(BadFileOpen);
+  ~Flusher();
+
+  void Write(const void *buf, unsigned int siz, long wh) throw(FileWriteError);
+  // batches written so far, read before reading the file for Overlay
+  unsigned long Batches();
+  // lay the queued bytes over done bytes read at wh, return the count
+  // now read, or false if a batch was written since batches
+  bool Overlay(void *buf, unsigned int siz, long wh, unsigned int &done,
+               unsigned long batches);
+  // wait for the queue to reach the file, and the disk by the policy
+  // or, if disk is true, whatever the policy
+  void Sync(bool disk = false) throw(FileWriteError);
+  // write out the queue and end the thread
+  void Stop();
+  // the flusher of a file, 0 = none
+  static std::shared_ptr<Flusher> Find(const std::string &filename);
+  static std::shared_ptr<Flusher> Start(const std::string &filename,
+                                        const FlushPolicy &policy);
+private:
+  typedef std::map<long, std::string> Extents; // by file address
+
+  Flusher(const Flusher &);
+  Flusher &operator=(const Flusher &);
+  void Run();
+  bool WriteBatch();
+  void SyncFile();
+  bool DiskWait() const;
+  static void Lay(const Extents &ext, char *buf, unsigned int siz, long wh,
+                  unsigned int &done);
+private:
+  std::string name;
+  FlushPolicy policy;
+#ifdef _WIN32
+  std::fstream nfile;
+#else
+  int fd;
+#endif
+  std::mutex lock;
+  std::condition_variable wake;    // the thread, there is work
+  std::condition_variable written; // the writers, a batch went out
+  Extents queued;                  // writes not taken by the thread yet
+  Extents writing;                 // the batch being written
+  unsigned int queuedbytes;
+  unsigned long batches;           // written
+  unsigned long syncedbatches;     // of them, on the disk
+  unsigned long wantedbatches;     // to be on the disk whatever the policy
+  std::chrono::steady_clock::time_point lastsync;
+  bool failed;                     // a write failed, the writes are lost
+  bool stopping;
+  std::thread worker;
+};
+
+#endif
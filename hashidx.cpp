@@ -0,0 +1,614 @@
+/*
+ * filename: hashidx.cpp
+ * describe: This is the implementation file of the extendible hash
+ *           index classes, used by the datastore engine - EDatastore
+ *           of the open source project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   No dependency. Handy
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#include "stdafx.h"
+#include <string>
+#include "edatastore.h"
+
+// the saved directory starts with this, then its bucket nodes
+const unsigned int directorymagic = 0x48534445;
+
+// most hash bits a directory uses, fuller buckets overflow
+const unsigned short maxdepth = 16;
+
+// open a hash index, keys without a normalized image cannot be hashed
+HashIndex::HashIndex(IndexFile &ndx, Class *cls, EdsKey *ky)
+    throw(BadKeylength, BadIndex) : EdsBtree(ndx, cls, ky) {
+  bucket = 0;
+  slot = 0;
+  if (!nullkey->normalized) {
+    throw BadIndex();
+  }
+  if (header.rootnode != 0) {
+    // read the directory
+    if (!ChainTagged(header.rootnode, directorymagic)) {
+      throw BadIndex();
+    }
+    std::string buf;
+    ReadChain(header.rootnode, buf);
+    directory.resize((buf.size() - sizeof directorymagic) / sizeof(NodeNbr));
+    memcpy(&directory[0], buf.data() + sizeof directorymagic,
+           directory.size() * sizeof(NodeNbr));
+  }
+}
+
+HashIndex::~HashIndex() {
+  delete bucket;
+}
+
+// write the directory to its node chain
+void HashIndex::WriteDirectory() {
+  std::string buf(reinterpret_cast<const char *>(&directorymagic), sizeof directorymagic);
+  buf.append(reinterpret_cast<const char *>(&directory[0]),
+             directory.size() * sizeof(NodeNbr));
+  header.rootnode = WriteChain(header.rootnode, buf);
+  WriteHeader();
+}
+
+// the directory slot of a key, the low bits of its hash
+unsigned int HashIndex::Slot(const EdsKey *key) const {
+  return KeyHash(key->keyimage) & (directory.size() - 1);
+}
+
+// true if s is the first directory slot of its bucket. A bucket that
+// uses d bits of the hash is in every slot with the same low d bits,
+// so a later slot has the bucket of the slot without its top bit
+bool HashIndex::FirstSlot(unsigned int s) const {
+  unsigned int top = 1;
+  while (top * 2 <= s) {
+    top *= 2;
+  }
+  return s == 0 || directory[s - top] != directory[s];
+}
+
+// find a key in the index. The bucket nodes are read raw and only
+// the keys with the same hash are built and compared, the bucket of
+// a found key is loaded when a cursor function needs it
+bool HashIndex::Find(EdsKey *keypointer) {
+  ResetCursor();
+  postpos = 0;
+  if (directory.empty() || keypointer->isPartialKey()) {
+    return false;
+  }
+  keypointer->Normalize();
+  const unsigned int hash = static_cast<unsigned int>(KeyHash(keypointer->keyimage));
+  const int hdrsize = sizeof(NodeNbr) + sizeof(HashBucket::BucketHeader);
+  const int stride = BucketEntryLength();
+  char page[nodelength];
+  HashBucket::BucketHeader hdr;
+  EdsKey *ky = 0;
+  bool found = false;
+
+  currnode = directory[Slot(keypointer)];
+  while (currnode != 0 && !found) {
+    index.ReadAt(page, nodelength, Node::NodeAddress(currnode));
+    memcpy(&hdr, page + sizeof(NodeNbr), sizeof hdr);
+    for (int i = 0; i < hdr.keycount && !found; i++) {
+      const char *entry = page + hdrsize + i * stride;
+      unsigned int eh;
+      memcpy(&eh, entry, sizeof eh);
+      if (eh != hash) continue;
+
+      // same hash, read the key
+      if (ky == 0) {
+        ky = MakeKeyBuffer();
+      }
+      index.Seek(Node::NodeAddress(currnode) + (entry + sizeof eh - page));
+      ky->ReadKey(index);
+      ky->Normalize();
+      if (ky->Compare(*keypointer) == 0) {
+        memcpy(&keypointer->fileaddr, entry + sizeof eh + header.keylength, sizeof(NodeNbr));
+        slot = hash & ((1u << hdr.depth) - 1);
+        nodepending = true;
+        pendingkey = i;
+        found = true;
+      }
+    }
+    if (!found) {
+      memcpy(&currnode, page, sizeof(NodeNbr));
+    }
+  }
+  delete ky;
+  return found;
+}
+
+// load the bucket a search stopped at
+void HashIndex::LoadBucket() {
+  if (nodepending) {
+    nodepending = false;
+    delete bucket;
+    bucket = new HashBucket(this, currnode);
+    bucket->currkey = bucket->keys.FindEntry(pendingkey);
+  }
+}
+
+// insert a key into the index, false if it is there already. A
+// secondary key that is there already gets the object's address
+// added to its posting list instead
+bool HashIndex::Insert(EdsKey *keypointer) {
+  NodeNbr fa = keypointer->fileaddr;
+  if (Find(keypointer)) {
+    LoadBucket();
+    keypointer->fileaddr = fa;
+    bool added = indexno != 0 && AddPosting(bucket->currkey, fa);
+    if (added) {
+      bucket->MarkNodeChanged();
+    }
+    ResetCursor();
+    return added;
+  }
+  if (directory.empty()) {
+    // the first bucket
+    directory.push_back(index.NewNode());
+    HashBucket first(this, directory[0]);
+    first.header = HashBucket::BucketHeader();
+    first.MarkNodeChanged();
+    WriteDirectory();
+  }
+
+  for (;;) {
+    unsigned int s = Slot(keypointer);
+    HashBucket *bk = new HashBucket(this, directory[s]);
+    while (bk->isFull() && bk->NextNode() != 0) {
+      NodeNbr nd = bk->NextNode();
+      delete bk;
+      bk = new HashBucket(this, nd);
+    }
+    if (bk->isFull() && bk->header.depth == maxdepth) {
+      // chain an overflow bucket
+      NodeNbr nd = index.NewNode();
+      bk->SetNextNode(nd);
+      delete bk;
+      bk = new HashBucket(this, nd);
+      bk->header = HashBucket::BucketHeader();
+      bk->header.depth = maxdepth;
+    }
+    if (!bk->isFull()) {
+      EdsKey *newkey = keypointer->MakeKey();
+      *newkey = *keypointer;
+      newkey->postings = 0;
+      bk->keys.AppendEntry(newkey);
+      bk->header.keycount++;
+      bk->MarkNodeChanged();
+      delete bk;
+      if (filter != 0) {
+        filter->Add(keypointer->keyimage);
+      }
+      return true;
+    }
+    Split(bk, s);
+    delete bk;
+  }
+}
+
+// split a full bucket on the next bit of the hash into a new bucket
+void HashIndex::Split(HashBucket *bk, unsigned int s) {
+  unsigned short depth = bk->header.depth;
+  if ((1u << depth) == directory.size()) {
+    // the bucket uses all the bits of the directory, double it
+    directory.insert(directory.end(), directory.begin(), directory.end());
+  }
+
+  NodeNbr nd = index.NewNode();
+  HashBucket sibling(this, nd);
+  sibling.header = HashBucket::BucketHeader();
+  sibling.header.depth = bk->header.depth = depth + 1;
+
+  // move the keys with the new bit set
+  EdsKey *ky = bk->keys.FirstEntry();
+  while (ky != 0) {
+    EdsKey *nx = bk->keys.NextEntry(ky);
+    if ((KeyHash(ky->keyimage) >> depth) & 1) {
+      bk->keys.RemoveEntry(ky);
+      bk->header.keycount--;
+      sibling.keys.AppendEntry(ky);
+      sibling.header.keycount++;
+    }
+    ky = nx;
+  }
+  bk->MarkNodeChanged();
+  sibling.MarkNodeChanged();
+
+  // the slots with the new bit set go to the new bucket
+  unsigned int first = (s & ((1u << depth) - 1)) | (1u << depth);
+  for (unsigned int i = first; i < directory.size(); i += 2u << depth) {
+    directory[i] = nd;
+  }
+  WriteDirectory();
+}
+
+// delete a key from the index
+void HashIndex::Delete(EdsKey *keypointer) {
+  NodeNbr fa = keypointer->fileaddr;
+  if (Find(keypointer)) {
+    LoadBucket();
+    keypointer->fileaddr = fa;
+    EdsKey *entry = bucket->currkey;
+    if (indexno != 0 && (entry->postings != 0 || entry->fileaddr != fa)) {
+      // the key stays while other objects have it
+      if (RemovePosting(entry, fa)) {
+        bucket->MarkNodeChanged();
+      }
+    } else {
+      if (filter != 0) {
+        filter->Remove();
+      }
+      bucket->keys.RemoveEntry(entry);
+      delete entry;
+      bucket->header.keycount--;
+      bucket->MarkNodeChanged();
+    }
+  }
+  ResetCursor();
+}
+
+// the addresses of all the objects with a key, ascending
+int HashIndex::FindAll(EdsKey *keypointer, std::vector<NodeNbr> &addrs) {
+  addrs.clear();
+  if (MayContain(keypointer) && Find(keypointer)) {
+    LoadBucket();
+    ReadPostings(bucket->currkey, addrs);
+  }
+  return addrs.size();
+}
+
+// the objects with key values from lo to hi in a bitmap. A range
+// reads every bucket, the keys are in no order
+int HashIndex::FindBitmap(EdsKey *lo, EdsKey *hi, Bitmap &bm) {
+  std::vector<NodeNbr> addrs;
+  if (lo == hi) {
+    FindAll(lo, addrs);
+    bm.Assign(addrs);
+    return bm.Count();
+  }
+  bm.Clear();
+  lo->Normalize();
+  if (hi != 0) {
+    hi->Normalize();
+  }
+  for (unsigned int s = 0; s < directory.size(); s++) {
+    NodeNbr nd = FirstSlot(s) ? directory[s] : 0;
+    while (nd != 0) {
+      HashBucket bk(this, nd);
+      for (EdsKey *ky = bk.keys.FirstEntry(); ky != 0; ky = bk.keys.NextEntry()) {
+        if ((lo->isNullValue() || ky->Compare(*lo) >= 0) &&
+            (hi == 0 || ky->Compare(*hi) <= 0)) {
+          ReadPostings(ky, addrs);
+          for (std::vector<NodeNbr>::size_type i = 0; i < addrs.size(); i++) {
+            bm.Add(addrs[i]);
+          }
+        }
+      }
+      nd = bk.NextNode();
+    }
+  }
+  return bm.Count();
+}
+
+// the buckets keep no counts, the objects in a range are counted
+// from its bitmap
+unsigned int HashIndex::Count(EdsKey *lo, EdsKey *hi) {
+  Bitmap bm;
+  return FindBitmap(lo, hi, bm);
+}
+
+unsigned int HashIndex::Rank(EdsKey *keypointer) {
+  return Count(nullkey, keypointer) - Count(keypointer, keypointer);
+}
+
+// step n objects from the first, in bucket order
+EdsKey *HashIndex::SeekToOffset(unsigned int n) {
+  EdsKey *ky = First();
+  for (; ky != 0 && n > 0; n--) {
+    ky = Next();
+  }
+  return ky;
+}
+
+// replace the index with one holding keys sorted by value and object
+// address. They go into new buckets under a new directory, then the
+// old buckets and directory are freed, unless reclaim is false for an
+// index that may be damaged
+void HashIndex::Rebuild(const std::vector<EdsKey *> &sorted, bool reclaim) {
+  ResetCursor();
+  std::vector<NodeNbr> olddir;
+  olddir.swap(directory);
+  NodeNbr oldroot = header.rootnode;
+  header.rootnode = 0;
+
+  std::vector<EdsKey *> entries;
+  MakeEntries(sorted, entries);
+  if (filter != 0) {
+    filter->Reset(entries.size());
+  }
+  for (std::vector<EdsKey *>::size_type i = 0; i < entries.size(); i++) {
+    EdsKey *entry = entries[i];
+    NodeNbr postings = entry->postings;
+    Insert(entry);
+    if (postings != 0 && Find(entry)) {
+      // the key's other objects are in the posting list made for it
+      LoadBucket();
+      bucket->currkey->postings = postings;
+      bucket->MarkNodeChanged();
+      ResetCursor();
+    }
+    delete entry;
+  }
+  WriteHeader();
+  if (reclaim) {
+    FreeBuckets(olddir, oldroot);
+  }
+  index.Flush();
+}
+
+// free the buckets of a directory with their overflow buckets and
+// posting lists, then the chain of the directory
+void HashIndex::FreeBuckets(const std::vector<NodeNbr> &dir, NodeNbr root) {
+  const int hdrsize = sizeof(NodeNbr) + sizeof(HashBucket::BucketHeader);
+  const int stride = BucketEntryLength();
+  const int capacity = (nodedatalength - sizeof(HashBucket::BucketHeader)) / stride;
+  std::vector<bool> freed(index.HighestNode() + 1, false);
+  char page[nodelength];
+  for (std::vector<NodeNbr>::size_type s = 0; s < dir.size(); s++) {
+    NodeNbr nd = dir[s];
+    while (nd != 0 && nd < freed.size() && !freed[nd]) {
+      freed[nd] = true;
+      index.ReadAt(page, nodelength, Node::NodeAddress(nd));
+      HashBucket::BucketHeader hdr;
+      memcpy(&hdr, page + sizeof(NodeNbr), sizeof hdr);
+      if (indexno != 0 && hdr.keycount <= capacity) {
+        for (int i = 0; i < hdr.keycount; i++) {
+          NodeNbr pnode;
+          memcpy(&pnode, page + hdrsize + i * stride + sizeof(unsigned int) +
+                 header.keylength + sizeof(NodeNbr), sizeof(NodeNbr));
+          // a node of packed lists is freed once
+          if (pnode < freed.size() && !freed[pnode]) {
+            freed[pnode] = true;
+            WriteChain(pnode, std::string());
+          }
+        }
+      }
+      NodeNbr next;
+      memcpy(&next, page, sizeof(NodeNbr));
+      Node node(&index, nd);
+      node.MarkNodeDeleted();
+      nd = next;
+    }
+  }
+  if (ChainTagged(root, directorymagic)) {
+    WriteChain(root, std::string());
+  }
+}
+
+void HashIndex::ResetCursor() {
+  delete bucket;
+  bucket = 0;
+  nodepending = false;
+  postnode = 0;
+}
+
+// build the key filter from the keys in the buckets
+void HashIndex::BuildFilter() {
+  std::vector<std::string> images;
+  for (unsigned int s = 0; s < directory.size(); s++) {
+    NodeNbr nd = FirstSlot(s) ? directory[s] : 0;
+    while (nd != 0) {
+      HashBucket bk(this, nd);
+      for (EdsKey *ky = bk.keys.FirstEntry(); ky != 0; ky = bk.keys.NextEntry()) {
+        images.push_back(ky->keyimage);
+      }
+      nd = bk.NextNode();
+    }
+  }
+  filter->Reset(images.size());
+  for (std::vector<std::string>::size_type i = 0; i < images.size(); i++) {
+    filter->Add(images[i]);
+  }
+}
+
+// return the current key
+EdsKey *HashIndex::Current() {
+  LoadBucket();
+  if (bucket == 0 || bucket->currkey == 0) {
+    return 0;
+  }
+  return CursorKey(bucket->currkey);
+}
+
+// move to the first key in bucket nd of slot s or after it,
+// nd = 0 to start at the next slot
+EdsKey *HashIndex::ScanForward(unsigned int s, NodeNbr nd) {
+  ResetCursor();
+  for (;;) {
+    while (nd == 0) {
+      if (++s >= directory.size()) {
+        return 0;
+      }
+      if (FirstSlot(s)) {
+        nd = directory[s];
+      }
+    }
+    bucket = new HashBucket(this, nd);
+    bucket->currkey = bucket->keys.FirstEntry();
+    if (bucket->currkey != 0) {
+      slot = s;
+      return Current();
+    }
+    nd = bucket->NextNode();
+    delete bucket;
+    bucket = 0;
+  }
+}
+
+// move to the last key before bucket nd of slot s, nd = 0 for the
+// last key of the slot
+EdsKey *HashIndex::ScanBackward(unsigned int s, NodeNbr nd) {
+  ResetCursor();
+  for (;;) {
+    // the buckets of the slot before nd
+    std::vector<NodeNbr> chain;
+    for (NodeNbr bn = directory[s]; bn != 0 && bn != nd; ) {
+      chain.push_back(bn);
+      index.ReadAt(&bn, sizeof(NodeNbr), Node::NodeAddress(bn));
+    }
+    while (!chain.empty()) {
+      bucket = new HashBucket(this, chain.back());
+      chain.pop_back();
+      bucket->currkey = bucket->keys.LastEntry();
+      if (bucket->currkey != 0) {
+        slot = s;
+        return Current();
+      }
+      delete bucket;
+      bucket = 0;
+    }
+    do {
+      if (s == 0) {
+        return 0;
+      }
+    } while (!FirstSlot(--s));
+    nd = 0;
+  }
+}
+
+// return the first key in directory order
+EdsKey *HashIndex::First() {
+  postpos = 0;
+  if (directory.empty()) {
+    ResetCursor();
+    return 0;
+  }
+  return ScanForward(0, directory[0]);
+}
+
+// return the last key in directory order
+EdsKey *HashIndex::Last() {
+  postpos = -1;
+  if (directory.empty()) {
+    ResetCursor();
+    return 0;
+  }
+  unsigned int s = directory.size() - 1;
+  while (!FirstSlot(s)) {
+    --s;
+  }
+  return ScanBackward(s, 0);
+}
+
+// return the next key
+EdsKey *HashIndex::Next() {
+  LoadBucket();
+  if (bucket == 0 || bucket->currkey == 0) {
+    return First();
+  }
+  if (bucket->currkey->postings != 0) {
+    // the next object with the same key
+    CursorKey(bucket->currkey);
+    if (postpos + 1 < (int)postlist.size()) {
+      ++postpos;
+      return CursorKey(bucket->currkey);
+    }
+  }
+  postpos = 0;
+  bucket->currkey = bucket->keys.NextEntry(bucket->currkey);
+  if (bucket->currkey != 0) {
+    return Current();
+  }
+  return ScanForward(slot, bucket->NextNode());
+}
+
+// return the previous key
+EdsKey *HashIndex::Previous() {
+  LoadBucket();
+  if (bucket == 0 || bucket->currkey == 0) {
+    return Last();
+  }
+  if (bucket->currkey->postings != 0) {
+    // the previous object with the same key
+    CursorKey(bucket->currkey);
+    if (postpos > 0) {
+      --postpos;
+      return CursorKey(bucket->currkey);
+    }
+  }
+  postpos = -1;
+  bucket->currkey = bucket->keys.PrevEntry(bucket->currkey);
+  if (bucket->currkey != 0) {
+    return Current();
+  }
+  return ScanBackward(slot, bucket->GetNodeNbr());
+}
+
+// read a bucket and its keys
+HashBucket::HashBucket(HashIndex *hx, NodeNbr nd) : Node(&(hx->GetIndexFile()), nd) {
+  hindex = hx;
+  currkey = 0;
+  capacity = (nodedatalength - sizeof(BucketHeader)) / hindex->BucketEntryLength();
+  IndexFile &nx = hindex->GetIndexFile();
+  long nad = NodeAddress() + Node::NodeHeaderSize();
+
+  if (nad + (long)sizeof(BucketHeader) > nx.FileLength()) {
+    // appending a new node
+    nx.WriteData(&header, sizeof(BucketHeader), nad);
+    return;
+  }
+  // read the header
+  nx.ReadData(&header, sizeof(BucketHeader), nad);
+
+  // read the keys, each after its hash and followed by its file
+  // address and for secondary keys its posting list node
+  for (int i = 0; i < header.keycount; i++) {
+    EdsKey *thiskey = hindex->MakeKeyBuffer();
+    unsigned int hash;
+    nx.ReadData(&hash, sizeof hash);
+    thiskey->ReadKey(nx);
+    thiskey->Normalize();
+    nx.ReadData(&thiskey->fileaddr, sizeof(NodeNbr));
+    if (hindex->Indexno() != 0) {
+      nx.ReadData(&thiskey->postings, sizeof(NodeNbr));
+    }
+    keys.AppendEntry(thiskey);
+  }
+}
+
+// write a changed bucket and free its keys
+HashBucket::~HashBucket() {
+  IndexFile &nx = hindex->GetIndexFile();
+  if (nodechanged) {
+    long nad = NodeAddress() + Node::NodeHeaderSize();
+    nx.WriteData(&header, sizeof(BucketHeader), nad);
+  }
+  EdsKey *thiskey = keys.FirstEntry();
+  while (thiskey != 0) {
+    if (nodechanged) {
+      unsigned int hash = static_cast<unsigned int>(KeyHash(thiskey->keyimage));
+      nx.WriteData(&hash, sizeof hash);
+      thiskey->WriteKey(nx);
+      nx.WriteData(&thiskey->fileaddr, sizeof(NodeNbr));
+      if (hindex->Indexno() != 0) {
+        nx.WriteData(&thiskey->postings, sizeof(NodeNbr));
+      }
+    }
+    delete thiskey;
+    thiskey = keys.NextEntry();
+  }
+  if (nodechanged) {
+    // pad the node
+    int residual = nodedatalength - sizeof(BucketHeader) -
+                   header.keycount * hindex->BucketEntryLength();
+    char *fill = new char[residual];
+    memset(fill, 0, residual);
+    nx.WriteData(fill, residual);
+    delete[] fill;
+  }
+}
@@ -0,0 +1,95 @@
+/*
+ * filename: hashidx.h
+ * describe: This is the definition file of the extendible hash index
+ *           classes, an index for exact-match searches used by the
+ *           datastore engine - EDatastore of the open source project
+ *           EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   No dependency. Handy
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#ifndef HASHIDX_H
+#define HASHIDX_H
+
+class HashBucket;
+
+// extendible hash index. The low bits of a key's hash select a
+// directory slot and the slot holds the bucket node the key is in,
+// so a search reads one node. Each entry in a bucket starts with the
+// low 32 bits of the hash and a search scans the raw node for them,
+// reading a key only when they match. A full bucket splits on one more bit
+// of the hash, doubling the directory when it already used them all.
+// The directory is kept in memory and in a chain of index nodes
+// recorded as the root of the tree header. Scans visit the buckets
+// in directory order, not in key order
+class HashIndex : public EdsBtree {
+public:
+  HashIndex(IndexFile &ndx, Class *cls, EdsKey *ky) throw(BadKeylength, BadIndex);
+  ~HashIndex();
+
+  bool Insert(EdsKey *keypointer);
+  void Delete(EdsKey *keypointer);
+  bool Find(EdsKey *keypointer);
+  int FindAll(EdsKey *keypointer, std::vector<NodeNbr> &addrs);
+  int FindBitmap(EdsKey *lo, EdsKey *hi, Bitmap &bm);
+  EdsKey *Current();
+  EdsKey *First();
+  EdsKey *Last();
+  EdsKey *Next();
+  EdsKey *Previous();
+  unsigned int Count(EdsKey *lo, EdsKey *hi);
+  bool CountsKept() const { return false; }
+  unsigned int Rank(EdsKey *keypointer);
+  EdsKey *SeekToOffset(unsigned int n);
+  void Rebuild(const std::vector<EdsKey *> &sorted, bool reclaim = true);
+  // bytes of a key in a bucket: its hash, the key, its file address
+  // and for secondary keys its posting list node
+  int BucketEntryLength() const {
+    return sizeof(unsigned int) + GetKeyLength() + sizeof(NodeNbr) * (1 + (Indexno() != 0));
+  }
+protected:
+  void ResetCursor();
+  void BuildFilter();
+private:
+  unsigned int Slot(const EdsKey *key) const;
+  void LoadBucket();
+  bool FirstSlot(unsigned int s) const;
+  void WriteDirectory();
+  void Split(HashBucket *bk, unsigned int s);
+  EdsKey *ScanForward(unsigned int s, NodeNbr nd);
+  EdsKey *ScanBackward(unsigned int s, NodeNbr nd);
+  void FreeBuckets(const std::vector<NodeNbr> &dir, NodeNbr root);
+private:
+  std::vector<NodeNbr> directory; // bucket of each hash suffix
+  HashBucket *bucket;             // bucket of the current key
+  unsigned int slot;              // its first directory slot
+};
+
+// hash index bucket. Keys that share all the hash bits of the deepest
+// directory go on in overflow buckets linked through the next node
+class HashBucket : Node {
+public: // like TRNode
+  ~HashBucket();
+private:
+  HashBucket(HashIndex *hx, NodeNbr node);
+  bool isFull() const { return header.keycount >= capacity; }
+private:
+  friend class HashIndex;
+  struct BucketHeader {
+    unsigned short depth;    // hash bits shared by the keys
+    unsigned short keycount; // number of keys in this bucket
+    BucketHeader() {
+      depth = keycount = 0;
+    }
+  } header;
+  int capacity;            // most keys in a bucket
+  EdsKey *currkey;         // current key
+  HashIndex *hindex;       // hash index that owns this bucket
+  LinkedList<EdsKey> keys; // the keys in this bucket
+};
+
+#endif
@@ -13,17 +13,24 @@
 
 #include "stdafx.h"
 #include "edatastore.h"
+#include "date.h"
 
 EdsKey::EdsKey(NodeNbr fa) {
   fileaddr = fa;
   lowernode = 0;
+  lowercount = 0;
+  postings = 0;
+  objects = 1;
   indexno = 0;
   relatedclass = 0;
+  filterrate = 0;
+  normalized = false;
   if (Serialize::objconstructed != 0)  {
     // register the key with the object being built
     Serialize::objconstructed->RegisterKey(this);
-    // assign index number based on position in object
-    indexno = ++Serialize::objconstructed->indexcount;
+    // assign index number based on position in object,
+    // the first key is the primary key
+    indexno = Serialize::objconstructed->indexcount++;
   }
 }
 
@@ -31,9 +38,51 @@ EdsKey& EdsKey::operator=(const EdsKey& key) {
   if (this != &key) {
     fileaddr = key.fileaddr;
     lowernode = key.lowernode;
+    lowercount = key.lowercount;
+    postings = key.postings;
+    objects = key.objects;
     indexno = key.indexno;
     keylength = key.keylength;
     relatedclass = key.relatedclass;
+    filterrate = key.filterrate;
+    keyimage = key.keyimage;
+    normalized = key.normalized;
   }
   return *this;
 }
+
+// append a number to a key image, most significant byte first. The
+// sign bit of integers is flipped so negatives sort below positives,
+// negative floats have all their bits flipped to reverse their order
+void EncodeNumber(const void *value, int length, bool integer,
+                  bool issigned, std::string& image) {
+  static const unsigned short one = 1;
+  static const bool littleendian = *reinterpret_cast<const unsigned char *>(&one) == 1;
+  unsigned char bytes[maxnumberlength];
+  if (length > maxnumberlength) {
+    return;
+  }
+  const unsigned char *vp = reinterpret_cast<const unsigned char *>(value);
+  for (int i = 0; i < length; i++) {
+    bytes[i] = littleendian ? vp[length - 1 - i] : vp[i];
+  }
+
+  if (integer) {
+    if (issigned) {
+      bytes[0] ^= 0x80;
+    }
+  } else if (bytes[0] & 0x80) {
+    for (int i = 0; i < length; i++) {
+      bytes[i] = ~bytes[i];
+    }
+  } else {
+    bytes[0] |= 0x80;
+  }
+  image.append(reinterpret_cast<const char *>(bytes), length);
+}
+
+bool KeyEncoder<Date, false>::Encode(const Date& value, std::string& image, KeyLength) {
+  unsigned int ymd = value.Year() * 10000 + value.Month() * 100 + value.Day();
+  EncodeNumber(&ymd, sizeof ymd, true, false, image);
+  return true;
+}
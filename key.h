@@ -15,6 +15,75 @@
 #define KEY_H
 
 #include <typeinfo>
+#include <limits>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <algorithm>
+
+class Date;
+
+// encode a built-in number as an order-preserving byte string
+// longest number EncodeNumber takes, a wider type has no image
+const int maxnumberlength = 8;
+void EncodeNumber(const void *value, int length, bool integer,
+                  bool issigned, std::string& image);
+
+// KeyEncoder appends the order-preserving byte image of a key value to
+// image: big-endian integers with the sign bit flipped, IEEE floats with
+// the sign handled, strings NUL terminated. Two key values compare the
+// same way as their images compare with memcmp. Encode returns false for
+// types without a normalized form, which compare through operator>
+template <class T, bool = std::numeric_limits<T>::is_specialized>
+struct KeyEncoder {
+  static bool Encode(const T&, std::string&, KeyLength) {
+    return false;
+  }
+};
+
+template <class T>
+struct KeyEncoder<T, true> {
+  static bool Encode(const T& value, std::string& image, KeyLength) {
+    if (sizeof(T) > maxnumberlength)
+      return false;
+    if (!std::numeric_limits<T>::is_integer &&
+        (!std::numeric_limits<T>::is_iec559 || (sizeof(T) != 4 && sizeof(T) != 8)))
+      return false;
+    // -0.0 and 0.0 are the same key
+    T nbr = value == T(0) ? T(0) : value;
+    EncodeNumber(&nbr, sizeof(T), std::numeric_limits<T>::is_integer,
+                 std::numeric_limits<T>::is_signed, image);
+    return true;
+  }
+};
+
+template <>
+struct KeyEncoder<std::string, false> {
+  static bool Encode(const std::string& value, std::string& image, KeyLength len) {
+    // the stored key is truncated to the key length and ends at the
+    // first NUL, the terminator keeps concatenated images in order
+    std::string::size_type n = std::min(value.find('\0'), value.size());
+    n = std::min(n, static_cast<std::string::size_type>(len));
+    image.append(value.data(), n);
+    image += '\0';
+    return true;
+  }
+};
+
+template <>
+struct KeyEncoder<ObjAddr, false> {
+  static bool Encode(const ObjAddr& value, std::string& image, KeyLength) {
+    NodeNbr nd = value.oa;
+    EncodeNumber(&nd, sizeof(NodeNbr), true, false, image);
+    return true;
+  }
+};
+
+// dates encode as the number yyyymmdd
+template <>
+struct KeyEncoder<Date, false> {
+  static bool Encode(const Date& value, std::string& image, KeyLength);
+};
 
 // EdsKey abstract base class
 class EdsKey {
@@ -24,10 +93,20 @@ public:
   virtual int operator>(const EdsKey& key) const = 0;
   virtual int operator==(const EdsKey& key) const = 0;
   virtual EdsKey& operator=(const EdsKey& key);
+  int Compare(const EdsKey& key) const;
+  void Normalize() {
+    keyimage.clear();
+    normalized = EncodeKey(keyimage);
+  }
 
   void Relate(const type_info *ti) {
     relatedclass = ti;
   }
+  // keep a key filter with the index, fprate is the share of missing
+  // keys it lets through to a search, 0 for no filter
+  void SetFilter(double fprate) {
+    filterrate = fprate;
+  }
   KeyLength GetKeyLength() const {
     return keylength;
   }
@@ -42,6 +121,27 @@ private:
   virtual bool isObjectAddress() const = 0;
   virtual const ObjAddr *ObjectAddress() const = 0;
   virtual EdsKey *MakeKey() const = 0;
+  virtual bool EncodeKey(std::string& image) const = 0;
+  // partial keys search on their leading components only
+  virtual bool isPartialKey() const {
+    return false;
+  }
+  virtual bool HasPrefix(const EdsKey&) const {
+    return false;
+  }
+  virtual void ResetPrefix() {}
+  virtual EdsBtree *MakeBtree(IndexFile& ndx, Class *cls) {
+    return new EdsBtree(ndx, cls, this);
+  }
+  // the index of a class kept in log-structured indexes, see
+  // EDatastore::UseLsm. A key without a normalized form keeps a b-tree
+  virtual EdsBtree *MakeLsm(IndexFile& ndx, Class *cls) {
+    Normalize();
+    if (!normalized) {
+      return MakeBtree(ndx, cls);
+    }
+    return new LsmIndex(ndx, cls, this);
+  }
 protected:
   const type_info *relatedclass;
   IndexNo indexno; // 0=primary key, >0 =secondary key
@@ -49,12 +149,41 @@ protected:
 private:
   friend class EDatastore;
   friend class EdsBtree;
+  template <class T> friend class TypedBtree;
   friend class TRNode;
+  friend class HashIndex;
+  friend class HashBucket;
+  friend class BitmapIndex;
+  friend class LsmIndex;
   friend class Serialize;
+  friend class IndexRebuild;
   NodeNbr fileaddr;    // object address -> by this key
   NodeNbr lowernode;   // lower node of keys > this key
+  unsigned int lowercount; // objects in the subtree of the lower node
+  NodeNbr postings;    // index node listing more objects with this
+                       // key, secondary keys only
+  unsigned int objects; // objects with this key
+  double filterrate;    // false positive rate of the index's key filter
+  std::string keyimage; // order-preserving image of the key value
+  bool normalized;      // true if keyimage holds the key value
 };
 
+// compare two keys: < 0, 0 or > 0. Normalized keys compare with a
+// single memcmp of their images, others through the virtual operators
+inline int EdsKey::Compare(const EdsKey& key) const {
+  if (normalized && key.normalized) {
+    std::string::size_type len1 = keyimage.size();
+    std::string::size_type len2 = key.keyimage.size();
+    int rtn = memcmp(keyimage.data(), key.keyimage.data(), std::min(len1, len2));
+    if (rtn == 0)
+      rtn = (len1 > len2) - (len1 < len2);
+    return rtn;
+  }
+  if (*this > key)
+    return 1;
+  return *this == key ? 0 : -1;
+}
+
 // Key class
 template <class T>
 class Key : public EdsKey {
@@ -77,6 +206,9 @@ public:
   virtual void WriteKey(IndexFile& ndx);
   virtual void ReadKey(IndexFile& ndx);
   bool isNullValue() const;
+  bool EncodeKey(std::string& image) const {
+    return KeyEncoder<T>::Encode(ky, image, keylength);
+  }
 private:
   bool isObjectAddress() const {
     return typeid(T) == typeid(ObjAddr);
@@ -86,6 +218,7 @@ private:
   }
   void CopyKeyData(const EdsKey *key);
   EdsKey *MakeKey() const;
+  EdsBtree *MakeBtree(IndexFile& ndx, Class *cls);
 private:
   T ky;
 };
@@ -129,6 +262,14 @@ EdsKey *Key<T>::MakeKey() const {
   return newkey;
 }
 
+// arithmetic keys get a b-tree specialized for their type
+template <class T>
+EdsBtree *Key<T>::MakeBtree(IndexFile& ndx, Class *cls) {
+  typedef typename std::conditional<std::is_arithmetic<T>::value,
+                                    TypedBtree<T>, EdsBtree>::type Btree;
+  return new Btree(ndx, cls, this);
+}
+
 // ReadKey must be specialized if key != simple data type
 template <class T>
 void Key<T>::ReadKey(IndexFile& ndx) {
@@ -148,6 +289,37 @@ bool Key<T>::isNullValue() const {
   return ky == T(0);
 }
 
+// key kept in a hash index: an exact-match search reads about one
+// bucket node, but the objects come in no particular order in scans
+// and searches on a partial key find nothing
+template <class T>
+class HashKey : public Key<T> {
+public:
+  HashKey(const T& key) : Key<T>(key) {}
+private:
+  EdsBtree *MakeBtree(IndexFile& ndx, Class *cls) {
+    return new HashIndex(ndx, cls, this);
+  }
+  EdsBtree *MakeLsm(IndexFile& ndx, Class *cls) {
+    return MakeBtree(ndx, cls);
+  }
+};
+
+// key kept in a bitmap index: for values shared by many objects,
+// whose bitmaps FindBitmap returns to combine with and, or, and not
+template <class T>
+class BitmapKey : public Key<T> {
+public:
+  BitmapKey(const T& key) : Key<T>(key) {}
+private:
+  EdsBtree *MakeBtree(IndexFile& ndx, Class *cls) {
+    return new BitmapIndex(ndx, cls, this);
+  }
+  EdsBtree *MakeLsm(IndexFile& ndx, Class *cls) {
+    return MakeBtree(ndx, cls);
+  }
+};
+
 // specialized Key<string> template member functions
 inline Key<std::string>::Key(const std::string& key) : ky(key) {
   keylength = (KeyLength)key.length();
@@ -231,6 +403,9 @@ private:
   bool isNullValue() const {
     return ky1.isNullValue() && ky2.isNullValue();
   }
+  bool EncodeKey(std::string& image) const {
+    return ky1.EncodeKey(image) && ky2.EncodeKey(image);
+  }
 private:
   Key<T1> ky1;
   Key<T2> ky2;
@@ -282,4 +457,338 @@ EdsKey *CatKey<T1, T2>::MakeKey() const {
   return newkey;
 }
 
+// KeyPart reads, writes and tests one CompositeKey component. Simple
+// types are stored as their bytes, strings in the width of their
+// initial value like Key<std::string>
+template <class T>
+struct KeyPart {
+  enum { width = sizeof(T) };
+  static KeyLength Width(const T&) {
+    return width;
+  }
+  static void Read(IndexFile& ndx, T& value, KeyLength) {
+    ndx.ReadData(&value, sizeof(T));
+  }
+  static void Write(IndexFile& ndx, const T& value, KeyLength) {
+    ndx.WriteData(&value, sizeof(T));
+  }
+  static bool isNullValue(const T& value) {
+    return value == T(0);
+  }
+};
+
+template <>
+struct KeyPart<std::string> {
+  enum { width = 0 };
+  static KeyLength Width(const std::string& value) {
+    return (KeyLength)value.length();
+  }
+  static void Read(IndexFile& ndx, std::string& value, KeyLength len) {
+    std::string buf(len, '\0');
+    if (len > 0)
+      ndx.ReadData(&buf[0], len);
+    value = buf.c_str();
+  }
+  static void Write(IndexFile& ndx, const std::string& value, KeyLength len) {
+    std::string buf(value, 0, len);
+    buf.resize(len);
+    ndx.WriteData(buf.data(), len);
+  }
+  static bool isNullValue(const std::string& value) {
+    return value.empty();
+  }
+};
+
+// compile-time key length of the fixed-width components
+template <class... Ts>
+struct KeyPartsWidth {
+  enum { value = 0 };
+};
+
+template <class T, class... Ts>
+struct KeyPartsWidth<T, Ts...> {
+  enum { value = KeyPart<T>::width + KeyPartsWidth<Ts...>::value };
+};
+
+// KeyParts<I, N> applies an operation to components I..N-1 of a
+// CompositeKey. Searches pass n, the number of components in use
+template <int I, int N>
+struct KeyParts {
+  template <class Tuple>
+  static void Widths(const Tuple& kys, KeyLength *widths) {
+    widths[I] = KeyPart<typename std::tuple_element<I, Tuple>::type>::Width(std::get<I>(kys));
+    KeyParts<I + 1, N>::Widths(kys, widths);
+  }
+  template <class Tuple>
+  static int Compare(const Tuple& kys1, const Tuple& kys2, int n) {
+    if (I >= n)
+      return 0;
+    if (std::get<I>(kys1) > std::get<I>(kys2))
+      return 1;
+    if (!(std::get<I>(kys1) == std::get<I>(kys2)))
+      return -1;
+    return KeyParts<I + 1, N>::Compare(kys1, kys2, n);
+  }
+  template <class Tuple>
+  static void Read(IndexFile& ndx, Tuple& kys, const KeyLength *widths) {
+    KeyPart<typename std::tuple_element<I, Tuple>::type>::Read(ndx, std::get<I>(kys), widths[I]);
+    KeyParts<I + 1, N>::Read(ndx, kys, widths);
+  }
+  template <class Tuple>
+  static void Write(IndexFile& ndx, const Tuple& kys, const KeyLength *widths) {
+    KeyPart<typename std::tuple_element<I, Tuple>::type>::Write(ndx, std::get<I>(kys), widths[I]);
+    KeyParts<I + 1, N>::Write(ndx, kys, widths);
+  }
+  template <class Tuple>
+  static bool Encode(const Tuple& kys, const KeyLength *widths, int n, std::string& image) {
+    if (I >= n)
+      return true;
+    return KeyEncoder<typename std::tuple_element<I, Tuple>::type>::Encode(std::get<I>(kys), image, widths[I]) &&
+           KeyParts<I + 1, N>::Encode(kys, widths, n, image);
+  }
+  template <class Tuple>
+  static bool isNullValue(const Tuple& kys, int n) {
+    if (I >= n)
+      return true;
+    return KeyPart<typename std::tuple_element<I, Tuple>::type>::isNullValue(std::get<I>(kys)) &&
+           KeyParts<I + 1, N>::isNullValue(kys, n);
+  }
+};
+
+template <int N>
+struct KeyParts<N, N> {
+  template <class Tuple>
+  static void Widths(const Tuple&, KeyLength *) {}
+  template <class Tuple>
+  static int Compare(const Tuple&, const Tuple&, int) {
+    return 0;
+  }
+  template <class Tuple>
+  static void Read(IndexFile&, Tuple&, const KeyLength *) {}
+  template <class Tuple>
+  static void Write(IndexFile&, const Tuple&, const KeyLength *) {}
+  template <class Tuple>
+  static bool Encode(const Tuple&, const KeyLength *, int, std::string&) {
+    return true;
+  }
+  template <class Tuple>
+  static bool isNullValue(const Tuple&, int) {
+    return true;
+  }
+};
+
+// Composite key class: any number of components compared left to
+// right. The components are plain values, so only the composite key
+// itself is registered as an index of its object.
+// SetPrefix(n) makes the next search use the first n components: the
+// object found is the first one with those values, NextObject goes on
+// from there in key order
+template <class... Ts>
+class CompositeKey : public EdsKey {
+public:
+  typedef std::tuple<Ts...> KeyValues;
+  enum { components = sizeof...(Ts) };
+  enum { fixedlength = KeyPartsWidth<Ts...>::value };
+
+  CompositeKey(const Ts&... keys);
+  ~CompositeKey() {}
+
+  EdsKey& operator=(const EdsKey& key);
+  int operator>(const EdsKey& key) const;
+  int operator==(const EdsKey& key) const;
+
+  template <int I>
+  typename std::tuple_element<I, KeyValues>::type& KeyValue() {
+    return std::get<I>(kys);
+  }
+  template <int I>
+  const typename std::tuple_element<I, KeyValues>::type& KeyValue() const {
+    return std::get<I>(kys);
+  }
+  template <int I>
+  void SetKeyValue(const typename std::tuple_element<I, KeyValues>::type& key) {
+    std::get<I>(kys) = key;
+  }
+  void SetPrefix(int n) {
+    prefix = (n > 0 && n < components) ? n : components;
+  }
+private:
+  bool isObjectAddress() const {
+    return false;
+  }
+  const ObjAddr *ObjectAddress() const {
+    return 0;
+  }
+  void CopyKeyData(const EdsKey *key);
+  void ReadKey(IndexFile& ndx) {
+    KeyParts<0, components>::Read(ndx, kys, widths);
+  }
+  void WriteKey(IndexFile& ndx) {
+    KeyParts<0, components>::Write(ndx, kys, widths);
+  }
+  bool isNullValue() const {
+    return !isPartialKey() && KeyParts<0, components>::isNullValue(kys, components);
+  }
+  EdsKey *MakeKey() const;
+  bool EncodeKey(std::string& image) const {
+    return KeyParts<0, components>::Encode(kys, widths, prefix, image);
+  }
+  bool isPartialKey() const {
+    return prefix < components;
+  }
+  bool HasPrefix(const EdsKey& key) const;
+  void ResetPrefix() {
+    prefix = components;
+  }
+  int CompareKeys(const CompositeKey<Ts...>& key) const;
+
+  KeyValues kys;
+  KeyLength widths[sizeof...(Ts)];
+  int prefix; // number of components used in searches
+};
+
+template <class... Ts>
+CompositeKey<Ts...>::CompositeKey(const Ts&... keys) : kys(keys...) {
+  prefix = components;
+  KeyParts<0, components>::Widths(kys, widths);
+  keylength = 0;
+  for (int i = 0; i < components; i++)
+    keylength += widths[i];
+}
+
+// a partial key sorts below the keys it is a prefix of
+template <class... Ts>
+int CompositeKey<Ts...>::CompareKeys(const CompositeKey<Ts...>& key) const {
+  int rtn = KeyParts<0, components>::Compare(kys, key.kys, std::min(prefix, key.prefix));
+  if (rtn == 0)
+    rtn = (prefix > key.prefix) - (prefix < key.prefix);
+  return rtn;
+}
+
+template <class... Ts>
+int CompositeKey<Ts...>::operator>(const EdsKey& key) const {
+  return CompareKeys(static_cast<const CompositeKey<Ts...>&>(key)) > 0;
+}
+
+template <class... Ts>
+int CompositeKey<Ts...>::operator==(const EdsKey& key) const {
+  return CompareKeys(static_cast<const CompositeKey<Ts...>&>(key)) == 0;
+}
+
+// true if the leading components equal those of a partial key
+template <class... Ts>
+bool CompositeKey<Ts...>::HasPrefix(const EdsKey& key) const {
+  const CompositeKey<Ts...> *ckp = static_cast<const CompositeKey<Ts...>*>(&key);
+  return KeyParts<0, components>::Compare(kys, ckp->kys, ckp->prefix) == 0;
+}
+
+template <class... Ts>
+void CompositeKey<Ts...>::CopyKeyData(const EdsKey *key) {
+  const CompositeKey<Ts...> *ckp = static_cast<const CompositeKey<Ts...>*>(key);
+  kys = ckp->kys;
+  for (int i = 0; i < components; i++)
+    widths[i] = ckp->widths[i];
+  prefix = ckp->prefix;
+}
+
+template <class... Ts>
+EdsKey& CompositeKey<Ts...>::operator=(const EdsKey& key) {
+  if (this != &key) {
+    EdsKey::operator=(key);
+    CopyKeyData(&key);
+  }
+  return *this;
+}
+
+template <class... Ts>
+EdsKey *CompositeKey<Ts...>::MakeKey() const {
+  CompositeKey<Ts...> *newkey = new CompositeKey<Ts...>(Ts()...);
+  for (int i = 0; i < components; i++)
+    newkey->widths[i] = widths[i];
+  newkey->SetKeyLength(keylength);
+  return newkey;
+}
+
+// the search of a TypedBtree, here where EdsKey is complete
+template <class T>
+bool TypedBtree<T>::Find(EdsKey *keypointer) {
+  if (GetKeyLength() != sizeof(T)) {
+    return EdsBtree::Find(keypointer);
+  }
+  MergeChanges(keypointer);
+
+  const T value = static_cast<Key<T> *>(keypointer)->KeyValue();
+  const int hdrsize = sizeof(NodeNbr) + sizeof(TRNode::TRNodeHeader);
+  char page[nodelength];
+  TRNode::TRNodeHeader hdr;
+  int lo = 0;
+
+  delete trnode;
+  trnode = 0;
+  nodepending = false;
+  oldcurrnode = 0;
+  oldcurrkey = 0;
+  postnode = 0;
+  postpos = 0;
+
+  path.clear();
+  currnode = Root();
+  while (currnode) {
+    index.ReadAt(page, nodelength, Node::NodeAddress(currnode));
+    memcpy(&hdr, page + sizeof(NodeNbr), sizeof hdr);
+    const int stride = EntryLength(hdr.isleaf);
+    const char *entries = page + hdrsize;
+
+    // find the first key >= the search key
+    int hi = hdr.keycount;
+    lo = 0;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      T ky;
+      memcpy(&ky, entries + mid * stride, sizeof(T));
+      if (ky < value) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    if (lo < hdr.keycount) {
+      T ky;
+      memcpy(&ky, entries + lo * stride, sizeof(T));
+      if (!(value < ky)) {
+        // search key is equal to a key in the node
+        NodeNbr kfa;
+        memcpy(&kfa, entries + lo * stride + sizeof(T), sizeof(NodeNbr));
+        keypointer->fileaddr = kfa;
+        oldcurrnode = 0;
+        oldcurrkey = 0;
+        nodepending = true;
+        pendingkey = lo;
+        return true;
+      }
+    }
+
+    if (lo < hdr.keycount || lo == 0) {
+      // search key is < a key in the node, save its position
+      oldcurrnode = hdr.isleaf ? 0 : currnode;
+      oldcurrkey = hdr.isleaf ? 0 : lo;
+    }
+    if (hdr.isleaf) break;
+
+    // go down to the lower node of the key before the position
+    NodeNbr lnode = hdr.lowernode;
+    if (lo > 0) {
+      memcpy(&lnode, entries + (lo - 1) * stride + sizeof(T) + sizeof(NodeNbr), sizeof(NodeNbr));
+    }
+    Descend(lnode);
+  }
+
+  if (currnode) {
+    nodepending = true;
+    pendingkey = lo < hdr.keycount ? lo : -1;
+  }
+  return false;
+}
+
 #endif
\ No newline at end of file
@@ -207,6 +207,11 @@ void LinkedList<T>::RemoveEntry(T *entry) {
 // insert an entry into the linked list ahead of another
 template <class T>
 void LinkedList<T>::InsertEntry(T *entry, T *curr) {
+  if (curr == 0) {
+    // no entry to insert ahead of, append
+    AppendEntry(entry);
+    return;
+  }
   FindEntry(curr);
   InsertEntry(entry);
 }
@@ -0,0 +1,920 @@
+/*
+ * filename: lsm.cpp
+ * describe: This is the implementation file of the log-structured merge
+ *           index class, used by the datastore engine - EDatastore of the
+ *           open source project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   Needs C++11 for std::thread
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#include "stdafx.h"
+#include <cstring>
+#include <algorithm>
+#include "edatastore.h"
+
+// the saved list of runs starts with this, then the log and the runs
+const unsigned int lsmmagic = 0x4d534445;
+
+// entries in a full memtable
+const unsigned int memtablekeys = 4096;
+
+// runs of level 0 that start a merge, and that make the writer wait
+// for the merge running
+const unsigned int level0runs = 4;
+const unsigned int level0stall = 8;
+
+// each level below level 1 holds this many times the one above
+const unsigned int levelratio = 10;
+
+// false positive rate of the run filters of keys that set none
+const double runfprate = 0.01;
+
+// open a log-structured merge index, its keys must have a normalized
+// image
+LsmIndex::LsmIndex(IndexFile &ndx, Class *cls, EdsKey *ky)
+    throw(BadKeylength, BadIndex) : EdsBtree(ndx, cls, ky), compacted(false) {
+  log.head = log.tail = 0;
+  log.pos = 0;
+  cursorstate = 0;
+  curkey = 0;
+  job = 0;
+  // the runs have filters of their own
+  fprate = ky->filterrate > 0 ? ky->filterrate : runfprate;
+  delete filter;
+  filter = 0;
+  if (!nullkey->normalized) {
+    throw BadIndex();
+  }
+  if (header.rootnode != 0) {
+    if (!ChainTagged(header.rootnode, lsmmagic)) {
+      throw BadIndex();
+    }
+    ReadManifest();
+    ReplayLog(memtable, log);
+  } else if (!index.ReadOnly()) {
+    // an empty list marks the index as one of these
+    WriteManifest();
+  }
+}
+
+// the memtable stays in the log, the merges due are waited for. An
+// error in a merge is thrown here, after the tree header is written
+void LsmIndex::Close() {
+  if (closed) {
+    return;
+  }
+  std::exception_ptr error;
+  while (job != 0) {
+    try {
+      Poll(true);
+    } catch (...) {
+      error = std::current_exception();
+      break;
+    }
+  }
+  try {
+    EdsBtree::Close();
+  } catch (...) {
+    if (!error) error = std::current_exception();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+LsmIndex::~LsmIndex() {
+  try {
+    Close();
+  } catch (...) {
+    // lost, call Close to know
+  }
+  ClearTable(memtable);
+  for (std::vector<Run *>::size_type r = 0; r < runs.size(); r++) {
+    delete runs[r]->filter;
+    delete runs[r];
+  }
+  delete curkey;
+}
+
+bool LsmIndex::Kept(IndexFile &ndx, const Class *cls, IndexNo ino) {
+  TreeHeader th;
+  ndx.ReadData(&th, sizeof(TreeHeader),
+               cls->headeraddr + (std::streamoff)(ino * sizeof(TreeHeader)));
+  unsigned int magic = 0;
+  if (th.rootnode != 0 && th.rootnode <= ndx.HighestNode()) {
+    ndx.ReadAt(&magic, sizeof magic, Node::NodeAddress(th.rootnode) + chainhdr);
+  }
+  return magic == lsmmagic;
+}
+
+// read the list of runs with their filters and the first node of the log
+void LsmIndex::ReadManifest() {
+  std::string buf;
+  ReadChain(header.rootnode, buf);
+  const char *lp = buf.data() + sizeof lsmmagic;
+  unsigned int count;
+  memcpy(&log.head, lp, sizeof(NodeNbr));
+  lp += sizeof(NodeNbr);
+  memcpy(&count, lp, sizeof count);
+  lp += sizeof count;
+  for (unsigned int r = 0; r < count; r++) {
+    NodeNbr rn;
+    memcpy(&rn, lp, sizeof rn);
+    lp += sizeof rn;
+    std::string rb;
+    ReadChain(rn, rb);
+    const char *cp = rb.data();
+    unsigned int hdr[5];
+    memcpy(hdr, cp, sizeof hdr);
+    cp += sizeof hdr;
+    Run *run = NewRun(hdr[0]);
+    run->runnode = rn;
+    run->entries = hdr[1];
+    run->bytes = hdr[2];
+    run->widest = hdr[3];
+    memcpy(&run->filternode, cp, sizeof(NodeNbr));
+    cp += sizeof(NodeNbr);
+    run->nodes.resize(hdr[4]);
+    memcpy(&run->nodes[0], cp, hdr[4] * sizeof(NodeNbr));
+    cp += hdr[4] * sizeof(NodeNbr);
+    for (unsigned int n = 0; n < hdr[4]; n++) {
+      unsigned short len;
+      memcpy(&len, cp, sizeof len);
+      run->fences.push_back(std::string(cp + sizeof len, len));
+      cp += sizeof len + len;
+    }
+    runs.push_back(run);
+    std::string fb;
+    if (run->filternode != 0) {
+      ReadChain(run->filternode, fb);
+    }
+    if (!run->filter->Load(fb)) {
+      FilterRun(run);
+    }
+  }
+}
+
+// write a new run's entry of the list of runs, its nodes and first
+// entries, to a chain of its own, and its filter to another. A run
+// does not change, so they are written once
+void LsmIndex::WriteRunEntry(Run *run) {
+  if (run->filternode == 0) {
+    std::string fb;
+    run->filter->Save(fb);
+    run->filternode = WriteChain(0, fb);
+  }
+  unsigned int hdr[] = { run->level, run->entries, run->bytes, run->widest,
+                         static_cast<unsigned int>(run->nodes.size()) };
+  std::string buf(reinterpret_cast<const char *>(hdr), sizeof hdr);
+  buf.append(reinterpret_cast<const char *>(&run->filternode), sizeof(NodeNbr));
+  buf.append(reinterpret_cast<const char *>(&run->nodes[0]),
+             run->nodes.size() * sizeof(NodeNbr));
+  for (std::vector<std::string>::size_type n = 0; n < run->fences.size(); n++) {
+    unsigned short len = run->fences[n].size();
+    buf.append(reinterpret_cast<const char *>(&len), sizeof len);
+    buf.append(run->fences[n]);
+  }
+  run->runnode = WriteChain(0, buf);
+}
+
+// write the list of runs and the first node of the log to the root
+// chain. The list holds the first node of each run's entry, so only
+// the entries of the runs new since the last time are written
+void LsmIndex::WriteManifest() {
+  std::string buf(reinterpret_cast<const char *>(&lsmmagic), sizeof lsmmagic);
+  unsigned int count = runs.size();
+  buf.append(reinterpret_cast<const char *>(&log.head), sizeof(NodeNbr));
+  buf.append(reinterpret_cast<const char *>(&count), sizeof count);
+  for (std::vector<Run *>::size_type r = 0; r < runs.size(); r++) {
+    if (runs[r]->runnode == 0) {
+      WriteRunEntry(runs[r]);
+    }
+    buf.append(reinterpret_cast<const char *>(&runs[r]->runnode), sizeof(NodeNbr));
+  }
+  header.rootnode = WriteChain(header.rootnode, buf);
+  WriteHeader();
+}
+
+// add an entry to the memtable and the log, a full memtable is
+// written out as a run
+void LsmIndex::Put(EdsKey *keypointer, bool deleted) {
+  if (LogKey(memtable, log, keypointer, deleted)) {
+    WriteManifest();
+  }
+  if (memtable.size() >= memtablekeys) {
+    FlushMemtable();
+  }
+}
+
+// write the memtable out as a run of level 0 and start the log over
+void LsmIndex::FlushMemtable() {
+  std::vector<Entry> entries;
+  for (KeyTable::iterator it = memtable.begin(); it != memtable.end(); ++it) {
+    // with no run below, a deletion has nothing to hide
+    if (it->second.deleted && runs.empty()) continue;
+    Entry e;
+    e.name = it->first;
+    e.deleted = it->second.deleted;
+    e.key = it->second.key;
+    e.keyaddr = 0;
+    entries.push_back(e);
+  }
+  if (!entries.empty()) {
+    runs.insert(runs.begin(), WriteRun(entries, 0));
+  }
+  FreeLog(log);
+  ClearTable(memtable);
+  WriteManifest();
+  if (job != 0 && Level0() >= level0stall) {
+    // the merges fall behind, wait for the one running
+    Poll(true);
+  }
+  Schedule();
+}
+
+LsmIndex::Run *LsmIndex::NewRun(unsigned int level) {
+  Run *run = new Run;
+  run->level = level;
+  run->entries = run->bytes = run->widest = 0;
+  run->filternode = 0;
+  run->runnode = 0;
+  run->filter = new KeyFilter(fprate);
+  run->cached = -1;
+  return run;
+}
+
+// write sorted entries from memory to the nodes of a new run, one
+// node after the other with WriteData
+LsmIndex::Run *LsmIndex::WriteRun(const std::vector<Entry> &entries, unsigned int level) {
+  Run *run = NewRun(level);
+  run->filter->Reset(entries.size());
+  // the first entry of each node
+  std::vector<std::vector<Entry>::size_type> starts;
+  int used = nodelength;
+  for (std::vector<Entry>::size_type i = 0; i < entries.size(); i++) {
+    int len = KeyEntryLength(entries[i].name);
+    if (used + len > nodelength) {
+      starts.push_back(i);
+      used = sizeof(NodeNbr);
+    }
+    used += len;
+    run->entries++;
+    run->bytes += len;
+    run->widest = std::max(run->widest, static_cast<unsigned int>(len));
+  }
+  starts.push_back(entries.size());
+  for (std::vector<Entry>::size_type k = 0; k + 1 < starts.size(); k++) {
+    run->nodes.push_back(index.NewNode());
+  }
+
+  char fill[nodelength];
+  memset(fill, 0, nodelength);
+  for (std::vector<NodeNbr>::size_type k = 0; k < run->nodes.size(); k++) {
+    NodeNbr next = k + 1 < run->nodes.size() ? run->nodes[k + 1] : 0;
+    index.WriteData(&next, sizeof next, Node::NodeAddress(run->nodes[k]));
+    used = sizeof(NodeNbr);
+    for (std::vector<Entry>::size_type i = starts[k]; i < starts[k + 1]; i++) {
+      const Entry &e = entries[i];
+      char op = e.deleted ? lostentry : keptentry;
+      unsigned short len = e.name.size();
+      index.WriteData(&op, 1);
+      index.WriteData(&len, sizeof len);
+      index.WriteData(e.name.data(), len);
+      e.key->WriteKey(index);
+      used += KeyEntryLength(e.name);
+      run->filter->Add(e.name.substr(0, len - sizeof(NodeNbr)));
+    }
+    index.WriteData(fill, nodelength - used);
+    run->fences.push_back(entries[starts[k]].name);
+  }
+  return run;
+}
+
+// build the filter of a run from its entries
+void LsmIndex::FilterRun(Run *run) {
+  run->filter->Reset(run->entries);
+  for (std::vector<NodeNbr>::size_type n = 0; n < run->nodes.size(); n++) {
+    const char *page = RunNode(run, n);
+    int off = sizeof(NodeNbr);
+    int keyoff;
+    bool deleted;
+    std::string name;
+    while (ReadKeyEntry(page, off, header.keylength, deleted, name, keyoff)) {
+      run->filter->Add(name.substr(0, name.size() - sizeof(NodeNbr)));
+    }
+  }
+  if (run->filternode != 0) {
+    // save it again in the chain the run's entry names
+    std::string fb;
+    run->filter->Save(fb);
+    run->filternode = WriteChain(run->filternode, fb);
+  }
+}
+
+// free the nodes of a run and its saved filter
+void LsmIndex::FreeRun(Run *run) {
+  for (std::vector<NodeNbr>::size_type n = 0; n < run->nodes.size(); n++) {
+    Node node(&index, run->nodes[n]);
+    node.MarkNodeDeleted();
+  }
+  if (run->filternode != 0) {
+    WriteChain(run->filternode, std::string());
+  }
+  if (run->runnode != 0) {
+    WriteChain(run->runnode, std::string());
+  }
+  delete run->filter;
+  delete run;
+}
+
+// node n of a run, the run keeps the last one read
+const char *LsmIndex::RunNode(Run *run, unsigned int n) {
+  if (run->cached != (int)n) {
+    run->page.resize(nodelength);
+    run->cached = -1;
+    index.ReadAt(&run->page[0], nodelength, Node::NodeAddress(run->nodes[n]));
+    run->cached = n;
+  }
+  return &run->page[0];
+}
+
+// the entry of a run nearest to from in the direction of the search,
+// from itself too when inclusive. The fences give the one node it can
+// be in, or the next one. An empty from searches back from the end
+bool LsmIndex::Seek(Run *run, const std::string &from, bool forward, bool inclusive,
+                    Entry &entry) {
+  const std::vector<std::string> &fences = run->fences;
+  int off, keyoff;
+  bool deleted;
+  std::string name;
+  if (forward) {
+    long n = std::upper_bound(fences.begin(), fences.end(), from) - fences.begin() - 1;
+    for (n = std::max(n, 0L); n < (long)run->nodes.size(); n++) {
+      const char *page = RunNode(run, n);
+      off = sizeof(NodeNbr);
+      while (ReadKeyEntry(page, off, header.keylength, deleted, name, keyoff)) {
+        int cmp = name.compare(from);
+        if (cmp > 0 || (cmp == 0 && inclusive)) {
+          entry.name = name;
+          entry.deleted = deleted;
+          entry.key = 0;
+          entry.keyaddr = Node::NodeAddress(run->nodes[n]) + keyoff;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  long n = run->nodes.size() - 1;
+  if (!from.empty()) {
+    n = (inclusive ? std::upper_bound(fences.begin(), fences.end(), from)
+                   : std::lower_bound(fences.begin(), fences.end(), from)) - fences.begin() - 1;
+  }
+  for (; n >= 0; n--) {
+    const char *page = RunNode(run, n);
+    bool found = false;
+    off = sizeof(NodeNbr);
+    while (ReadKeyEntry(page, off, header.keylength, deleted, name, keyoff)) {
+      int cmp = from.empty() ? -1 : name.compare(from);
+      if (cmp > 0 || (cmp == 0 && !inclusive)) break;
+      entry.name = name;
+      entry.deleted = deleted;
+      entry.key = 0;
+      entry.keyaddr = Node::NodeAddress(run->nodes[n]) + keyoff;
+      found = true;
+    }
+    if (found) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the entry nearest to from in the memtable and the runs that the
+// object still has. Of the entries with the same name the newest one
+// counts, and a deletion sends the search on past it. With only, the
+// search is for the entries of that key image: the runs whose filter
+// does not have it are skipped and an entry of another image ends it
+bool LsmIndex::Step(const std::string &from, bool forward, bool inclusive, Entry &entry,
+                    const std::string *only) {
+  std::string at = from;
+  for (;;) {
+    bool found;
+    KeyTable::iterator it;
+    if (forward) {
+      it = inclusive ? memtable.lower_bound(at) : memtable.upper_bound(at);
+      found = it != memtable.end();
+    } else {
+      it = at.empty() ? memtable.end()
+                      : inclusive ? memtable.upper_bound(at) : memtable.lower_bound(at);
+      found = it != memtable.begin();
+      if (found) {
+        --it;
+      }
+    }
+    if (found) {
+      entry.name = it->first;
+      entry.deleted = it->second.deleted;
+      entry.key = it->second.key;
+      entry.keyaddr = 0;
+    }
+    // a run's entry counts only if it is nearer than those of the
+    // newer runs
+    Entry e;
+    for (std::vector<Run *>::size_type r = 0; r < runs.size(); r++) {
+      if (only != 0 && !runs[r]->filter->MayContain(*only)) continue;
+      if (Seek(runs[r], at, forward, inclusive, e) &&
+          (!found || (forward ? e.name < entry.name : e.name > entry.name))) {
+        entry = e;
+        found = true;
+      }
+    }
+    if (!found || (only != 0 &&
+                   entry.name.compare(0, entry.name.size() - sizeof(NodeNbr), *only) != 0)) {
+      return false;
+    }
+    if (!entry.deleted) {
+      return true;
+    }
+    at = entry.name;
+    inclusive = false;
+  }
+}
+
+// move the cursor to an entry and return its key
+EdsKey *LsmIndex::Position(const Entry &entry) {
+  cursor = entry.name;
+  cursorstate = 1;
+  if (curkey == 0) {
+    curkey = MakeKeyBuffer();
+  }
+  if (entry.key != 0) {
+    *curkey = *entry.key;
+  } else {
+    index.Seek(entry.keyaddr);
+    curkey->ReadKey(index);
+    curkey->keyimage.assign(entry.name, 0, entry.name.size() - sizeof(NodeNbr));
+    curkey->normalized = true;
+  }
+  curkey->indexno = indexno;
+  curkey->fileaddr = NameAddress(entry.name);
+  curkey->postings = 0;
+  return curkey;
+}
+
+// insert a key into the index, false if it is a primary key there
+// already. Only a primary key is searched for, the runs whose filter
+// does not have it are not read
+bool LsmIndex::Insert(EdsKey *keypointer) {
+  Poll(false);
+  keypointer->Normalize();
+  Entry e;
+  if (indexno == 0 && Step(keypointer->keyimage, true, true, e, &keypointer->keyimage)) {
+    return false;
+  }
+  Put(keypointer, false);
+  return true;
+}
+
+// delete a key from the index, by adding the entry of its deletion
+void LsmIndex::Delete(EdsKey *keypointer) {
+  Poll(false);
+  keypointer->Normalize();
+  Put(keypointer, true);
+}
+
+// find the first object with a key. When there is none the cursor
+// goes to the first key after it, as does a partial key
+bool LsmIndex::Find(EdsKey *keypointer) {
+  Poll(false);
+  keypointer->Normalize();
+  Entry e;
+  if (!keypointer->isPartialKey() &&
+      Step(keypointer->keyimage, true, true, e, &keypointer->keyimage)) {
+    Position(e);
+    keypointer->fileaddr = curkey->fileaddr;
+    return true;
+  }
+  cursor = keypointer->keyimage;
+  cursorstate = 2;
+  return false;
+}
+
+// the addresses of all the objects with a key, ascending
+int LsmIndex::FindAll(EdsKey *keypointer, std::vector<NodeNbr> &addrs) {
+  addrs.clear();
+  Poll(false);
+  keypointer->Normalize();
+  if (keypointer->isPartialKey()) {
+    return 0;
+  }
+  std::string at = keypointer->keyimage;
+  bool inclusive = true;
+  Entry e;
+  while (Step(at, true, inclusive, e, &keypointer->keyimage)) {
+    addrs.push_back(NameAddress(e.name));
+    at = e.name;
+    inclusive = false;
+  }
+  return addrs.size();
+}
+
+// the objects with key values from lo to hi in key order, hi = 0 for
+// no upper bound and a null lo from the first key
+void LsmIndex::Range(EdsKey *lo, EdsKey *hi, std::vector<NodeNbr> &addrs) {
+  addrs.clear();
+  Poll(false);
+  std::string at;
+  if (!lo->isNullValue()) {
+    lo->Normalize();
+    at = lo->keyimage;
+  }
+  if (hi != 0) {
+    hi->Normalize();
+  }
+  bool inclusive = true;
+  Entry e;
+  while (Step(at, true, inclusive, e) &&
+         (hi == 0 ||
+          e.name.compare(0, e.name.size() - sizeof(NodeNbr), hi->keyimage) <= 0)) {
+    addrs.push_back(NameAddress(e.name));
+    at = e.name;
+    inclusive = false;
+  }
+}
+
+int LsmIndex::FindBitmap(EdsKey *lo, EdsKey *hi, Bitmap &bm) {
+  std::vector<NodeNbr> addrs;
+  if (lo == hi) {
+    FindAll(lo, addrs);
+    bm.Assign(addrs);
+    return bm.Count();
+  }
+  Range(lo, hi, addrs);
+  bm.Clear();
+  for (std::vector<NodeNbr>::size_type i = 0; i < addrs.size(); i++) {
+    bm.Add(addrs[i]);
+  }
+  return bm.Count();
+}
+
+// the runs keep no counts, the objects in a range are counted by
+// reading it
+unsigned int LsmIndex::Count(EdsKey *lo, EdsKey *hi) {
+  std::vector<NodeNbr> addrs;
+  if (lo == hi) {
+    return FindAll(lo, addrs);
+  }
+  Range(lo, hi, addrs);
+  return addrs.size();
+}
+
+unsigned int LsmIndex::Rank(EdsKey *keypointer) {
+  return Count(nullkey, keypointer) - Count(keypointer, keypointer);
+}
+
+EdsKey *LsmIndex::SeekToOffset(unsigned int n) {
+  EdsKey *ky = First();
+  for (; ky != 0 && n > 0; n--) {
+    ky = Next();
+  }
+  return ky;
+}
+
+void LsmIndex::ResetCursor() {
+  cursor.clear();
+  cursorstate = 0;
+}
+
+// return the current key
+EdsKey *LsmIndex::Current() {
+  if (cursorstate == 2) {
+    // the first key from where a search stopped
+    Entry e;
+    if (Step(cursor, true, true, e)) {
+      return Position(e);
+    }
+    ResetCursor();
+  }
+  return cursorstate == 1 ? curkey : 0;
+}
+
+// return the first key
+EdsKey *LsmIndex::First() {
+  Poll(false);
+  ResetCursor();
+  Entry e;
+  return Step(std::string(), true, true, e) ? Position(e) : 0;
+}
+
+// return the last key
+EdsKey *LsmIndex::Last() {
+  Poll(false);
+  ResetCursor();
+  Entry e;
+  return Step(std::string(), false, true, e) ? Position(e) : 0;
+}
+
+// return the next key
+EdsKey *LsmIndex::Next() {
+  if (cursorstate == 0) {
+    return First();
+  }
+  // as in a b-tree, a search that failed leaves the cursor at the
+  // key after the one searched for
+  if (cursorstate == 2 && Current() == 0) {
+    return 0;
+  }
+  Poll(false);
+  Entry e;
+  if (Step(cursor, true, false, e)) {
+    return Position(e);
+  }
+  ResetCursor();
+  return 0;
+}
+
+// return the previous key
+EdsKey *LsmIndex::Previous() {
+  if (cursorstate == 0) {
+    return Last();
+  }
+  Poll(false);
+  Entry e;
+  if (Step(cursor, false, false, e)) {
+    return Position(e);
+  }
+  ResetCursor();
+  return 0;
+}
+
+// replace the index with one holding keys sorted by value and object
+// address, as one run. The old runs and log are freed, unless reclaim
+// is false for an index that may be damaged
+void LsmIndex::Rebuild(const std::vector<EdsKey *> &sorted, bool reclaim) {
+  Poll(true);
+  ResetCursor();
+  std::vector<Entry> entries;
+  for (std::vector<EdsKey *>::size_type i = 0; i < sorted.size(); i++) {
+    sorted[i]->Normalize();
+    Entry e;
+    e.name = KeyName(sorted[i]);
+    e.deleted = false;
+    e.key = sorted[i];
+    e.keyaddr = 0;
+    entries.push_back(e);
+  }
+  if (reclaim) {
+    FreeLog(log);
+  }
+  log.head = log.tail = 0;
+  log.pos = 0;
+  for (std::vector<Run *>::size_type r = 0; r < runs.size(); r++) {
+    if (reclaim) {
+      FreeRun(runs[r]);
+    } else {
+      delete runs[r]->filter;
+      delete runs[r];
+    }
+  }
+  runs.clear();
+  ClearTable(memtable);
+  if (!entries.empty()) {
+    runs.push_back(WriteRun(entries, 1));
+  }
+  WriteManifest();
+  index.Flush();
+}
+
+unsigned int LsmIndex::Level0() const {
+  unsigned int n = 0;
+  while (n < runs.size() && runs[n]->level == 0) {
+    n++;
+  }
+  return n;
+}
+
+// start a merge on the compaction thread, of the runs of level 0 into
+// level 1 when there are enough of them, else of the first level that
+// holds too many entries into the next. The new run's nodes are taken
+// here, as many as the entries could need
+void LsmIndex::Schedule() {
+  if (job != 0 || index.ReadOnly()) {
+    return;
+  }
+  Job *jb = new Job;
+  jb->level = 0;
+  jb->output = 0;
+  unsigned int level0 = Level0();
+  if (level0 >= level0runs) {
+    jb->inputs.assign(runs.begin(), runs.begin() + level0);
+    jb->level = 1;
+  } else {
+    unsigned long long capacity = memtablekeys * level0runs;
+    unsigned int level = 1;
+    for (std::vector<Run *>::size_type r = level0; r < runs.size(); r++) {
+      for (; level < runs[r]->level; level++) {
+        capacity *= levelratio;
+      }
+      if (runs[r]->entries > capacity) {
+        jb->inputs.push_back(runs[r]);
+        jb->level = runs[r]->level + 1;
+        break;
+      }
+    }
+  }
+  if (jb->inputs.empty()) {
+    delete jb;
+    return;
+  }
+  // the run of the level merged into goes in too, the oldest
+  for (std::vector<Run *>::size_type r = 0; r < runs.size(); r++) {
+    if (runs[r]->level == jb->level) {
+      jb->inputs.push_back(runs[r]);
+    }
+  }
+  jb->bottom = runs.back()->level <= jb->level;
+
+  unsigned int bytes = 0, widest = 0;
+  for (std::vector<Run *>::size_type r = 0; r < jb->inputs.size(); r++) {
+    bytes += jb->inputs[r]->bytes;
+    widest = std::max(widest, jb->inputs[r]->widest);
+  }
+  // a node is only left for an entry that does not fit in it
+  unsigned int room = nodelength - sizeof(NodeNbr) - widest + 1;
+  for (unsigned int n = bytes / room + 1; n > 0; n--) {
+    jb->nodes.push_back(index.NewNode());
+  }
+  // the thread reads and writes aside, nothing may be held for it
+  index.Flush();
+  job = jb;
+  compacted = false;
+  compactor = std::thread(&LsmIndex::Compact, this, jb);
+}
+
+// merge the runs of a job, on the compaction thread. It reads the
+// runs and writes the new one aside, on nodes no one else uses, and
+// builds the new run's filter
+void LsmIndex::Compact(Job *jb) {
+  struct Input {
+    const Run *run;
+    unsigned int node;
+    std::vector<char> page;
+    int off;
+    int keyoff;
+    bool deleted;
+    bool done;
+    std::string name;
+  };
+  const int keylength = header.keylength;
+  try {
+    // the next entry of an input
+    auto advance = [&](Input &in) {
+      for (;;) {
+        if (ReadKeyEntry(&in.page[0], in.off, keylength, in.deleted, in.name, in.keyoff)) {
+          return;
+        }
+        if (++in.node >= in.run->nodes.size()) {
+          in.done = true;
+          return;
+        }
+        index.ReadAside(&in.page[0], nodelength, Node::NodeAddress(in.run->nodes[in.node]));
+        in.off = sizeof(NodeNbr);
+      }
+    };
+    std::vector<Input> inputs(jb->inputs.size());
+    unsigned int entries = 0;
+    for (std::vector<Input>::size_type i = 0; i < inputs.size(); i++) {
+      Input &in = inputs[i];
+      in.run = jb->inputs[i];
+      in.page.assign(nodelength, 0);
+      in.node = 0;
+      in.off = nodelength;
+      in.done = in.run->nodes.empty();
+      if (!in.done) {
+        index.ReadAside(&in.page[0], nodelength, Node::NodeAddress(in.run->nodes[0]));
+        in.off = sizeof(NodeNbr);
+        advance(in);
+      }
+      entries += in.run->entries;
+    }
+
+    Run *out = NewRun(jb->level);
+    jb->output = out;
+    out->filter->Reset(entries);
+    std::vector<char> node(nodelength, 0);
+    int used = sizeof(NodeNbr);
+    auto write = [&](NodeNbr next) {
+      NodeNbr nd = jb->nodes[out->nodes.size()];
+      memcpy(&node[0], &next, sizeof next);
+      index.WriteAside(&node[0], nodelength, Node::NodeAddress(nd));
+      out->nodes.push_back(nd);
+      std::fill(node.begin(), node.end(), 0);
+      used = sizeof(NodeNbr);
+    };
+
+    for (;;) {
+      // the lowest name, from the newest input that has it
+      int low = -1;
+      for (std::vector<Input>::size_type i = 0; i < inputs.size(); i++) {
+        if (!inputs[i].done && (low < 0 || inputs[i].name < inputs[low].name)) {
+          low = i;
+        }
+      }
+      if (low < 0) break;
+      Input &in = inputs[low];
+      std::string name = in.name;
+      if (!in.deleted || !jb->bottom) {
+        int len = KeyEntryLength(name);
+        if (used + len > nodelength) {
+          if (out->nodes.size() + 1 >= jb->nodes.size()) {
+            throw FileWriteError();
+          }
+          write(jb->nodes[out->nodes.size() + 1]);
+        }
+        if (used == sizeof(NodeNbr)) {
+          out->fences.push_back(name);
+        }
+        unsigned short nlen = name.size();
+        node[used] = in.deleted ? lostentry : keptentry;
+        memcpy(&node[used + 1], &nlen, sizeof nlen);
+        memcpy(&node[used + entryhdr], name.data(), nlen);
+        memcpy(&node[used + entryhdr + nlen], &in.page[in.keyoff], keylength);
+        used += len;
+        out->entries++;
+        out->bytes += len;
+        out->widest = std::max(out->widest, static_cast<unsigned int>(len));
+        out->filter->Add(name.substr(0, nlen - sizeof(NodeNbr)));
+      }
+      // the older entries of the name are hidden by it
+      for (std::vector<Input>::size_type i = 0; i < inputs.size(); i++) {
+        if (!inputs[i].done && inputs[i].name == name) {
+          advance(inputs[i]);
+        }
+      }
+    }
+    if (used > (int)sizeof(NodeNbr)) {
+      write(0);
+    }
+  } catch (...) {
+    jb->error = std::current_exception();
+  }
+  compacted = true;
+}
+
+// put the run of a finished merge in the place of the runs it merged,
+// waiting for it if wait is true, and start the next merge
+void LsmIndex::Poll(bool wait) {
+  if (job == 0 || (!wait && !compacted)) {
+    return;
+  }
+  compactor.join();
+  Job *jb = job;
+  job = 0;
+  Run *out = jb->output;
+  std::vector<NodeNbr>::size_type used = out != 0 && !jb->error ? out->nodes.size() : 0;
+  long end = 0;
+  for (std::vector<NodeNbr>::size_type n = 0; out != 0 && n < out->nodes.size(); n++) {
+    end = std::max(end, Node::NodeAddress(out->nodes[n]) + nodelength);
+  }
+  index.Rejoin(end);
+  for (std::vector<NodeNbr>::size_type n = used; n < jb->nodes.size(); n++) {
+    // a node the merge did not use may never have been written
+    NodeNbr next = 0;
+    index.WriteData(&next, sizeof next, Node::NodeAddress(jb->nodes[n]));
+    Node node(&index, jb->nodes[n]);
+    node.MarkNodeDeleted();
+  }
+  if (jb->error) {
+    std::exception_ptr ex = jb->error;
+    if (out != 0) {
+      delete out->filter;
+      delete out;
+    }
+    delete jb;
+    std::rethrow_exception(ex);
+  }
+
+  for (std::vector<Run *>::size_type i = 0; i < jb->inputs.size(); i++) {
+    runs.erase(std::find(runs.begin(), runs.end(), jb->inputs[i]));
+    FreeRun(jb->inputs[i]);
+  }
+  if (out->entries > 0) {
+    std::vector<Run *>::iterator at = runs.begin();
+    while (at != runs.end() && (*at)->level < out->level) {
+      ++at;
+    }
+    runs.insert(at, out);
+  } else {
+    delete out->filter;
+    delete out;
+  }
+  delete jb;
+  WriteManifest();
+  Schedule();
+}
@@ -0,0 +1,135 @@
+/*
+ * filename: lsm.h
+ * describe: This is the definition file of the log-structured merge
+ *           index class, an index for classes that are mostly added to,
+ *           used by the datastore engine - EDatastore of the open source
+ *           project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   Needs C++11 for std::thread
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#ifndef LSM_H
+#define LSM_H
+
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <string>
+#include <vector>
+
+// log-structured merge index. A key added or deleted goes into a
+// sorted table in memory, the memtable, and is appended to a log of
+// index nodes that brings the memtable back when the index is opened
+// again. A full memtable is written out as a sorted run, nodes of
+// entries in key order, and the log starts over. An entry is the key
+// image with the object's address after it, the key itself, and
+// whether the object has the key or lost it, so a deletion is an entry
+// too. The runs of level 0 are the memtables written out, each level
+// below holds one run ten times as big as the one above. When level 0
+// has four runs they are merged with level 1 on a thread of its own, a
+// level that grows too big is merged with the next, and only the
+// entry from the newest run is kept for each key and object, the
+// deletions dropped in the last level. Searches read the memtable and
+// then each run, newest first, the entries of the newer ones hiding
+// those of the older. Each run has a Bloom filter of its key images
+// and a list of the first entry of each of its nodes, so an exact
+// search reads at most one node of a run and none of most runs that do
+// not hold the key. The runs and the log are recorded in a chain of
+// index nodes as the root of the tree header, which lists a chain for
+// each run written when the run is made
+class LsmIndex : public EdsBtree {
+public:
+  LsmIndex(IndexFile &ndx, Class *cls, EdsKey *ky) throw(BadKeylength, BadIndex);
+  ~LsmIndex();
+  void Close();
+
+  bool Insert(EdsKey *keypointer);
+  void Delete(EdsKey *keypointer);
+  bool Find(EdsKey *keypointer);
+  int FindAll(EdsKey *keypointer, std::vector<NodeNbr> &addrs);
+  int FindBitmap(EdsKey *lo, EdsKey *hi, Bitmap &bm);
+  EdsKey *Current();
+  EdsKey *First();
+  EdsKey *Last();
+  EdsKey *Next();
+  EdsKey *Previous();
+  unsigned int Count(EdsKey *lo, EdsKey *hi);
+  bool CountsKept() const { return false; }
+  unsigned int Rank(EdsKey *keypointer);
+  EdsKey *SeekToOffset(unsigned int n);
+  void Rebuild(const std::vector<EdsKey *> &sorted, bool reclaim = true);
+  // true if index ino of a class is a log-structured merge index
+  static bool Kept(IndexFile &ndx, const Class *cls, IndexNo ino);
+protected:
+  void ResetCursor();
+private:
+  // a sorted run: its nodes, the first entry of each and the filter
+  struct Run {
+    unsigned int level;
+    unsigned int entries;
+    unsigned int bytes;   // of its entries
+    unsigned int widest;  // its longest entry
+    std::vector<NodeNbr> nodes;
+    std::vector<std::string> fences;
+    NodeNbr filternode;   // saved filter, 0 = not saved yet
+    NodeNbr runnode;      // its entry of the list of runs, 0 = not written yet
+    KeyFilter *filter;
+    int cached;           // the node in page, -1 = none
+    std::vector<char> page;
+  };
+  // an entry read from the memtable or a run
+  struct Entry {
+    std::string name;  // key image and object address
+    bool deleted;
+    EdsKey *key;       // in the memtable, 0 = in a run
+    long keyaddr;      // in a run, the file address of the key
+  };
+  // a merge of runs into one on the compaction thread
+  struct Job {
+    std::vector<Run *> inputs;  // newest first
+    unsigned int level;         // of the run made
+    bool bottom;                // no level below, deletions go
+    std::vector<NodeNbr> nodes; // for the run made, the unused ones freed
+    Run *output;
+    std::exception_ptr error;
+  };
+
+  LsmIndex(const LsmIndex &);
+  LsmIndex &operator=(const LsmIndex &);
+  void Put(EdsKey *keypointer, bool deleted);
+  void FlushMemtable();
+  Run *NewRun(unsigned int level);
+  Run *WriteRun(const std::vector<Entry> &entries, unsigned int level);
+  void FilterRun(Run *run);
+  void FreeRun(Run *run);
+  const char *RunNode(Run *run, unsigned int n);
+  void ReadManifest();
+  void WriteManifest();
+  void WriteRunEntry(Run *run);
+  bool Seek(Run *run, const std::string &from, bool forward, bool inclusive, Entry &entry);
+  bool Step(const std::string &from, bool forward, bool inclusive, Entry &entry,
+            const std::string *only = 0);
+  EdsKey *Position(const Entry &entry);
+  void Range(EdsKey *lo, EdsKey *hi, std::vector<NodeNbr> &addrs);
+  unsigned int Level0() const;
+  void Schedule();
+  void Compact(Job *jb);
+  void Poll(bool wait);
+private:
+  KeyTable memtable;
+  KeyLog log;              // of the memtable
+  std::vector<Run *> runs; // newest first, level 0 before level 1...
+  double fprate;           // false positive rate of the run filters
+  std::string cursor;      // entry the cursor is at
+  int cursorstate;         // 0 = none, 1 = at cursor, 2 = at the first from it
+  EdsKey *curkey;          // key of the current entry
+  Job *job;                // merge running, 0 = none
+  std::thread compactor;   // runs it
+  std::atomic<bool> compacted; // the thread is through with the job
+};
+
+#endif
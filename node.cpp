@@ -10,77 +10,429 @@
  */
 
 #include "stdafx.h"
-#include <io.h>
+#include <cerrno>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include "node.h"
 #include "edatastore.h"
+#include "shadow.h"
+#include "flusher.h"
+
+// most bytes WriteData holds before writing them
+const unsigned int maxpending = 16 * nodelength;
+
+// a shadow paged file has this header, its own is in the meta pages
+const NodeNbr shadowmark = 0xffff;
 
 // construct a node file
-NodeFile::NodeFile(const std::string &filename) throw(BadFileOpen) {
-  newfile = _access(filename.c_str(), 0) != 0;
+NodeFile::NodeFile(const std::string &filename, bool shadowpaging) throw(BadFileOpen) {
+  readonly = false;
+  shadow = 0;
+  Open(filename);
 
-  if (newfile) {
-    nfile.open(filename.c_str(), std::ios::out);
-    nfile.close();
-    nfile.open(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-    if (nfile.fail()) {
+  if (shadowpaging) {
+    shadow = new PageMap(*this);
+    if (newfile) {
+      FileHeader mark;
+      mark.deletednode = mark.highestnode = shadowmark;
+      FileWrite(&mark, sizeof mark, 0);
+      shadow->Create();
+    } else if (!shadow->Open()) {
+      CloseFile();
       throw BadFileOpen();
     }
+    header.deletednode = shadow->Current()->deletednode;
+    header.highestnode = shadow->Current()->highestnode;
+    filelength = shadow->Current()->length;
+  } else if (newfile) {
     //write the empty header
     WriteData(&header, sizeof header);
   } else {
-    nfile.open(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-    if (nfile.fail()) {
-      throw BadFileOpen();
-    }
     // an existing file, read the header
     ReadData(&header, sizeof header);
+    if (header.deletednode == shadowmark && header.highestnode == shadowmark &&
+        PageMap::Probe(*this)) {
+      // a shadow paged file
+      CloseFile();
+      throw BadFileOpen();
+    }
   }
 
   origheader = header;
 }
 
+// construct a node file that reads a version of a shadow paged file
+NodeFile::NodeFile(const std::string &filename,
+                   std::shared_ptr<const PageVersion> pin) throw(BadFileOpen) {
+  readonly = true;
+  shadow = 0;
+  if (!pin) {
+    throw BadFileOpen();
+  }
+  Open(filename);
+  if (newfile) {
+    CloseFile();
+    throw BadFileOpen();
+  }
+  shadow = new PageMap(*this, pin);
+  header.deletednode = pin->deletednode;
+  header.highestnode = pin->highestnode;
+  filelength = pin->length;
+  origheader = header;
+  // pages of the version may not be written yet
+  flusher = Flusher::Find(filename);
+}
 
-NodeFile::~NodeFile() {
-  if (header.deletednode != origheader.deletednode ||
-      header.highestnode != origheader.highestnode) {
-    // the file header has changed
-    WriteData(&header, sizeof header, 0);
+// open the file, a new one if there is none unless reading a version
+void NodeFile::Open(const std::string &filename) {
+  this->filename = filename;
+  closed = false;
+  filepos = 0;
+  pageaddr = -1;
+  pagelength = 0;
+  pendingaddr = 0;
+
+#ifdef _WIN32
+  std::ios::openmode mode = std::ios::in | std::ios::binary;
+  if (!readonly) {
+    mode |= std::ios::out;
   }
+  nfile.open(filename.c_str(), mode);
+  newfile = !nfile.is_open();
+  if (newfile && !readonly) {
+    nfile.clear();
+    nfile.open(filename.c_str(), mode | std::ios::trunc);
+  }
+  if (!nfile.is_open()) {
+    throw BadFileOpen();
+  }
+#else
+  if (readonly) {
+    fd = open(filename.c_str(), O_RDONLY);
+    newfile = false;
+  } else {
+    fd = open(filename.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    newfile = fd >= 0;
+    if (!newfile && errno == EEXIST) {
+      fd = open(filename.c_str(), O_RDWR);
+    }
+  }
+  if (fd < 0) {
+    throw BadFileOpen();
+  }
+#endif
+  filelength = 0;
+  if (!newfile) {
+#ifdef _WIN32
+    nfile.seekg(0, std::ios::end);
+    filelength = static_cast<long>(nfile.tellg());
+#else
+    filelength = static_cast<long>(lseek(fd, 0, SEEK_END));
+#endif
+  }
+}
+
+void NodeFile::CloseFile() {
+  closed = true;
+  flusher.reset();
+  delete shadow;
+  shadow = 0;
+#ifdef _WIN32
   nfile.close();
+#else
+  close(fd);
+#endif
 }
 
-void NodeFile::ReadData(void *buf, unsigned int siz,
-                        long wh) throw(FileReadError) {
-  if (wh != -1) {
-    nfile.seekg(wh);
+// write what is held and close the file, an error writing it is
+// thrown here, the destructor can only drop it
+void NodeFile::Close() throw(FileWriteError) {
+  if (closed) {
+    return;
+  }
+  try {
+    if (shadow != 0) {
+      // the header goes into the version
+      Commit();
+    } else if (header.deletednode != origheader.deletednode ||
+               header.highestnode != origheader.highestnode) {
+      // the file header has changed
+      WriteData(&header, sizeof header, 0);
+    }
+    Flush();
+    EndWriteBehind();
+  } catch (...) {
+    CloseFile();
+    throw;
+  }
+  CloseFile();
+}
+
+NodeFile::~NodeFile() {
+  try {
+    Close();
+  } catch (...) {
+    // lost, call Close to know
+  }
+}
+
+bool NodeFile::Publish() throw(FileWriteError) {
+  if (shadow == 0 || readonly) {
+    return false;
+  }
+  Flush();
+  return shadow->Publish(header.deletednode, header.highestnode, filelength);
+}
+
+void NodeFile::Commit() throw(FileWriteError) {
+  if (shadow != 0 && !readonly) {
+    Publish();
+    shadow->Commit();
+  } else if (flusher && !readonly) {
+    Flush();
+    Sync();
+  }
+}
+
+void NodeFile::WriteBehind(const FlushPolicy &policy) throw(BadFileOpen, FileWriteError) {
+  if (!readonly) {
+    Flush();
+    EndWriteBehind();
+    flusher = Flusher::Start(filename, policy);
+  }
+}
+
+// write out the queue, the file is written in place from then on
+void NodeFile::EndWriteBehind() throw(FileWriteError) {
+  if (flusher) {
+    std::shared_ptr<Flusher> fl;
+    fl.swap(flusher);
+    if (!readonly) {
+      fl->Sync();
+      fl->Stop();
+    }
+  }
+}
+
+std::shared_ptr<const PageVersion> NodeFile::Version() const {
+  return shadow != 0 ? shadow->Current() : std::shared_ptr<const PageVersion>();
+}
+
+// read up to siz bytes at file address wh, return the count read
+unsigned int NodeFile::RawRead(void *buf, unsigned int siz, long wh) {
+  return shadow != 0 ? shadow->Read(buf, siz, wh) : FileRead(buf, siz, wh);
+}
+
+// write siz bytes at file address wh
+void NodeFile::RawWrite(const void *buf, unsigned int siz,
+                        long wh) throw(FileWriteError) {
+  if (shadow != 0) {
+    shadow->Write(buf, siz, wh);
+  } else {
+    FileWrite(buf, siz, wh);
+  }
+  if (wh + (long)siz > filelength) {
+    filelength = wh + siz;
+  }
+  DropPage(wh, siz);
+}
+
+// read up to siz bytes at offset wh of the file itself, with the
+// writes queued for it
+unsigned int NodeFile::FileRead(void *buf, unsigned int siz, long wh) {
+  if (!flusher) {
+    return DiskRead(buf, siz, wh);
   }
+  for (;;) {
+    unsigned long batches = flusher->Batches();
+    unsigned int done = DiskRead(buf, siz, wh);
+    if (flusher->Overlay(buf, siz, wh, done, batches)) {
+      return done;
+    }
+  }
+}
 
+unsigned int NodeFile::DiskRead(void *buf, unsigned int siz, long wh) {
+  unsigned int done = 0;
+#ifdef _WIN32
+  std::lock_guard<std::mutex> lk(rawlock);
+  nfile.clear();
+  nfile.seekg(wh);
   nfile.read(reinterpret_cast<char *>(buf), siz);
+  done = static_cast<unsigned int>(nfile.gcount());
+  nfile.clear();
+#else
+  while (done < siz) {
+    ssize_t n = pread(fd, reinterpret_cast<char *>(buf) + done, siz - done, wh + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += n;
+  }
+#endif
+  return done;
+}
 
-  if (nfile.fail() || nfile.eof()) {
+void NodeFile::FileWrite(const void *buf, unsigned int siz,
+                         long wh) throw(FileWriteError) {
+  if (flusher) {
+    flusher->Write(buf, siz, wh);
+    return;
+  }
+#ifdef _WIN32
+  std::lock_guard<std::mutex> lk(rawlock);
+  nfile.seekp(wh);
+  nfile.write(reinterpret_cast<const char *>(buf), siz);
+  if (nfile.fail()) {
     nfile.clear();
+    throw FileWriteError();
+  }
+#else
+  unsigned int done = 0;
+  while (done < siz) {
+    ssize_t n = pwrite(fd, reinterpret_cast<const char *>(buf) + done, siz - done, wh + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) throw FileWriteError();
+    done += n;
+  }
+#endif
+}
+
+// wait for the writes to reach the disk, with write-behind by its
+// policy or, if disk is true, whatever the policy
+void NodeFile::Sync(bool disk) {
+  if (flusher) {
+    flusher->Sync(disk);
+    return;
+  }
+#ifdef _WIN32
+  std::lock_guard<std::mutex> lk(rawlock);
+  nfile.flush();
+#else
+  fsync(fd);
+#endif
+}
+
+// forget the read buffer if a write overlaps it
+void NodeFile::DropPage(long wh, unsigned int siz) {
+  if (pageaddr != -1 && wh < pageaddr + nodelength && wh + (long)siz > pageaddr) {
+    pageaddr = -1;
+  }
+}
+
+// read the node (or the file header) holding file address wh
+void NodeFile::LoadPage(long wh) throw(FileReadError) {
+  long base = 0;
+  unsigned int len = sizeof(FileHeader);
+  if (wh >= (long)sizeof(FileHeader)) {
+    base = wh - (wh - (long)sizeof(FileHeader)) % nodelength;
+    len = nodelength;
+  }
+  pagelength = RawRead(page, len, base);
+  pageaddr = base;
+  if (wh >= base + (long)pagelength) {
+    pageaddr = -1;
     throw FileReadError();
   }
-  nfile.seekp(nfile.tellg());
+}
+
+// write out the bytes held by WriteData
+void NodeFile::Flush() throw(FileWriteError) {
+  if (!pending.empty()) {
+    std::string buf;
+    buf.swap(pending);
+    RawWrite(buf.data(), buf.size(), pendingaddr);
+  }
+}
+
+void NodeFile::ReadData(void *buf, unsigned int siz,
+                        long wh) throw(FileReadError) {
+  if (wh != -1) {
+    filepos = wh;
+  }
+  Flush();
+
+  char *cp = reinterpret_cast<char *>(buf);
+  while (siz > 0) {
+    if (pageaddr == -1 || filepos < pageaddr ||
+        filepos >= pageaddr + (long)pagelength) {
+      LoadPage(filepos);
+    }
+    unsigned int len = pageaddr + pagelength - filepos;
+    if (len > siz) {
+      len = siz;
+    }
+    memcpy(cp, page + (filepos - pageaddr), len);
+    cp += len;
+    filepos += len;
+    siz -= len;
+  }
 }
 
 void NodeFile::WriteData(const void *buf, unsigned int siz,
                          long wh) throw(FileWriteError) {
   if (wh != -1) {
-    nfile.seekp(wh);
+    filepos = wh;
+  }
+  if (!pending.empty() && filepos != pendingaddr + (long)pending.size()) {
+    Flush();
+  }
+  if (pending.empty()) {
+    pendingaddr = filepos;
+  }
+  pending.append(reinterpret_cast<const char *>(buf), siz);
+  filepos += siz;
+  if (filepos > filelength) {
+    filelength = filepos;
   }
+  if (pending.size() >= maxpending) {
+    Flush();
+  }
+}
 
-  nfile.write(reinterpret_cast<const char *>(buf), siz);
+// positional read, safe for concurrent readers while no writes are held
+void NodeFile::ReadAt(void *buf, unsigned int siz,
+                      long wh) throw(FileReadError) {
+  if (!pending.empty()) {
+    Flush();
+  }
+  if (RawRead(buf, siz, wh) != siz) {
+    throw FileReadError();
+  }
+}
 
-  if (nfile.fail()) {
-    nfile.clear();
-    throw FileWriteError();
+void NodeFile::WriteAt(const void *buf, unsigned int siz,
+                       long wh) throw(FileWriteError) {
+  Flush();
+  RawWrite(buf, siz, wh);
+}
+
+void NodeFile::ReadAside(void *buf, unsigned int siz,
+                         long wh) throw(FileReadError) {
+  if (RawRead(buf, siz, wh) != siz) {
+    throw FileReadError();
+  }
+}
+
+void NodeFile::WriteAside(const void *buf, unsigned int siz,
+                          long wh) throw(FileWriteError) {
+  if (shadow != 0) {
+    shadow->Write(buf, siz, wh);
+  } else {
+    FileWrite(buf, siz, wh);
+  }
+}
+
+void NodeFile::Rejoin(long end) {
+  pageaddr = -1;
+  if (end > filelength) {
+    filelength = end;
   }
-  nfile.seekg(nfile.tellp());
 }
 
 // appropriate a new node
-NodeNbr NodeFile::NewNode() {
+NodeNbr NodeFile::NewNode() throw (FileWriteError) {
   NodeNbr newnode;
   if (header.deletednode) {
     newnode = header.deletednode;
@@ -88,6 +440,10 @@ NodeNbr NodeFile::NewNode() {
     header.deletednode = node.NextNode();
     node.SetNextNode(0);
   } else {
+    if (header.highestnode >= shadowmark - 1) {
+      // the node numbers are used up, the file can grow no more
+      throw FileWriteError();
+    }
     newnode = ++header.highestnode;
   }
 
@@ -102,10 +458,10 @@ Node::Node(NodeFile *hd, NodeNbr node) {
   owner = hd;
   if (nodenbr) {
     long nad = NodeAddress();
-    // read the header
-    try {
+    if (nad < owner->FileLength()) {
+      // read the header
       owner->ReadData(&nextnode, sizeof nextnode, nad);
-    } catch (FileReadError) {
+    } else {
       // appending a new node
       owner->WriteData(&nextnode, sizeof nextnode, nad);
     }
@@ -149,8 +505,8 @@ Node::~Node() {
 }
 
 // compute the disk address of a node
-long Node::NodeAddress() {
-  long adr = nodenbr - 1;
+long Node::NodeAddress(NodeNbr nd) {
+  long adr = nd - 1;
   adr *= nodelength;
   adr += sizeof(FileHeader);
   return adr;
@@ -14,6 +14,10 @@
 
 #include <string>
 #include <fstream>
+#include <memory>
+#ifdef _WIN32
+#include <mutex>
+#endif
 
 #pragma warning( disable : 4290 )
 
@@ -26,6 +30,11 @@ class BadFileOpen{};
 class FileReadError{};
 class FileWriteError{};
 
+class PageMap;
+struct PageVersion;
+class Flusher;
+struct FlushPolicy;
+
 // Node File Header Record
 class FileHeader  {
   NodeNbr deletednode;     // first deleted node
@@ -37,9 +46,25 @@ class FileHeader  {
 };
 
 // Node File Header Class
+// The file is read and written at explicit offsets: pread/pwrite on
+// POSIX systems, a seek before each transfer on Windows. ReadData and
+// WriteData keep their own file position for sequential access, read
+// through a one-node buffer and combine contiguous writes. ReadAt and
+// WriteAt go straight to the file and leave the file position alone,
+// so readers that use only ReadAt do not disturb each other, on
+// Windows they take turns on the stream.
+// A shadow paged file keeps its nodes through a PageMap. Publish and
+// Commit make its changes a version, and a node file opened on a
+// version reads that version alone while the file goes on changing.
+// ReadAside and WriteAside are for a thread that works on nodes of its
+// own while another goes on using the file, see LsmIndex.
+// A file with write-behind queues its writes for a Flusher thread to
+// write, its reads see the queued writes, and Sync and Commit wait for
+// them by the flush policy
 class NodeFile  {
 public:
-  NodeFile(const std::string& filename) throw (BadFileOpen);
+  NodeFile(const std::string& filename, bool shadowpaging = false) throw (BadFileOpen);
+  NodeFile(const std::string& filename, std::shared_ptr<const PageVersion> pin) throw (BadFileOpen);
   virtual ~NodeFile();
 
   void SetDeletedNode(NodeNbr node) {
@@ -54,14 +79,26 @@ public:
   NodeNbr HighestNode() const {
     return header.highestnode;
   }
-  NodeNbr NewNode();
+  NodeNbr NewNode() throw (FileWriteError);
   void ReadData(void *buf, unsigned int siz, long wh = -1) throw (FileReadError);
   void WriteData(const void *buf, unsigned int siz, long wh = -1) throw (FileWriteError);
-  void Seek(std::streampos offset, std::ios::seek_dir dir = std::ios::beg) {
-    nfile.seekg(offset,dir); nfile.seekp(offset,dir);
-  }
-  std::streampos FilePosition() {
-    return nfile.tellg();
+  void ReadAt(void *buf, unsigned int siz, long wh) throw (FileReadError);
+  void WriteAt(const void *buf, unsigned int siz, long wh) throw (FileWriteError);
+  void Flush() throw (FileWriteError);
+  // transfers that leave the read buffer, the held writes and the file
+  // length alone, safe on another thread for nodes that thread alone
+  // uses. Rejoin makes the nodes written aside up to end readable
+  void ReadAside(void *buf, unsigned int siz, long wh) throw (FileReadError);
+  void WriteAside(const void *buf, unsigned int siz, long wh) throw (FileWriteError);
+  void Rejoin(long end);
+  void Seek(long offset) {
+    filepos = offset;
+  }
+  std::streampos FilePosition() const {
+    return filepos;
+  }
+  long FileLength() const {
+    return filelength;
   }
   bool NewFile() const {
     return newfile;
@@ -69,11 +106,56 @@ public:
   void ResetNewFile() {
     newfile = false;
   }
+  bool ShadowPaging() const {
+    return shadow != 0;
+  }
+  bool ReadOnly() const {
+    return readonly;
+  }
+  // make the changes a version, true if there were any
+  bool Publish() throw (FileWriteError);
+  // and write it to disk
+  void Commit() throw (FileWriteError);
+  std::shared_ptr<const PageVersion> Version() const;
+  // write what is held and close the file, reporting errors
+  void Close() throw (FileWriteError);
+  // queue the writes for a thread of their own, or write in place again
+  void WriteBehind(const FlushPolicy &policy) throw (BadFileOpen, FileWriteError);
+  void EndWriteBehind() throw (FileWriteError);
 private:
+  void Open(const std::string &filename);
+  void CloseFile();
+  void LoadPage(long wh) throw (FileReadError);
+  void DropPage(long wh, unsigned int siz);
+  unsigned int RawRead(void *buf, unsigned int siz, long wh);
+  void RawWrite(const void *buf, unsigned int siz, long wh) throw (FileWriteError);
+  unsigned int FileRead(void *buf, unsigned int siz, long wh);
+  unsigned int DiskRead(void *buf, unsigned int siz, long wh);
+  void FileWrite(const void *buf, unsigned int siz, long wh) throw (FileWriteError);
+  void Sync(bool disk = false);
+private:
+  friend class PageMap;
   FileHeader header;
   FileHeader origheader;
+#ifdef _WIN32
   std::fstream nfile;
+  std::mutex rawlock; // one transfer at a time on nfile
+#else
+  int fd;
+#endif
   bool newfile;    // true if building new node file
+  bool readonly;   // open on a version
+  bool closed;     // by Close
+  PageMap *shadow; // page map of a shadow paged file, 0 = none
+  std::string filename;
+  std::shared_ptr<Flusher> flusher; // write-behind of the file, 0 = none
+  long filepos;    // position of ReadData and WriteData
+  long filelength; // end of the file, including pending writes
+  char page[nodelength];   // the node ReadData last read from
+  long pageaddr;           // its file address, -1 = none
+  unsigned int pagelength; // bytes of it in the file
+  std::string pending;     // WriteData bytes not written yet
+  long pendingaddr;        // file address of the pending bytes
 };
 
 // ============================
@@ -106,7 +188,10 @@ public:
   bool NodeChanged() const {
     return nodechanged;
   }
-  long NodeAddress();
+  long NodeAddress() {
+    return NodeAddress(nodenbr);
+  }
+  static long NodeAddress(NodeNbr nd);
   virtual int NodeHeaderSize() const {
     return sizeof(NodeNbr);
   }
@@ -0,0 +1,328 @@
+/*
+ * filename: parallel.cpp
+ * describe: This is the implementation file of the work-stealing thread
+ *           pool, the parallel scan of a class and the index rebuild,
+ *           used by the datastore engine - EDatastore of the open
+ *           source project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   Needs C++11 for std::thread
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#include "stdafx.h"
+#include "parallel.h"
+
+WorkPool::WorkPool(int threads) : task(0), job(0), running(0), stop(false) {
+  if (threads <= 0) {
+    threads = std::thread::hardware_concurrency();
+  }
+  if (threads <= 0) {
+    threads = 1;
+  }
+  for (int w = 0; w < threads; w++) {
+    queues.push_back(new Queue);
+  }
+  for (int w = 0; w < threads; w++) {
+    workers.push_back(std::thread(&WorkPool::Work, this, w));
+  }
+}
+
+WorkPool::~WorkPool() {
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    stop = true;
+  }
+  start.notify_all();
+  for (std::vector<std::thread>::size_type w = 0; w < workers.size(); w++) {
+    workers[w].join();
+  }
+  for (std::vector<Queue *>::size_type w = 0; w < queues.size(); w++) {
+    delete queues[w];
+  }
+}
+
+void WorkPool::Run(int count, const std::function<void(int, int)> &tk) {
+  if (count <= 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> one(runlock);
+  // deal the morsels out, neighbours to different workers
+  for (int m = 0; m < count; m++) {
+    Queue *q = queues[m % queues.size()];
+    std::lock_guard<std::mutex> lk(q->lock);
+    q->morsels.push_back(m);
+  }
+  std::unique_lock<std::mutex> lk(lock);
+  task = &tk;
+  error = std::exception_ptr();
+  running = workers.size();
+  job++;
+  start.notify_all();
+  done.wait(lk, [this] { return running == 0; });
+  task = 0;
+  if (error) {
+    std::exception_ptr ex = error;
+    error = std::exception_ptr();
+    std::rethrow_exception(ex);
+  }
+}
+
+// the next morsel for a worker: its own first, else one stolen from
+// the back of another worker's queue
+bool WorkPool::Take(int worker, int &morsel) {
+  int n = queues.size();
+  for (int i = 0; i < n; i++) {
+    Queue *q = queues[(worker + i) % n];
+    std::lock_guard<std::mutex> lk(q->lock);
+    if (!q->morsels.empty()) {
+      if (i == 0) {
+        morsel = q->morsels.front();
+        q->morsels.pop_front();
+      } else {
+        morsel = q->morsels.back();
+        q->morsels.pop_back();
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkPool::Work(int worker) {
+  unsigned long seen = 0;
+  for (;;) {
+    const std::function<void(int, int)> *tk;
+    {
+      std::unique_lock<std::mutex> lk(lock);
+      start.wait(lk, [&] { return stop || job != seen; });
+      if (stop) {
+        return;
+      }
+      seen = job;
+      tk = task;
+    }
+    int morsel;
+    while (Take(worker, morsel)) {
+      try {
+        (*tk)(worker, morsel);
+      } catch (...) {
+        std::lock_guard<std::mutex> lk(lock);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lk(lock);
+    if (--running == 0) {
+      done.notify_all();
+    }
+  }
+}
+
+// read the data file in morsels on the workers of the pool, each
+// worker into its own instance of the class
+void ParallelScan::Scan(std::vector<Serialize *> &objs,
+                        const std::function<void(int, Serialize &)> &fn) {
+  if (objs.empty()) {
+    return;
+  }
+  DataFile &df = objs[0]->edatastore->datafile;
+  // the workers read with ReadAt alone, nothing is left to write
+  df.Flush();
+  // a node handed out but not written yet is not in the file
+  NodeNbr highest = df.HighestNode();
+  while (highest > 0 && Node::NodeAddress(highest) + nodelength > df.FileLength()) {
+    highest--;
+  }
+  int nodes = morselnodes > 0 ? morselnodes : 1;
+  int count = (highest + nodes - 1) / nodes;
+  std::vector<std::vector<char> > bufs(objs.size());
+  pool.Run(count, [&](int worker, int morsel) {
+    NodeNbr first = static_cast<NodeNbr>(morsel * nodes + 1);
+    NodeNbr last = static_cast<NodeNbr>(std::min(morsel * nodes + nodes, int(highest)));
+    ReadMorsel(*objs[worker], first, last, bufs[worker], worker, fn);
+  });
+}
+
+// read the objects that start in nodes first to last into obj one at
+// a time and call fn for each
+void ParallelScan::ReadMorsel(Serialize &obj, NodeNbr first, NodeNbr last,
+                              std::vector<char> &buf, int worker,
+                              const std::function<void(int, Serialize &)> &fn) {
+  DataFile &df = obj.edatastore->datafile;
+  const int ohlength = obj.edatastore->ObjectHeaderLength();
+  const int hdrsize = sizeof(NodeNbr) + ohlength;
+  buf.resize((last - first + 1) * nodelength);
+  df.ReadAt(&buf[0], buf.size(), Node::NodeAddress(first));
+
+  char page[nodelength];
+  for (NodeNbr nd = first; nd >= first && nd <= last; nd++) {
+    const char *pg = &buf[(nd - first) * nodelength];
+    ObjectHeader oh;
+    memcpy(&oh, pg + sizeof(NodeNbr), ohlength);
+    if (oh.classid != obj.objhdr.classid || oh.ndnbr != 0) {
+      continue;
+    }
+    obj.record.clear();
+    NodeNbr nx;
+    for (;;) {
+      obj.record.append(pg + hdrsize, nodelength - hdrsize);
+      memcpy(&nx, pg, sizeof(NodeNbr));
+      if (nx == 0) break;
+      // the object goes on in another node, in the morsel or not
+      if (nx >= first && nx <= last) {
+        pg = &buf[(nx - first) * nodelength];
+      } else {
+        df.ReadAt(page, nodelength, Node::NodeAddress(nx));
+        pg = page;
+      }
+    }
+    // the object being constructed is per thread, so the workers
+    // read their objects side by side
+    obj.objectaddress = nd;
+    obj.objhdr.stamp = oh.stamp;
+    obj.recpos = 0;
+    Serialize *hold = Serialize::objconstructed;
+    try {
+      Serialize::objconstructed = &obj;
+      obj.Read();
+      Serialize::objconstructed = hold;
+      obj.record.clear();
+      fn(worker, obj);
+    } catch (...) {
+      Serialize::objconstructed = hold;
+      obj.objectaddress = 0;
+      throw;
+    }
+    obj.objectaddress = 0;
+  }
+}
+
+IndexRebuild::~IndexRebuild() {
+  if (extractor.joinable()) {
+    extractor.join();
+  }
+  Clear();
+}
+
+// take the instances of the class and start reading their keys
+void IndexRebuild::Begin(std::vector<Serialize *> &instances, bool rc) {
+  if (extractor.joinable()) {
+    extractor.join();
+  }
+  Clear();
+  objs = instances;
+  reclaim = rc;
+  objects = 0;
+  error = std::exception_ptr();
+  runs.assign(objs.size(), std::vector<std::vector<EdsKey *> >(objs[0]->indexcount));
+  sorted.assign(objs[0]->indexcount, std::vector<EdsKey *>());
+  // the reads that follow do not flush writes
+  objs[0]->edatastore->datafile.Flush();
+  extractor = std::thread(&IndexRebuild::Extract, this);
+}
+
+// read the keys of the objects, sort the run of each worker and
+// merge the runs of each index
+void IndexRebuild::Extract() {
+  try {
+    std::vector<int> counts(objs.size(), 0);
+    scan.Scan(objs, [&](int worker, Serialize &obj) {
+      counts[worker]++;
+      for (EdsKey *key = obj.keys.FirstEntry(); key != 0; key = obj.keys.NextEntry()) {
+        if (!key->isNullValue()) {
+          EdsKey *ky = key->MakeKey();
+          *ky = *key;
+          ky->fileaddr = obj.objectaddress;
+          ky->Normalize();
+          runs[worker][key->indexno].push_back(ky);
+        }
+      }
+    });
+    for (std::vector<int>::size_type w = 0; w < counts.size(); w++) {
+      objects += counts[w];
+    }
+
+    // keys in the order of their index, by value then object address
+    auto before = [](const EdsKey *a, const EdsKey *b) {
+      int cmp = a->Compare(*b);
+      return cmp < 0 || (cmp == 0 && a->fileaddr < b->fileaddr);
+    };
+    const int indexes = sorted.size();
+    pool.Run(runs.size() * indexes, [&](int, int t) {
+      std::vector<EdsKey *> &run = runs[t / indexes][t % indexes];
+      std::sort(run.begin(), run.end(), before);
+    });
+
+    pool.Run(indexes, [&](int, int i) {
+      // take the lowest of the first keys left in the runs
+      std::vector<std::vector<EdsKey *>::size_type> pos(runs.size(), 0);
+      for (;;) {
+        int low = -1;
+        for (std::vector<int>::size_type w = 0; w < runs.size(); w++) {
+          if (pos[w] < runs[w][i].size() &&
+              (low < 0 || before(runs[w][i][pos[w]], runs[low][i][pos[low]]))) {
+            low = w;
+          }
+        }
+        if (low < 0) break;
+        sorted[i].push_back(runs[low][i][pos[low]++]);
+      }
+      for (std::vector<int>::size_type w = 0; w < runs.size(); w++) {
+        runs[w][i].clear();
+      }
+    });
+  } catch (...) {
+    error = std::current_exception();
+  }
+}
+
+int IndexRebuild::Finish() {
+  if (extractor.joinable()) {
+    extractor.join();
+  }
+  if (error) {
+    std::exception_ptr ex = error;
+    error = std::exception_ptr();
+    Clear();
+    std::rethrow_exception(ex);
+  }
+  if (objs.empty()) {
+    return 0;
+  }
+  Serialize *obj = objs[0];
+  for (EdsKey *key = obj->keys.FirstEntry(); key != 0; key = obj->keys.NextEntry()) {
+    EdsBtree *bt = obj->FindIndex(key);
+    if (bt != 0) {
+      bt->Rebuild(sorted[key->indexno], reclaim);
+    }
+  }
+  int n = objects;
+  Clear();
+  return n;
+}
+
+// free the keys and the instances of the class
+void IndexRebuild::Clear() {
+  for (std::vector<int>::size_type w = 0; w < runs.size(); w++) {
+    for (std::vector<int>::size_type i = 0; i < runs[w].size(); i++) {
+      for (std::vector<int>::size_type k = 0; k < runs[w][i].size(); k++) {
+        delete runs[w][i][k];
+      }
+    }
+  }
+  runs.clear();
+  for (std::vector<int>::size_type i = 0; i < sorted.size(); i++) {
+    for (std::vector<int>::size_type k = 0; k < sorted[i].size(); k++) {
+      delete sorted[i][k];
+    }
+  }
+  sorted.clear();
+  for (std::vector<int>::size_type w = 0; w < objs.size(); w++) {
+    delete objs[w];
+  }
+  objs.clear();
+}
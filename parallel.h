@@ -0,0 +1,208 @@
+/*
+ * filename: parallel.h
+ * describe: This is the definition file of the work-stealing thread
+ *           pool, the parallel scan of a class and the index rebuild,
+ *           used by the datastore engine - EDatastore of the open
+ *           source project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   Needs C++11 for std::thread
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include "edatastore.h"
+
+// pool of worker threads. A job is split into morsels numbered from 0
+// that are dealt out to the queues of the workers in turns. A worker
+// runs the morsels at the front of its own queue and, when it has none
+// left, steals from the back of the others, so the workers finish
+// together even when some morsels take longer
+class WorkPool {
+public:
+  WorkPool(int threads = 0); // 0 = one for each hardware thread
+  ~WorkPool();
+  int Threads() const {
+    return workers.size();
+  }
+  // run task(worker, morsel) for the morsels 0 to count - 1 and wait
+  // for them all. The first exception a task throws is thrown here
+  void Run(int count, const std::function<void(int, int)> &task);
+private:
+  WorkPool(const WorkPool &) {}
+  WorkPool &operator=(const WorkPool &) {
+    return *this;
+  }
+  void Work(int worker);
+  bool Take(int worker, int &morsel);
+private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<int> morsels;
+  };
+  std::vector<std::thread> workers;
+  std::vector<Queue *> queues;  // a queue for each worker
+  std::mutex runlock;           // one job at a time
+  std::mutex lock;              // guards the members below
+  std::condition_variable start, done;
+  const std::function<void(int, int)> *task; // task of the current job
+  unsigned long job;            // number of the current job
+  int running;                  // workers still in the job
+  std::exception_ptr error;     // first exception of the job
+  bool stop;                    // true when the pool closes
+};
+
+// scan of all the objects of a class on the workers of a pool. The
+// data file is cut into morsels of consecutive nodes and each morsel
+// is read with one ReadAt. A worker reads the objects that start in
+// its morsels into an instance of the class of its own, built by the
+// default constructor on the calling thread. An instance holds one
+// object at a time, for reading only, and is empty after the scan.
+// Nothing may change the datastore while a scan runs
+class ParallelScan {
+public:
+  ParallelScan(WorkPool &wp, int nodes = 64) : pool(wp), morselnodes(nodes) {}
+
+  // call fn(worker, obj) for every object of class T
+  template <class T, class Fn>
+  void ForEach(Fn fn);
+  // the addresses of the objects of class T for which pred(obj) is
+  // true, ascending
+  template <class T, class Pred>
+  int Select(Pred pred, std::vector<ObjAddr> &addrs);
+  // fold the objects of class T into a result for each worker with
+  // acc(result, obj), then merge those with merge(result, part).
+  // empty is the result of no objects
+  template <class T, class R, class Acc, class Merge>
+  R Aggregate(const R &empty, Acc acc, Merge merge);
+private:
+  friend class IndexRebuild;
+  void Scan(std::vector<Serialize *> &objs,
+            const std::function<void(int, Serialize &)> &fn);
+  void ReadMorsel(Serialize &obj, NodeNbr first, NodeNbr last, std::vector<char> &buf,
+                  int worker, const std::function<void(int, Serialize &)> &fn);
+private:
+  WorkPool &pool;
+  int morselnodes; // nodes in a morsel
+};
+
+template <class T, class Fn>
+void ParallelScan::ForEach(Fn fn) {
+  std::vector<T *> mine;
+  std::vector<Serialize *> objs;
+  for (int w = 0; w < pool.Threads(); w++) {
+    mine.push_back(new T);
+    objs.push_back(mine.back());
+  }
+  try {
+    Scan(objs, [&](int worker, Serialize &) { fn(worker, *mine[worker]); });
+  } catch (...) {
+    for (int w = 0; w < pool.Threads(); w++) {
+      delete mine[w];
+    }
+    throw;
+  }
+  for (int w = 0; w < pool.Threads(); w++) {
+    delete mine[w];
+  }
+}
+
+template <class T, class Pred>
+int ParallelScan::Select(Pred pred, std::vector<ObjAddr> &addrs) {
+  std::vector<std::vector<ObjAddr> > found(pool.Threads());
+  ForEach<T>([&](int worker, T &obj) {
+    if (pred(obj)) {
+      found[worker].push_back(obj.ObjectAddress());
+    }
+  });
+  addrs.clear();
+  for (int w = 0; w < pool.Threads(); w++) {
+    addrs.insert(addrs.end(), found[w].begin(), found[w].end());
+  }
+  std::sort(addrs.begin(), addrs.end());
+  return addrs.size();
+}
+
+template <class T, class R, class Acc, class Merge>
+R ParallelScan::Aggregate(const R &empty, Acc acc, Merge merge) {
+  std::vector<R> parts(pool.Threads(), empty);
+  ForEach<T>([&](int worker, T &obj) { acc(parts[worker], obj); });
+  R result = empty;
+  for (int w = 0; w < pool.Threads(); w++) {
+    merge(result, parts[w]);
+  }
+  return result;
+}
+
+// rebuild of the indexes of a class from its objects in the data
+// file. Start reads the keys of every object on the workers of a pool,
+// each worker sorting its own run of keys, and merges the runs of each
+// index, all on a thread of its own. Meanwhile the old indexes serve
+// searches on the calling thread, but no object may be added, changed
+// or deleted until Finish. Finish waits for the sorted keys, builds
+// each index from them bottom up and frees the old one
+class IndexRebuild {
+public:
+  IndexRebuild(WorkPool &wp, int nodes = 64)
+      : scan(wp, nodes), pool(wp), objects(0), reclaim(true) {}
+  ~IndexRebuild();
+
+  // read and sort the keys of class T. reclaim false leaves the nodes
+  // of the old indexes unused, for indexes that may be damaged
+  template <class T>
+  void Start(bool rc = true);
+  // build the indexes, returns the number of objects indexed
+  int Finish();
+  template <class T>
+  int Run(bool rc = true) {
+    Start<T>(rc);
+    return Finish();
+  }
+private:
+  IndexRebuild(const IndexRebuild &);
+  IndexRebuild &operator=(const IndexRebuild &);
+  void Begin(std::vector<Serialize *> &instances, bool rc);
+  void Extract();
+  void Clear();
+private:
+  ParallelScan scan;
+  WorkPool &pool;
+  std::vector<Serialize *> objs; // an instance of the class for each worker
+  std::vector<std::vector<std::vector<EdsKey *> > > runs; // keys of each worker by index
+  std::vector<std::vector<EdsKey *> > sorted; // keys of each index, sorted
+  std::thread extractor;     // reads and sorts the keys
+  std::exception_ptr error;  // what stopped it, if anything
+  int objects;               // objects read
+  bool reclaim;              // free the old indexes
+};
+
+template <class T>
+void IndexRebuild::Start(bool rc) {
+  std::vector<T *> mine;
+  try {
+    for (int w = 0; w < pool.Threads(); w++) {
+      mine.push_back(new T);
+    }
+  } catch (...) {
+    for (typename std::vector<T *>::size_type w = 0; w < mine.size(); w++) {
+      delete mine[w];
+    }
+    throw;
+  }
+  std::vector<Serialize *> instances(mine.begin(), mine.end());
+  Begin(instances, rc);
+}
+
+#endif
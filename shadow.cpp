@@ -0,0 +1,336 @@
+/*
+ * filename: shadow.cpp
+ * describe: This is the implementation file of the shadow paging of a
+ *           node file, used by the datastore engine - EDatastore of the
+ *           open source project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   Needs C++11 for std::shared_ptr
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#include "stdafx.h"
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include "shadow.h"
+
+// "EDSP", the start of a meta page
+const unsigned int metamagic = 0x50534445;
+
+// the map of a writer
+PageMap::PageMap(NodeFile &nf)
+    : file(nf), readonly(false), checked(0), pages(2), durable(0), metapage(1) {}
+
+// the map of a version held by a snapshot
+PageMap::PageMap(NodeFile &nf, std::shared_ptr<const PageVersion> pin)
+    : file(nf), readonly(true), current(pin), checked(0), pages(0), durable(pin->txn),
+      metapage(0) {}
+
+// a new file: version 0 with no nodes, in meta page 1
+void PageMap::Create() {
+  std::shared_ptr<PageVersion> v(new PageVersion);
+  v->txn = 0;
+  v->deletednode = v->highestnode = 0;
+  v->length = sizeof(FileHeader);
+  v->chunks.resize(mapchunks);
+  current = v;
+  map.assign(mapchunks * mapchunk, 0);
+  changed.assign(mapchunks, false);
+  unsaved.assign(mapchunks, false);
+  chunkpages.assign(mapchunks, 0);
+  pages = 2;
+  born.assign(pages + 1, 0);
+  durable = 0;
+  metapage = 2;
+  WriteVersion();
+}
+
+// load the newer of the two versions on disk
+bool PageMap::Open() {
+  MetaPage m1, m2;
+  bool ok1 = ReadMeta(file, 1, m1);
+  bool ok2 = ReadMeta(file, 2, m2);
+  if (!ok1 && !ok2) {
+    return false;
+  }
+  metapage = (ok1 && (!ok2 || m1.txn > m2.txn)) ? 1 : 2;
+  const MetaPage &m = metapage == 1 ? m1 : m2;
+
+  std::shared_ptr<PageVersion> v(new PageVersion);
+  v->txn = m.txn;
+  v->deletednode = m.deletednode;
+  v->highestnode = m.highestnode;
+  v->length = m.length;
+  v->chunks.resize(mapchunks);
+  map.assign(mapchunks * mapchunk, 0);
+  chunkpages.assign(m.chunkpages, m.chunkpages + mapchunks);
+  pages = m.pages;
+  durable = m.txn;
+  // the pages on disk are as old as the version
+  born.assign(pages + 1, 0);
+  // the pages the version does not use are free, pages written
+  // after it and never committed among them
+  std::vector<bool> used(pages + 1, false);
+  used[1] = used[2] = true;
+  for (unsigned int c = 0; c < mapchunks; c++) {
+    if (chunkpages[c] == 0) continue;
+    if (chunkpages[c] > pages ||
+        file.FileRead(&map[c * mapchunk], nodelength, PageAddress(chunkpages[c])) != nodelength) {
+      return false;
+    }
+    used[chunkpages[c]] = true;
+    v->chunks[c].reset(new MapChunk(map.begin() + c * mapchunk, map.begin() + (c + 1) * mapchunk));
+  }
+  for (unsigned int nd = 0; nd < map.size(); nd++) {
+    if (map[nd] > pages) {
+      return false;
+    }
+    used[map[nd]] = true;
+  }
+  for (unsigned int pg = pages; pg > 2; pg--) {
+    if (!used[pg]) {
+      freepages.push_back(pg);
+    }
+  }
+  current = v;
+  changed.assign(mapchunks, false);
+  unsaved.assign(mapchunks, false);
+  return true;
+}
+
+bool PageMap::Probe(NodeFile &nf) {
+  MetaPage m;
+  return ReadMeta(nf, 1, m) || ReadMeta(nf, 2, m);
+}
+
+bool PageMap::ReadMeta(NodeFile &nf, unsigned int pg, MetaPage &meta) {
+  return nf.FileRead(&meta, sizeof meta, PageAddress(pg)) == sizeof meta &&
+         meta.magic == metamagic && meta.check == Check(meta);
+}
+
+// FNV-1a hash of a meta page up to its check
+unsigned long long PageMap::Check(const MetaPage &meta) {
+  const unsigned char *cp = reinterpret_cast<const unsigned char *>(&meta);
+  unsigned long long h = 14695981039346656037ULL;
+  for (size_t i = 0; i < offsetof(MetaPage, check); i++) {
+    h = (h ^ cp[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+// read up to siz bytes of the nodes at file address wh, return the
+// count read. The file header is in the meta page, it reads as zeros
+unsigned int PageMap::Read(void *buf, unsigned int siz, long wh) {
+  std::lock_guard<std::mutex> lk(lock);
+  char *cp = reinterpret_cast<char *>(buf);
+  unsigned int done = 0;
+  while (done < siz) {
+    long at = wh + done;
+    if (at < (long)sizeof(FileHeader)) {
+      unsigned int len = std::min<unsigned int>(siz - done, sizeof(FileHeader) - at);
+      memset(cp + done, 0, len);
+      done += len;
+      continue;
+    }
+    long rel = at - sizeof(FileHeader);
+    if (rel / nodelength >= (long)(mapchunks * mapchunk - 1)) break;
+    NodeNbr nd = static_cast<NodeNbr>(rel / nodelength + 1);
+    unsigned int off = rel % nodelength;
+    unsigned int len = std::min<unsigned int>(siz - done, nodelength - off);
+    std::map<NodeNbr, std::string>::const_iterator it = overlay.find(nd);
+    if (it != overlay.end()) {
+      memcpy(cp + done, it->second.data() + off, len);
+      done += len;
+      continue;
+    }
+    unsigned int pg = Lookup(nd);
+    if (pg == 0) break;
+    unsigned int n = file.FileRead(cp + done, len, PageAddress(pg) + off);
+    done += n;
+    if (n < len) break;
+  }
+  return done;
+}
+
+// write siz bytes of the nodes at file address wh. A node in a page
+// a version uses goes to a new page, a whole one or a copy of the old
+// one with the bytes put in
+void PageMap::Write(const void *buf, unsigned int siz, long wh) {
+  std::lock_guard<std::mutex> lk(lock);
+  const char *cp = reinterpret_cast<const char *>(buf);
+  unsigned int done = 0;
+  while (done < siz) {
+    long at = wh + done;
+    if (at < (long)sizeof(FileHeader)) {
+      done += std::min<unsigned int>(siz - done, sizeof(FileHeader) - at);
+      continue;
+    }
+    long rel = at - sizeof(FileHeader);
+    if (rel / nodelength >= (long)(mapchunks * mapchunk - 1)) throw FileWriteError();
+    NodeNbr nd = static_cast<NodeNbr>(rel / nodelength + 1);
+    unsigned int off = rel % nodelength;
+    unsigned int len = std::min<unsigned int>(siz - done, nodelength - off);
+    unsigned int pg = Lookup(nd);
+    if (readonly) {
+      // a snapshot keeps its writes to itself
+      std::map<NodeNbr, std::string>::iterator it = overlay.find(nd);
+      if (it == overlay.end()) {
+        std::string node(nodelength, '\0');
+        if (pg != 0) {
+          file.FileRead(&node[0], nodelength, PageAddress(pg));
+        }
+        it = overlay.insert(std::make_pair(nd, node)).first;
+      }
+      memcpy(&it->second[off], cp + done, len);
+    } else if (pg != 0 && fresh.count(pg)) {
+      file.FileWrite(cp + done, len, PageAddress(pg) + off);
+    } else {
+      char node[nodelength];
+      if (len < (unsigned int)nodelength) {
+        memset(node, 0, nodelength);
+        if (pg != 0) {
+          file.FileRead(node, nodelength, PageAddress(pg));
+        }
+      }
+      memcpy(node + off, cp + done, len);
+      unsigned int np = Allocate();
+      file.FileWrite(node, nodelength, PageAddress(np));
+      map[nd] = np;
+      born[np] = current->txn + 1;
+      fresh.insert(np);
+      changed[nd / mapchunk] = true;
+      unsaved[nd / mapchunk] = true;
+      if (pg != 0) {
+        replaced.push_back(pg);
+      }
+    }
+    done += len;
+  }
+}
+
+// make the nodes written so far a new version, false if none changed
+bool PageMap::Publish(NodeNbr deletednode, NodeNbr highestnode, long length) {
+  std::lock_guard<std::mutex> lk(lock);
+  if (readonly || (fresh.empty() && current->deletednode == deletednode &&
+                   current->highestnode == highestnode && current->length == length)) {
+    return false;
+  }
+  std::shared_ptr<PageVersion> v(new PageVersion(*current));
+  v->txn = current->txn + 1;
+  v->deletednode = deletednode;
+  v->highestnode = highestnode;
+  v->length = length;
+  for (unsigned int c = 0; c < mapchunks; c++) {
+    if (changed[c]) {
+      v->chunks[c].reset(new MapChunk(map.begin() + c * mapchunk, map.begin() + (c + 1) * mapchunk));
+    }
+  }
+  older.push_back(current);
+  current = v;
+  for (std::vector<unsigned int>::size_type i = 0; i < replaced.size(); i++) {
+    Retired r;
+    r.page = replaced[i];
+    r.born = born[r.page];
+    r.died = v->txn;
+    retired.push_back(r);
+  }
+  replaced.clear();
+  fresh.clear();
+  changed.assign(mapchunks, false);
+  Recycle(false);
+  return true;
+}
+
+void PageMap::Commit() {
+  std::lock_guard<std::mutex> lk(lock);
+  if (!readonly && durable != current->txn) {
+    WriteVersion();
+  }
+}
+
+// write the newest version to disk: the chunks of the map that
+// changed, then the meta page. The file is synced before and after
+// the meta page, so the version it names is whole on disk
+void PageMap::WriteVersion() {
+  std::vector<unsigned int> oldchunks;
+  for (unsigned int c = 0; c < mapchunks; c++) {
+    if (unsaved[c]) {
+      unsigned int pg = Allocate();
+      file.FileWrite(&(*current->chunks[c])[0], nodelength, PageAddress(pg));
+      if (chunkpages[c] != 0) {
+        oldchunks.push_back(chunkpages[c]);
+      }
+      chunkpages[c] = pg;
+    }
+  }
+  file.Sync(true);
+
+  MetaPage m;
+  memset(&m, 0, sizeof m);
+  m.magic = metamagic;
+  m.txn = current->txn;
+  m.deletednode = current->deletednode;
+  m.highestnode = current->highestnode;
+  m.length = current->length;
+  m.pages = pages;
+  std::copy(chunkpages.begin(), chunkpages.end(), m.chunkpages);
+  m.check = Check(m);
+  char node[nodelength];
+  memset(node, 0, nodelength);
+  memcpy(node, &m, sizeof m);
+  metapage = 3 - metapage;
+  file.FileWrite(node, nodelength, PageAddress(metapage));
+  file.Sync(true);
+
+  durable = current->txn;
+  unsaved.assign(mapchunks, false);
+  // the chunks of the version before are for nobody to read
+  freepages.insert(freepages.end(), oldchunks.begin(), oldchunks.end());
+  Recycle(true);
+}
+
+// a page to write a node or a chunk to
+unsigned int PageMap::Allocate() {
+  if (freepages.empty()) {
+    born.push_back(0);
+    return ++pages;
+  }
+  unsigned int pg = freepages.back();
+  freepages.pop_back();
+  return pg;
+}
+
+// free the pages that no version still held uses, nor the one on
+// disk. Only the pages retired since the last time are looked at,
+// unless a version was let go or all is true
+void PageMap::Recycle(bool all) {
+  std::vector<unsigned int> held;
+  std::deque<std::shared_ptr<const PageVersion> >::iterator it = older.begin();
+  while (it != older.end()) {
+    if (it->use_count() == 1) {
+      it = older.erase(it);
+      all = true;
+    } else {
+      held.push_back((*it)->txn);
+      ++it;
+    }
+  }
+  held.insert(std::upper_bound(held.begin(), held.end(), durable), durable);
+
+  std::vector<Retired>::size_type keep = all ? 0 : checked;
+  for (std::vector<Retired>::size_type i = keep; i < retired.size(); i++) {
+    // the first version held from the one the page is new in
+    std::vector<unsigned int>::iterator h =
+        std::lower_bound(held.begin(), held.end(), retired[i].born);
+    if (h == held.end() || *h >= retired[i].died) {
+      freepages.push_back(retired[i].page);
+    } else {
+      retired[keep++] = retired[i];
+    }
+  }
+  retired.resize(keep);
+  checked = keep;
+}
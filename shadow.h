@@ -0,0 +1,143 @@
+/*
+ * filename: shadow.h
+ * describe: This is the definition file of the shadow paging of a node
+ *           file, the versions of its pages and the snapshots of a
+ *           datastore, used by the datastore engine - EDatastore of the
+ *           open source project EDS (Embedded Data Store)
+ * Author:   Jerry Sun <jerysun0818@gmail.com>
+ * Date:     October 18, 2026
+ * Remark:   Needs C++11 for std::shared_ptr
+ * Linkedin: http://nl.linkedin.com/in/jerysun
+ * Website:  https://sites.google.com/site/geekssmallworld
+ * Github:   https://github.com/jerysun/
+ */
+
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <mutex>
+#include <string>
+#include "node.h"
+
+// nodes in a chunk of the page map, one page of the file holds a chunk
+const unsigned int mapchunk = nodelength / sizeof(unsigned int);
+const unsigned int mapchunks = 65536 / mapchunk;
+
+typedef std::vector<unsigned int> MapChunk;
+
+// one version of the pages of a shadow paged file: the file header
+// and the page that holds each node. A version never changes, the
+// chunks of the map that did not change are shared with the version
+// before it
+struct PageVersion {
+  unsigned int txn;    // number of the version
+  NodeNbr deletednode; // its file header
+  NodeNbr highestnode;
+  long length;         // end of its nodes
+  std::vector<std::shared_ptr<const MapChunk> > chunks; // 0 = no nodes
+  unsigned int Page(NodeNbr nd) const {
+    const MapChunk *ck = chunks[nd / mapchunk].get();
+    return ck != 0 ? (*ck)[nd % mapchunk] : 0;
+  }
+};
+
+// the versions of the two files of a datastore, taken together, for a
+// datastore on another thread to read
+struct Snapshot {
+  std::string name;
+  std::shared_ptr<const PageVersion> data, index;
+  // the commit stamp of the newest objects it holds
+  unsigned int Stamp() const {
+    return data ? data->txn : 0;
+  }
+};
+
+// shadow paging of a node file, in the manner of LMDB. A node is kept
+// in a page of the file found through a map, and a node changed since
+// the last version is written to a page no version uses, so the pages
+// of the versions stay as they were. Publish makes the changes a new
+// version, Commit also writes the chunks of the map that changed and
+// then the older of the two meta pages at the front of the file, the
+// one write that swaps the version on disk. A page a version no longer
+// uses is freed when no snapshot holds a version that uses it and the
+// version on disk does not use it. A map over a version held by a snapshot reads
+// only its pages, and keeps what is written in memory.
+// A page is kept only for the versions from the one it was written in
+// to the one that replaced it, so a snapshot held for long keeps the
+// pages of its own version and not those of every version after it.
+// Each transfer holds a lock on the map, so one thread may write nodes
+// aside while another uses the file
+class PageMap {
+public:
+  PageMap(NodeFile &nf);
+  PageMap(NodeFile &nf, std::shared_ptr<const PageVersion> pin);
+
+  // start a new file, or load the newest version on disk, false if
+  // the file holds none
+  void Create();
+  bool Open();
+  // true if the file holds a version
+  static bool Probe(NodeFile &nf);
+  unsigned int Read(void *buf, unsigned int siz, long wh);
+  void Write(const void *buf, unsigned int siz, long wh);
+  bool Publish(NodeNbr deletednode, NodeNbr highestnode, long length);
+  void Commit();
+  std::shared_ptr<const PageVersion> Current() const {
+    return current;
+  }
+private:
+  struct MetaPage {
+    unsigned int magic;
+    unsigned int txn;
+    NodeNbr deletednode;
+    NodeNbr highestnode;
+    unsigned int length;
+    unsigned int pages;                // pages in the file
+    unsigned int chunkpages[mapchunks]; // page of each chunk of the map
+    unsigned long long check;
+  };
+  static long PageAddress(unsigned int pg) {
+    return static_cast<long>(pg - 1) * nodelength + sizeof(FileHeader);
+  }
+  unsigned int Lookup(NodeNbr nd) const {
+    return readonly ? current->Page(nd) : map[nd];
+  }
+  void WriteVersion();
+  unsigned int Allocate();
+  void Recycle(bool all);
+  static bool ReadMeta(NodeFile &nf, unsigned int pg, MetaPage &meta);
+  static unsigned long long Check(const MetaPage &meta);
+private:
+  // a page the versions from born to died - 1 used
+  struct Retired {
+    unsigned int page;
+    unsigned int born;
+    unsigned int died;
+  };
+  NodeFile &file;
+  bool readonly;
+  std::shared_ptr<const PageVersion> current; // newest version
+  std::deque<std::shared_ptr<const PageVersion> > older; // maybe still held
+  std::vector<unsigned int> map;       // page of each node, for the writer
+  std::vector<bool> changed;           // chunks changed since Publish
+  std::vector<bool> unsaved;           // chunks changed since Commit
+  std::vector<unsigned int> chunkpages; // pages of the chunks on disk
+  std::set<unsigned int> fresh;        // pages written since Publish
+  std::vector<unsigned int> replaced;  // pages they took the place of
+  std::vector<unsigned int> born;      // version each page is new in
+  std::vector<Retired> retired;        // pages waiting to be free
+  std::vector<Retired>::size_type checked; // of them, seen by Recycle
+  std::vector<unsigned int> freepages; // pages to write to
+  unsigned int pages;                  // pages in the file
+  unsigned int durable;                // version on disk
+  unsigned int metapage;               // its meta page, 1 or 2
+  std::map<NodeNbr, std::string> overlay; // nodes a reader wrote
+  std::mutex lock;                     // one transfer at a time
+};
+
+#endif
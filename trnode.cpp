@@ -20,20 +20,20 @@ TRNode::TRNode(EdsBtree *bt, NodeNbr nd) : Node(&(bt->GetIndexFile()), nd) {
   IndexFile &nx = btree->GetIndexFile();
   long nad = NodeAddress() + Node::NodeHeaderSize();
 
-  // read the header
-  try {
-    nx.ReadData(&header, sizeof(TRNodeHeader), nad);
-  } catch (FileReadError) {
+  if (nad + (long)sizeof(TRNodeHeader) > nx.FileLength()) {
     // appending a new node
     nx.WriteData(&header, sizeof(TRNodeHeader), nad);
     return;
   }
+  // read the header
+  nx.ReadData(&header, sizeof(TRNodeHeader), nad);
 
   // reading an existing node, read the keys
   for (int i = 0; i < header.keycount; i++) {
     // get memory for and read a key
     EdsKey *thiskey = btree->MakeKeyBuffer();
     thiskey->ReadKey(nx);
+    thiskey->Normalize();
 
     // read the key's file address
     NodeNbr fa;
@@ -44,6 +44,14 @@ TRNode::TRNode(EdsBtree *bt, NodeNbr nd) : Node(&(bt->GetIndexFile()), nd) {
       NodeNbr lnode;
       nx.ReadData(&lnode, sizeof(NodeNbr));
       thiskey->lowernode = lnode;
+      nx.ReadData(&thiskey->lowercount, sizeof(unsigned int));
+    }
+    if (btree->Indexno() != 0) {
+      // read the key's posting list node and count of objects
+      NodeNbr pnode;
+      nx.ReadData(&pnode, sizeof(NodeNbr));
+      thiskey->postings = pnode;
+      nx.ReadData(&thiskey->objects, sizeof(unsigned int));
     }
     keys.AppendEntry(thiskey);
   }
@@ -61,6 +69,13 @@ void TRNode::WriteBtreeKey(EdsKey *thiskey) {
     // write the lower node pointer for non-leaf keys
     NodeNbr lnode = thiskey->lowernode;
     nx.WriteData(&lnode, sizeof(NodeNbr));
+    nx.WriteData(&thiskey->lowercount, sizeof(unsigned int));
+  }
+  if (btree->Indexno() != 0) {
+    // write the posting list node and count of objects for secondary keys
+    NodeNbr pnode = thiskey->postings;
+    nx.WriteData(&pnode, sizeof(NodeNbr));
+    nx.WriteData(&thiskey->objects, sizeof(unsigned int));
   }
 }
 
@@ -88,8 +103,7 @@ TRNode::~TRNode() {
 
     if (nodechanged) {
       // pad the node
-      int keyspace = header.keycount * (btree->GetKeyLength() + sizeof(NodeNbr) +
-                           (header.isleaf ? 0 : sizeof(NodeNbr)));
+      int keyspace = header.keycount * btree->EntryLength(header.isleaf);
       int residual = nodedatalength - keyspace - sizeof(TRNodeHeader);
       char *fill = new char[residual];
       memset(fill, 0, residual);
@@ -128,28 +142,19 @@ TRNode &TRNode::operator=(TRNode &trnode) {
 
 // compute m value of node
 int TRNode::m() {
-  int keyspace = nodelength - NodeHeaderSize();
-  int keylen = btree->GetKeyLength();
-  if (!header.isleaf) {
-    keylen += sizeof(NodeNbr);
-  }
-  return keyspace / keylen;
+  return header.isleaf ? btree->LeafFanout() : btree->InnerFanout();
 }
 
 // search a node for a match on a key
 bool TRNode::SearchNode(EdsKey *keyvalue) {
   currkey = keys.FirstEntry();
   while (currkey != 0) {
-    if (*currkey > *keyvalue) break;
-    if (*currkey == *keyvalue) {
-      if (keyvalue->indexno == 0)
-        return true;
-      if (currkey->fileaddr == keyvalue->fileaddr)
-        return true;
-      if (keyvalue->fileaddr == 0)
-        return true;
-      if (currkey->fileaddr > keyvalue->fileaddr)
-        break;
+    int cmp = currkey->Compare(*keyvalue);
+    if (cmp > 0) break;
+    if (cmp == 0) {
+      // a key is in the tree once, the objects
+      // of a secondary key are in its posting list
+      return true;
     }
     currkey = keys.NextEntry();
   }
@@ -172,33 +177,18 @@ void TRNode::Insert(EdsKey *keyvalue) {
   currkey = ky;
 }
 
-// a node "adopts" all its children by telling
-//      them to point to it as their parent
-void TRNode::Adoption() {
-  Adopt(header.lowernode);
-  EdsKey *thiskey = keys.FirstEntry();
-  for (int i = 0; i < header.keycount; i++) {
-    Adopt(thiskey->lowernode);
-    thiskey = keys.NextEntry();
-  }
-}
-
-// adopt a child node
-void TRNode::Adopt(NodeNbr node) {
-  if (node) {
-    TRNode nd(btree, node);
-    nd.header.parent = nodenbr;
-    nd.nodechanged = true;
-  }
+// position currkey to the key that separates two adjacent
+// nodes, false if they are not both children of this node
+bool TRNode::FindSeparator(EdsKey *leftkey, NodeNbr right) {
+  SearchNode(leftkey);
+  return currkey != 0 && currkey->lowernode == right;
 }
 
 // redistribute keys among two sibling nodes
-bool TRNode::Redistribute(NodeNbr sib) {
-  if (sib == 0) return false;
+bool TRNode::Redistribute(NodeNbr sib, NodeNbr par) {
+  if (sib == 0 || par == 0) return false;
 
   TRNode sibling(btree, sib);
-  if (sibling.header.parent != header.parent) return false;
-
   int totkeys = header.keycount + sibling.header.keycount;
   if (totkeys >= m() * 2) return false;
 
@@ -220,9 +210,12 @@ bool TRNode::Redistribute(NodeNbr sib) {
   // compute number of keys to be in right node
   int rightct = (left->header.keycount + right->header.keycount) - leftct;
   // get the parent
-  TRNode parent(btree, left->header.parent);
+  TRNode parent(btree, par);
   // position parent's currkey to one that points to siblings
-  parent.SearchNode(left->keys.FirstEntry());
+  if (!parent.FindSeparator(left->keys.FirstEntry(), right->nodenbr)) {
+    // the nodes are cousins, they have different parents
+    return false;
+  }
   // will move keys from left to right or right to left depending on which
   // node has the greater number of keys to start with.
   if (left->header.keycount < right->header.keycount) {
@@ -238,6 +231,7 @@ bool TRNode::Redistribute(NodeNbr sib) {
 
     if (!left->header.isleaf) {
       left->currkey->lowernode = right->header.lowernode;
+      left->currkey->lowercount = right->header.lowercount;
     }
 
     // point to the keys to move (at front of right node)
@@ -253,15 +247,14 @@ bool TRNode::Redistribute(NodeNbr sib) {
     // move separating key from right node to parent
     right->keys.RemoveEntry(movekey);
     parent.keys.InsertEntry(movekey, parent.currkey);
-    if (!right->header.isleaf)
+    if (!right->header.isleaf) {
       right->header.lowernode = movekey->lowernode;
+      right->header.lowercount = movekey->lowercount;
+    }
 
     movekey->lowernode = right->nodenbr;
     right->header.keycount = rightct;
     left->header.keycount = leftct;
-    if (!left->header.isleaf) {
-      left->Adoption();
-    }
   } else {
     // moving from left to right
     int mvkeys = left->header.keycount - leftct - 1;
@@ -274,6 +267,7 @@ bool TRNode::Redistribute(NodeNbr sib) {
     right->keys.InsertEntry(right->currkey, right->keys.FirstEntry());
     if (!right->header.isleaf) {
       right->currkey->lowernode = right->header.lowernode;
+      right->currkey->lowercount = right->header.lowercount;
     }
 
     // locate the first key to move in the left node
@@ -285,6 +279,7 @@ bool TRNode::Redistribute(NodeNbr sib) {
     parent.keys.InsertEntry(movekey, parent.currkey);
 
     right->header.lowernode = movekey->lowernode;
+    right->header.lowercount = movekey->lowercount;
     movekey->lowernode = right->nodenbr;
     movekey = nkey;
     // move keys from the left node to the right node
@@ -298,18 +293,26 @@ bool TRNode::Redistribute(NodeNbr sib) {
 
     right->header.keycount = rightct;
     left->header.keycount = leftct;
-    if (!right->header.isleaf) {
-      right->Adoption();
-    }
   }
+  // the parent's counts of the objects under the two nodes
+  parent.SetLowerCount(left->nodenbr, left->Total());
+  parent.SetLowerCount(right->nodenbr, right->Total());
   nodechanged = sibling.nodechanged = parent.nodechanged = true;
   return true;
 }
 
 // implode the keys of two sibling nodes
-bool TRNode::Implode(TRNode &right) {
+// par is set to 0 when the imploded node becomes the root
+bool TRNode::Implode(TRNode &right, NodeNbr &par) {
   int totkeys = right.header.keycount + header.keycount;
-  if (totkeys >= m() || right.header.parent != header.parent) {
+  if (totkeys >= m() || par == 0) {
+    return false;
+  }
+
+  // get the parent of the imploding nodes
+  TRNode parent(btree, par);
+  // position parent's currkey to key that points to siblings
+  if (!parent.FindSeparator(keys.FirstEntry(), right.nodenbr)) {
     return false;
   }
 
@@ -317,19 +320,16 @@ bool TRNode::Implode(TRNode &right) {
   header.rightsibling = right.header.rightsibling;
   header.keycount += right.header.keycount + 1;
   right.header.keycount = 0;
-  // get the parent of the imploding nodes
-  TRNode parent(btree, header.parent);
   parent.nodechanged = true;
-  // position parent's currkey to key that points to siblings
-  parent.SearchNode(keys.FirstEntry());
   // move the parent's key to the left sibling
-  parent.keys.RemoveEntry(currkey);
+  parent.keys.RemoveEntry(parent.currkey);
   keys.AppendEntry(parent.currkey);
   parent.currkey->lowernode = right.header.lowernode;
+  parent.currkey->lowercount = right.header.lowercount;
   parent.header.keycount--;
   if (parent.header.keycount == 0) {
-    // combined the last two leaf nodes into a new root
-    header.parent = 0;
+    // combined the last two children of the root into a new root
+    par = 0;
   }
 
   // move the keys from the right sibling into the left
@@ -341,12 +341,41 @@ bool TRNode::Implode(TRNode &right) {
     movekey = nkey;
   }
 
+  parent.SetLowerCount(GetNodeNbr(), Total());
+
   if (header.rightsibling) {
     // - point right sibling of old right to imploded node
     TRNode farright(btree, header.rightsibling);
     farright.header.leftsibling = GetNodeNbr();
     farright.nodechanged = true;
   }
-  Adoption();
   return true;
 }
+
+// count the objects in the subtree of this node
+unsigned int TRNode::Total() {
+  unsigned int total = 0;
+  if (!header.isleaf) {
+    total = header.lowercount;
+  }
+  for (EdsKey *ky = keys.FirstEntry(); ky != 0; ky = keys.NextEntry()) {
+    total += ky->objects;
+    if (!header.isleaf) {
+      total += ky->lowercount;
+    }
+  }
+  return total;
+}
+
+// set the count of objects under a lower node of this node
+void TRNode::SetLowerCount(NodeNbr nd, unsigned int count) {
+  if (header.lowernode == nd) {
+    header.lowercount = count;
+  }
+  for (EdsKey *ky = keys.FirstEntry(); ky != 0; ky = keys.NextEntry()) {
+    if (ky->lowernode == nd) {
+      ky->lowercount = count;
+    }
+  }
+  nodechanged = true;
+}